@@ -18,14 +18,15 @@
 
 	Contact: freespace@gmail.com
 */
+#ifdef ARDUINO
 #include "SdFatUtil.h"
+#endif
 #include "SDHash.h"
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+#include "utility/SDHashCrc.h"
+#endif
 
-// disable this if you don't want the logging feature which provides
-// some speed ups when creating and deleting files, and also
-// makes the code a *little* smaller
-#define LOGGING_ENABLED
-///#define SERIAL_DEBUG
+// feature selection lives in SDHashConfig.h
 
 #ifdef SERIAL_DEBUG
 #define Serial_print(x,args...) Serial.print(x, ## args)
@@ -44,36 +45,278 @@
 #define STEP(f) (f%2?1:-1)
 
 #define kSDHashLogFilename "__LOG"
-#define kSDHashLogFilenameHash 0x00428ef4
+// v1 tables have always used this handle for __LOG, newer ones hash the name
+#define kSDHashLogFilenameHashV1 0x00428ef4
+#ifdef SDHASH_WIDE_HANDLES
+#define kSDHashLogFilenameHash filehandle((uint8_t*)kSDHashLogFilename, sizeof kSDHashLogFilename - 1)
+#else
+#define kSDHashLogFilenameHash (hashFunction() == kSDHashFNV1a?kSDHashLogFilenameHashV1:filehandle((uint8_t*)kSDHashLogFilename, sizeof kSDHashLogFilename - 1))
+#endif
 #define kSDHashHiddenFilenamePrefix "__"
 #define kSDHashHiddenFilenamePrefixLen 2
 
 static const uint8_t kSDHashMagic[5] = {0xae, 'h', 'a', 's', 'h'};
+static const uint8_t kSDHashPartitionMagic[5] = {0xae, 'h', 'p', 'r', 't'};
+// first block + block count
+#define kSDHashPartitionEntrySize (sizeof(SDHAddress) + sizeof(SDHBucketCount))
+// magic + 1 byte of partition count + entries
+#define kSDHashPartitionDirSize (sizeof kSDHashPartitionMagic + 1 + SDHASH_MAX_PARTITIONS*kSDHashPartitionEntrySize)
+// newest version of the hashtable spec we understand
+#define kSDHashVersion 4
+// tables holding checked segments, which are otherwise the same as v3
+#define kSDHashVersionChecked 4
 // magic + 1 byte of version +  bytes of bucket count
-#define kSDHashHeaderSize (sizeof kSDHashMagic + 1 + sizeof(SDHBucketCount))
+#define kSDHashHeaderSizeV1 (sizeof kSDHashMagic + 1 + sizeof(SDHBucketCount))
+// v1 header + hash function
+#define kSDHashHeaderSizeV2 (kSDHashHeaderSizeV1 + 1)
+// v2 header + table flags
+#define kSDHashHeaderSize (kSDHashHeaderSizeV2 + 1)
+// v3 header + segment 0 address of the file whose count is pending + the
+// version of the table without the pending count
+#define kSDHashHeaderSizePending (kSDHashHeaderSize + sizeof(SDHAddress) + 1)
+// pending header + log2 of the allocation unit, tables with local segments
+#define kSDHashHeaderSizeLocal (kSDHashHeaderSizePending + 1)
+// local header + rate + read, write and multiple write ticks per block,
+// tables with a tuned rate
+#define kSDHashHeaderSizeTuned (kSDHashHeaderSizeLocal + 1 + 3*sizeof(uint16_t))
+// tuned header + generation + buckets before growing + next old bucket to
+// look at + segment 0 address a file is moving from and to, grown tables
+#define kSDHashHeaderSizeGrown (kSDHashHeaderSizeTuned + 1 + sizeof(SDHBucketCount) + 3*sizeof(SDHAddress))
+
+// blocks past the end of tables with a tuned rate, for trying rates on
+#define kSDHashScratchBlocks 8
+// setSckRate rates go from 0, the fastest, to this
+#define kSDHashSlowestSckRate 6
+
+// table flags that change the on card format, and so have to match how
+// the library was compiled
+#ifdef SDHASH_WIDE_HANDLES
+#define kSDHashRequiredTableFlags kSDHashTableWideHandles
+#else
+#define kSDHashRequiredTableFlags 0
+#endif
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+#if SDHASH_ROTATE_SEGMENT_COUNT < 2 || SDHASH_ROTATE_SEGMENT_COUNT > 8
+#error SDHASH_ROTATE_SEGMENT_COUNT has to be between 2 and 8
+#endif
+#define kSDHashRotateTableFlags kSDHashTableRotatedCounts
+#else
+#define kSDHashRotateTableFlags 0
+#endif
+#ifdef SDHASH_LOCAL_SEGMENTS
+#define kSDHashLocalTableFlags kSDHashTableLocalSegments
+#else
+#define kSDHashLocalTableFlags 0
+#endif
+// tables with a tuned rate can be used without it, they are only smaller
+#ifdef SDHASH_AUTO_SCK_RATE
+#define kSDHashTunedTableFlags kSDHashTableTunedRate
+#else
+#define kSDHashTunedTableFlags 0
+#endif
+// only the filter relies on hidden files being logged, and the filter
+// needs the log
+#if defined(SDHASH_BLOOM_FILTER_BITS) && defined(LOGGING_ENABLED)
+#define kSDHashBloomTableFlags kSDHashTableLoggedCreates
+#else
+#define kSDHashBloomTableFlags 0
+#endif
+#ifdef SDHASH_BLOOM_FILTER_BITS
+#if SDHASH_BLOOM_FILTER_BITS < 8 || SDHASH_BLOOM_FILTER_BITS > 65536
+#error SDHASH_BLOOM_FILTER_BITS has to be between 8 and 65536
+#endif
+// indices each filehandle sets in the filter
+#define kSDHashBloomHashes 3
+#endif
+#ifdef SDHASH_ONLINE_GROWTH
+#define kSDHashGrowTableFlags kSDHashTableGrown
+#else
+#define kSDHashGrowTableFlags 0
+#endif
+#define kSDHashKnownTableFlags (kSDHashTableWideHandles | kSDHashTableSegmentTags | kSDHashTablePendingCount | kSDHashRotateTableFlags | kSDHashLocalTableFlags | kSDHashTableTunedRate | kSDHashBloomTableFlags | kSDHashGrowTableFlags)
+// flags of tables created by begin()
+#ifdef SDHASH_NO_SEGMENT_TAGS
+#define kSDHashNewTableFlags (kSDHashRequiredTableFlags | kSDHashRotateTableFlags | kSDHashLocalTableFlags | kSDHashTunedTableFlags | kSDHashBloomTableFlags)
+#else
+#define kSDHashNewTableFlags (kSDHashRequiredTableFlags | kSDHashTableSegmentTags | kSDHashRotateTableFlags | kSDHashLocalTableFlags | kSDHashTunedTableFlags | kSDHashBloomTableFlags)
+#endif
 
 #define kSDHashMaxFilenameLength (23)
+// most segments a file can have, including segment 0
+#define kSDHashMaxSegments 0xffffUL
+
+#ifdef SDHASH_NAME_INDEX
+#ifndef LOGGING_ENABLED
+#error "SDHASH_NAME_INDEX needs LOGGING_ENABLED"
+#endif
+#ifdef SDHASH_NO_SEGMENT_TAGS
+#error "SDHASH_NAME_INDEX needs segment tags"
+#endif
+#define kSDHashIndexFilename "__IDX"
+#define kSDHashIndexFilenameHash filehandle((uint8_t*)kSDHashIndexFilename, sizeof kSDHashIndexFilename - 1)
+// segment 1 of the index holds the __LOG segment count the index is up to
+// date with, the number of the root page and of pages in use, the others
+// are tree pages
+#define kSDHashIndexMetaPage 1
+#define kSDHashIndexMetaSize (3 * sizeof(SDHSegmentCount))
+// pages start with their level, 0 for leaves, and the next leaf, or the
+// first child of inner pages
+#define kSDHashIndexPageHeader (1 + sizeof(SDHSegmentCount))
+#define kSDHashIndexMaxRecord (1 + kSDHashMaxFilenameLength + sizeof(SDHAddress))
+#define kSDHashIndexMaxDepth 8
+// pages fill their segment up to its checksum, the index being tagged
+// they share it with the segment number
+#define kSDHashIndexPageSize (kSDHashSegmentFillSize-kSDHashSegmentNumberSize)
+#endif
+
+// keys _truncateChain remembers to replay the keys of its batches from
+#define kSDHashTruncateMarks 16
+
+// segment lengths fit into 9 bits, the upper 7 bits of the length field
+// tag the segment with its number in tables that have segment tags
+#define kSDHashSegmentLengthMask 0x01ff
+#define kSDHashSegmentTagShift 9
+#define kSDHashSegmentTagModulus 127
+// tags repeat every 127 segments, so tagged segments follow their
+// metadata with their full number, which is what tells them apart
+#define kSDHashSegmentNumberSize sizeof(SDHSegmentCount)
+
 // type + hash + segment count
 #define kSDHashSegment0MetaHeaderSize (1 + sizeof(SDHFilehandle) + sizeof(SDHSegmentCount))
 
 // header + filename + 1 padding
 #define kSDHashSegment0MetaSize (kSDHashSegment0MetaHeaderSize + kSDHashMaxFilenameLength + 1)
 
+// file flags follow the filename padding, and are 0x00 in segment 0s
+// written before they existed
+#define kSDHashSegment0FlagsOffset kSDHashSegment0MetaSize
+
+// per file type data follows the flags
+#define kSDHashSegment0ExtOffset (kSDHashSegment0FlagsOffset + 1)
+
+// extent address + extent block count + blocks used
+#define kSDHashStreamExtSize (sizeof(SDHAddress) + 2*sizeof(SDHBucketCount))
+
+// files that aren't stream files use the ext for rotating their segment
+// count: rewrites of segment 0 + sequence number of the count in segment
+// 0 + number of count slots + their addresses
+#define kSDHashRotateRewritesOffset 0
+#define kSDHashRotateSeqOffset 2
+#define kSDHashRotateSlotCountOffset 4
+#define kSDHashRotateSlotsOffset 5
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+#define kSDHashRotateExtSize (kSDHashRotateSlotsOffset + (SDHASH_ROTATE_SEGMENT_COUNT-1)*sizeof(SDHAddress))
+#define kSDHashSegment0ExtSize (kSDHashRotateExtSize > kSDHashStreamExtSize?kSDHashRotateExtSize:kSDHashStreamExtSize)
+#else
+#define kSDHashSegment0ExtSize kSDHashStreamExtSize
+#endif
+
+// inline files store their length and data in place of the per file type
+// data, up to the end of segment 0
+#define kSDHashInlineDataOffset (kSDHashSegment0ExtOffset + sizeof(SDHDataSize))
+#define kSDHashInlineSize (SDHASH_BLOCK_SIZE - kSDHashInlineDataOffset)
+
+// type + seg 0 addr + sequence number + segment count
+#define kSDHashCountSlotSize (1 + sizeof(SDHAddress) + sizeof(uint16_t) + sizeof(SDHSegmentCount))
+
 // type + seg 0 addr + length
 #define kSDHashSegmentMetaSize (1 + sizeof(SDHAddress) + sizeof(SDHDataSize))
 
-#define kSDHashSegmentDataSize (512-kSDHashSegmentMetaSize)
+#define kSDHashSegmentDataSize (SDHASH_BLOCK_SIZE-kSDHashSegmentMetaSize)
+
+// checked segments end in a CRC32C of their metadata and data, so appends
+// put a little less into each
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+#define kSDHashSegmentCrcSize sizeof(uint32_t)
+#else
+#define kSDHashSegmentCrcSize 0
+#endif
+#define kSDHashSegmentFillSize (kSDHashSegmentDataSize-kSDHashSegmentCrcSize)
+
+#ifdef SDHASH_COMPRESSION
+// segments of compressed files start with the number of bytes they unpack
+// to, with the top bit set if the data is stored as it is
+#define kSDHashPackedHeaderSize sizeof(uint16_t)
+#define kSDHashPackedStored 0x8000
+#define kSDHashMaxPackedLength 0x7fff
+// packed data is groups of a flag byte and up to 8 items. Items whose bit
+// is set, lowest first, are a distance - 1 and a length - 3 byte copying
+// that many bytes from that far back in the segment, the others are
+// literal bytes.
+#define kSDHashPackWindow 256
+#define kSDHashPackMinMatch 3
+#define kSDHashPackMaxMatch (kSDHashPackMinMatch + 255)
+// packed bytes read from the card at a time, at least an item and its flag
+#define kSDHashUnpackChunk 16
+#endif
+
+#ifdef SDHASH_RING_FILES
+// segments of ring files start with a sequence number, one more than that
+// of the segment appended before
+#define kSDHashRingHeaderSize sizeof(uint32_t)
+// ring files need segment tags, so their segments always hold a number
+#define kSDHashRingHeaderOffset (kSDHashSegmentMetaSize+kSDHashSegmentNumberSize)
+#define kSDHashRingDataSize (kSDHashSegmentFillSize-kSDHashSegmentNumberSize-kSDHashRingHeaderSize)
+#endif
+
+// bytes the number of a segment takes, which only tagged segments have
+static uint8_t _numberSize(SDHSegmentCount number) {
+	return number?kSDHashSegmentNumberSize:0;
+}
+
+// where the data of a segment starts
+static uint16_t _dataOffset(const SegmentInfo *sinfo) {
+	return kSDHashSegmentMetaSize + (sinfo->tag?kSDHashSegmentNumberSize:0);
+}
+
+#ifdef SDHASH_LATENCY_STATS
+static void _recordLatency(SDHLatencyStats *stats, uint32_t ticks) {
+	uint8_t bucket = 0;
+	for (uint32_t t = ticks; t > 1 && bucket < kSDHashLatencyBuckets - 1; t >>= 1) ++bucket;
+
+	if (stats->buckets[bucket] == 0xffff) {
+		// keep the shape of the histogram, and buckets that were
+		// in use non-empty
+		for (uint8_t n = 0; n < kSDHashLatencyBuckets; ++n) {
+			stats->buckets[n] = (stats->buckets[n] + 1) / 2;
+		}
+	}
+	stats->buckets[bucket] += 1;
+	stats->count += 1;
+	if (ticks > stats->max) stats->max = ticks;
+}
+
+// times the public call it is declared in, up to whichever return it
+// leaves through. Calls made from within an already timed one, like the
+// appends to __LOG, aren't recorded.
+class SDHLatencyTimer {
+	public:
+		SDHLatencyTimer(SDHLatencyStats *stats, bool *timing): _stats(*timing?NULL:stats), _timing(timing) {
+			if (!_stats) return;
+			*_timing = true;
+			_start = SDHASH_LATENCY_CLOCK();
+		}
+		~SDHLatencyTimer() {
+			if (!_stats) return;
+			// unsigned, so the clock wrapping around doesn't matter
+			_recordLatency(_stats, (uint32_t)(SDHASH_LATENCY_CLOCK() - _start));
+			*_timing = false;
+		}
+	private:
+		SDHLatencyStats *_stats;
+		bool *_timing;
+		unsigned long _start;
+};
+#define SDHASH_TIMED(op) SDHLatencyTimer _timer(&_latency[op], &_timing)
+#else
+#define SDHASH_TIMED(op)
+#endif
 
 uint32_t SDHashClass::fnv(uint8_t *buf, size_t len, uint32_t hval) {
 	Serial_print("fnv:0x");
 	Serial_print(hval, HEX);
 	Serial_print(" .. ");
-	uint8_t *end = buf+len;
-	if (!hval) hval = 2166136261;
-	for(;buf < end;++buf) {
-		hval ^= (uint32_t)*buf;
-		hval += (hval<<1) + (hval<<4) + (hval<<7) + (hval<<8) + (hval<<24);
-	}
+	hval = sdhFnv(buf, len, hval);
 	Serial_print("0x");
 	Serial_println(hval, HEX);
 
@@ -82,7 +325,7 @@ uint32_t SDHashClass::fnv(uint8_t *buf, size_t len, uint32_t hval) {
 
 uint8_t SDHashClass::zeroMagic() {
 	uint8_t zero[1] = {0x00};
-	if (!_card.writeBlock(0, zero, sizeof zero)) {
+	if (!_card.writeBlock(_hashInfo.base, zero, sizeof zero)) {
 		return SDH_ERR_SD;
 	}
 	
@@ -94,7 +337,7 @@ uint8_t SDHashClass::zero(SDHAddress startblock, uint16_t count) {
 	_card.writeStart(startblock, count);
 	for (; count>0; count-=1) {
 		if (!_card.writeData(zero, sizeof zero, 0)) return SDH_ERR_SD;
-		if (!_card.writeDataPadding(512-sizeof zero)) return SDH_ERR_SD;
+		if (!_card.writeDataPadding(SDHASH_BLOCK_SIZE-sizeof zero)) return SDH_ERR_SD;
 	}
 
 	if (!_card.writeStop()) {
@@ -106,7 +349,25 @@ uint8_t SDHashClass::zero(SDHAddress startblock, uint16_t count) {
 
 uint8_t SDHashClass::begin() {
 	_validCard = false;
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	_pendingSeg0 = 0;
+#endif
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	_rotSeg0 = 0;
+#endif
+#ifdef SDHASH_RING_FILES
+	_ringSeg0 = 0;
+#endif
+#ifdef SDHASH_BLOOM_FILTER_BITS
+	// everything may exist until the filter is built
+	memset(_bloom, 0xff, sizeof _bloom);
+#endif
+#ifdef SDHASH_NAME_INDEX
+	_indexValid = false;
+#endif
+#ifdef ARDUINO
 	pinMode(10, OUTPUT); 
+#endif
 	_card.init();
 
 	// stop any reads and writes that were in progress
@@ -114,6 +375,14 @@ uint8_t SDHashClass::begin() {
 	// reset while the SD card didn't
 	_card.writeStop();
 	_card.readEnd();
+#ifdef SDHASH_AUTO_SCK_RATE
+	// whatever the wiring, the header can be read slowly
+	_card.setSckRate(kSDHashSlowestSckRate);
+#endif
+
+	SDHBucketCount limit;
+	uint8_t ret = _getPartition(&limit);
+	if (ret != SDH_OK) return ret;
 
 	if (_getHashInfo()) {
 		_validCard = true;
@@ -122,31 +391,97 @@ uint8_t SDHashClass::begin() {
 		Serial_print(" buckets=");
 		Serial_println(_hashInfo.buckets);
 
+		// a newer spec than ours, or a hash function we don't know. Don't
+		// treat it as unformatted either
+#ifdef SDHASH_FIXED_HASH
+		if (_hashInfo.version > kSDHashVersion || _hashInfo.hash != SDHASH_FIXED_HASH ||
+#else
+		if (_hashInfo.version > kSDHashVersion || _hashInfo.hash > kSDHashMurmur3 ||
+#endif
+				(_hashInfo.flags & ~kSDHashKnownTableFlags) ||
+				(_hashInfo.flags & kSDHashTableWideHandles) != kSDHashRequiredTableFlags) {
+			Serial_println("unsupported hashtable version");
+			_validCard = false;
+			return SDH_ERR_CARD;
+		}
+
 		// make sure our buckets count is smaller than cardsize
 		// otherwise things are going to go haywire
-		if (_hashInfo.buckets > _card.cardSize()) {
+		if (_hashInfo.buckets > limit) {
 			Serial_println("card isn't big enough");
 			return SDH_ERR_CARD;
 		}
+
+		// we might have been reset before a segment count was written
+		if (_hashInfo.flags & kSDHashTablePendingCount) {
+			ret = _recoverSegmentsCount();
+			if (ret != SDH_OK) return ret;
+		}
+#ifdef SDHASH_ONLINE_GROWTH
+		// or while moving a file
+		if (_moveFrom) {
+			ret = _moveFile(_moveFrom, _moveTo, true);
+			if (ret != SDH_OK) return ret;
+		}
+#endif
+#ifdef SDHASH_AUTO_SCK_RATE
+		// tuning rewrites the header, so only once nothing is pending
+		ret = _setupSckRate();
+		if (ret != SDH_OK) return ret;
+#endif
+#ifdef SDHASH_BLOOM_FILTER_BITS
+		ret = _buildBloom();
+		if (ret != SDH_OK) return ret;
+#endif
 #ifdef LOGGING_ENABLED
 		if (statFile(kSDHashLogFilenameHash, NULL, NULL) == SDH_ERR_FILE_NOT_FOUND) {
-			return SDHash.createFile(kSDHashLogFilenameHash, kSDHashLogFilename);
+			return createFile(kSDHashLogFilenameHash, kSDHashLogFilename);
 		}
 #endif
+#ifdef SDHASH_NAME_INDEX
+		return _checkIndex();
+#else
 		return SDH_OK;
+#endif
 	} else {
-		_hashInfo.version = 1;
-		_hashInfo.buckets = _card.cardSize();
+#ifdef SDHASH_FIXED_HASH
+		_hashInfo.hash = SDHASH_FIXED_HASH;
+#else
+		_hashInfo.hash = NEW_TABLE_HASH;
+#endif
+		_hashInfo.flags = kSDHashNewTableFlags;
+		// use the oldest version that can describe the table, checked
+		// segments raise it later
+		if (_hashInfo.flags) _hashInfo.version = 3;
+		else _hashInfo.version = _hashInfo.hash == kSDHashFNV1a?1:2;
+		_hashInfo.buckets = limit;
+		if (SDHASH_TABLE_BUCKETS && SDHASH_TABLE_BUCKETS < _hashInfo.buckets) {
+			_hashInfo.buckets = SDHASH_TABLE_BUCKETS;
+		}
+#ifdef SDHASH_LOCAL_SEGMENTS
+		// round the unit down to a power of 2 so it fits in a byte
+		uint32_t unit = _card.allocationUnitSize();
+		if (!unit) unit = SDHASH_ALLOCATION_UNIT_BLOCKS;
+		for (_hashInfo.unitShift = 0; unit > 1; unit >>= 1) _hashInfo.unitShift += 1;
+		Serial_print("allocation unit=");
+		Serial_println(1UL << _hashInfo.unitShift);
+#endif
+#ifdef SDHASH_AUTO_SCK_RATE
+		// the scratch blocks follow the table
+		if (_hashInfo.buckets > limit - min(limit, (SDHBucketCount)kSDHashScratchBlocks)) {
+			_hashInfo.buckets = limit - min(limit, (SDHBucketCount)kSDHashScratchBlocks);
+		}
+		_profile.sckRate = 0xff;
+#endif
+#ifdef SDHASH_ONLINE_GROWTH
+		_hashInfo.oldBuckets = 0;
+		_hashInfo.probeBuckets = _hashInfo.buckets;
+		_hashInfo.generation = 0;
+		_growCursor = _moveFrom = _moveTo = 0;
+#endif
 
 		if (_hashInfo.buckets) {
-			uint8_t header[kSDHashHeaderSize];
-			memcpy(header, kSDHashMagic, sizeof kSDHashMagic);
-			header[sizeof kSDHashMagic] = _hashInfo.version;
-
-			_hashInfo.buckets = _BSWAP32(_hashInfo.buckets);
-			memcpy(header + sizeof kSDHashMagic + 1, &_hashInfo.buckets, sizeof _hashInfo.buckets);
-
-			if (_card.writeBlock(0, header, sizeof header)) {
+			if (_writeHeader(0) == SDH_OK) {
 				Serial_println("card marked as SDHash");
 				_validCard = true;
 			} else {
@@ -154,9 +489,24 @@ uint8_t SDHashClass::begin() {
 				Serial_println(_card.errorCode(), HEX);
 				return SDH_ERR_SD;
 			}
+#ifdef SDHASH_AUTO_SCK_RATE
+			ret = _setupSckRate();
+			if (ret != SDH_OK) return ret;
+#endif
 #ifdef LOGGING_ENABLED
-			SDHash.deleteFile(kSDHashLogFilenameHash);
-			return SDHash.createFile(kSDHashLogFilenameHash, kSDHashLogFilename);
+			deleteFile(kSDHashLogFilenameHash);
+#endif
+#ifdef SDHASH_BLOOM_FILTER_BITS
+			// a new table is empty
+			memset(_bloom, 0, sizeof _bloom);
+#endif
+#ifdef SDHASH_NAME_INDEX
+			ret = createFile(kSDHashLogFilenameHash, kSDHashLogFilename);
+			if (ret != SDH_OK) return ret;
+			// nothing to replay yet
+			return rebuildIndex();
+#elif defined(LOGGING_ENABLED)
+			return createFile(kSDHashLogFilenameHash, kSDHashLogFilename);
 #else
 			return SDH_OK;
 #endif
@@ -167,67 +517,284 @@ uint8_t SDHashClass::begin() {
 	}
 }
 
+uint8_t SDHashClass::createPartitions(SDHBucketCount *blocks, uint8_t count) {
+	if (count < 1 || count > SDHASH_MAX_PARTITIONS) return SDH_ERR_INVALID_ARGUMENT;
+
+	_validCard = false;
+#ifdef ARDUINO
+	pinMode(10, OUTPUT); 
+#endif
+	_card.init();
+	_card.writeStop();
+	_card.readEnd();
+
+	uint8_t dir[kSDHashPartitionDirSize];
+	memcpy(dir, kSDHashPartitionMagic, sizeof kSDHashPartitionMagic);
+	dir[sizeof kSDHashPartitionMagic] = count;
+
+	// partitions follow the directory back to back
+	SDHAddress start = 1;
+	SDHAddress end = _card.cardSize();
+	uint8_t *entry = dir + sizeof kSDHashPartitionMagic + 1;
+	for (uint8_t idx = 0; idx < count; ++idx, entry += kSDHashPartitionEntrySize) {
+		SDHBucketCount size = blocks[idx];
+		// a size of 0 means the rest of the card, only for the last one
+		if (!size && idx == count-1) size = end > start?end - start:0;
+
+		// tables need at least a header and one bucket
+		if (size < 2 || size > end - start) return SDH_ERR_INVALID_ARGUMENT;
+
+		// so begin() formats the partition rather than mounting whatever
+		// was there before
+		uint8_t zero[1] = {0x00};
+		if (!_card.writeBlock(start, zero, sizeof zero)) return SDH_ERR_SD;
+
+		SDHAddress first = _BSWAP32(start);
+		memcpy(entry, &first, sizeof first);
+		size = _BSWAP32(size);
+		memcpy(entry + sizeof first, &size, sizeof size);
+
+		start += _BSWAP32(size);
+	}
+
+	if (!_card.writeBlock(0, dir, entry - dir)) return SDH_ERR_SD;
+	return SDH_OK;
+}
+
 uint8_t SDHashClass::createFile(SDHFilehandle fh, const char *filename, uint8_t *data, SDHDataSize len) {
+	SDHASH_TIMED(kSDHashOpCreate);
+
 	SDHAddress addr;
-	if (statFile(fh, NULL, &addr) == SDH_ERR_FILE_NOT_FOUND) {
+	uint8_t ret;
+#ifdef SDHASH_ONLINE_GROWTH
+	ret = growStep();
+	if (ret != SDH_OK) return ret;
+#endif
+	ret = statFile(fh, filename, NULL, &addr);
+	if (ret == SDH_ERR_FILE_NOT_FOUND) {
 		Serial_print("addr=");
 		Serial_println(addr);
 
-		uint8_t namelen = strlen(filename);
-		char name_padding = kSDHashMaxFilenameLength - namelen;
-		if (name_padding <= 0) return SDH_ERR_FILENAME;
-		name_padding+=1;
+#ifdef SDHASH_INLINE_FILES
+		// the library reads hidden files segment by segment, so they
+		// don't start out inline
+		if (data && len && len <= kSDHashInlineSize && strncmp(filename, kSDHashHiddenFilenamePrefix, kSDHashHiddenFilenamePrefixLen)) {
+			SDHDataSize stored = _BSWAP16(len);
+			return _createSegment0(addr, fh, filename, kSDHashFileInline, (uint8_t*)&stored, sizeof stored, data, len, 1);
+		}
+#endif
+		ret = _createSegment0(addr, fh, filename, 0, NULL, 0, NULL, 0, 1);
+		if (ret != SDH_OK) return ret;
 
-		if(!_card.writeStart(addr, 1)) return SDH_ERR_SD;
-		
-		uint8_t ofs = 0;
-		uint8_t type = kSDHashSegment0;
+		if (data && len) return appendFile(fh, data, len); 
 
-		if(!_card.writeData(&type, sizeof type, ofs)) return SDH_ERR_SD;
-		ofs+= sizeof type;
+		return SDH_OK;
+	}
+	else if (ret == SDH_OK) return SDH_ERR_FILE_EXISTS;
+	else return ret;
+}
 
-		if(!_card.writeData((uint8_t*)&fh, sizeof fh, ofs)) return SDH_ERR_SD;
-		ofs += sizeof fh;
+#ifdef STREAM_FILES_ENABLED
+uint8_t SDHashClass::createStreamFile(SDHFilehandle fh, const char *filename, SDHBucketCount blocks) {
+	SDHASH_TIMED(kSDHashOpCreate);
 
-		uint16_t seg_count = _BSWAP16(1);
-		if(!_card.writeData((uint8_t*)&seg_count, sizeof seg_count, ofs)) return SDH_ERR_SD;
-		ofs += sizeof seg_count;
+	if (blocks < 1) return SDH_ERR_INVALID_ARGUMENT;
 
-		if(!_card.writeData((uint8_t*)filename, namelen, ofs)) return SDH_ERR_SD;
-		ofs += namelen;
+	SDHAddress addr;
+	uint8_t ret;
+#ifdef SDHASH_ONLINE_GROWTH
+	ret = growStep();
+	if (ret != SDH_OK) return ret;
+#endif
+	ret = statFile(fh, filename, NULL, &addr);
+	if (ret == SDH_OK) return SDH_ERR_FILE_EXISTS;
+	else if (ret != SDH_ERR_FILE_NOT_FOUND) return ret;
 
-		for(uint8_t cnt = 0; cnt < name_padding; ++cnt) {
-			if(!_card.writeData((uint8_t*)&name_padding, sizeof name_padding, ofs)) return SDH_ERR_SD;
-			ofs += sizeof name_padding;
-		}
-		
-		if(!_card.writeDataPadding(512 - ofs)) return SDH_ERR_SD;
-		
-		if(!_card.writeStop()) return SDH_ERR_SD;
+	SDHAddress extent;
+	ret = _findExtent(_segmentAddr(addr, _incHash(fh)), addr, blocks, &extent);
+	if (ret != SDH_OK) return ret;
 
-#ifdef LOGGING_ENABLED
-		if (namelen >=kSDHashHiddenFilenamePrefixLen) {
-			if (memcmp(filename, kSDHashHiddenFilenamePrefix, kSDHashHiddenFilenamePrefixLen)) {
-				uint8_t ret = _appendLog(kSDHashLogCreate, addr);
-				if (ret != SDH_OK) return ret;
-			}
-		}
+	Serial_print("extent=");
+	Serial_println(extent);
+
+	// claim the extent before segment 0 points at it, so being reset
+	// in between leaks the extent rather than handing out blocks other
+	// files might claim. Every block becomes an empty segment, which
+	// keeps other files from probing into it, and the whole extent
+	// gets pre-erased while we are at it.
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	ret = _markChecked();
+	if (ret != SDH_OK) return ret;
 #endif
-		if (data && len) return appendFile(fh, data, len); 
+	if (!_card.writeStart(extent, blocks)) return SDH_ERR_SD;
+	for (SDHBucketCount cnt = 0; cnt < blocks; ++cnt) {
+		ret = _writeSegmentData(addr, NULL, 0, 0);
+		if (ret != SDH_OK) return ret;
+	}
+	if (!_card.writeStop()) return SDH_ERR_SD;
 
-		return SDH_OK;
+	uint8_t ext[kSDHashStreamExtSize];
+	SDHBucketCount used = 0;
+	extent = _BSWAP32(extent);
+	blocks = _BSWAP32(blocks);
+	memcpy(ext, &extent, sizeof extent);
+	memcpy(ext + sizeof extent, &blocks, sizeof blocks);
+	memcpy(ext + sizeof extent + sizeof blocks, &used, sizeof used);
+
+	return _createSegment0(addr, fh, filename, kSDHashFileStream, ext, sizeof ext, NULL, 0, 1);
+}
+#endif
+
+#ifdef SDHASH_COMPRESSION
+uint8_t SDHashClass::createCompressedFile(SDHFilehandle fh, const char *filename) {
+	SDHASH_TIMED(kSDHashOpCreate);
+
+	SDHAddress addr;
+	uint8_t ret;
+#ifdef SDHASH_ONLINE_GROWTH
+	ret = growStep();
+	if (ret != SDH_OK) return ret;
+#endif
+	ret = statFile(fh, filename, NULL, &addr);
+	if (ret == SDH_OK) return SDH_ERR_FILE_EXISTS;
+	else if (ret != SDH_ERR_FILE_NOT_FOUND) return ret;
+
+	return _createSegment0(addr, fh, filename, kSDHashFileCompressed, NULL, 0, NULL, 0, 1);
+}
+#endif
+
+#ifdef SDHASH_RING_FILES
+uint8_t SDHashClass::createRingFile(SDHFilehandle fh, const char *filename, SDHSegmentCount segments) {
+	SDHASH_TIMED(kSDHashOpCreate);
+
+	if (segments < 1 || segments >= kSDHashMaxSegments) return SDH_ERR_INVALID_ARGUMENT;
+	// before any segment is written
+	if (strlen(filename) >= kSDHashMaxFilenameLength) return SDH_ERR_FILENAME;
+	// segments are written over in place, which needs telling them
+	// apart by their tags
+	if (!(_hashInfo.flags & kSDHashTableSegmentTags)) return SDH_ERR_CARD;
+
+	SDHAddress addr;
+	uint8_t ret;
+#ifdef SDHASH_ONLINE_GROWTH
+	ret = growStep();
+	if (ret != SDH_OK) return ret;
+#endif
+	ret = statFile(fh, filename, NULL, &addr);
+	if (ret == SDH_OK) return SDH_ERR_FILE_EXISTS;
+	else if (ret != SDH_ERR_FILE_NOT_FOUND) return ret;
+
+	// write every segment up front, numbered as if the file had been
+	// filled once already, so appends only ever overwrite. They go
+	// before segment 0, so being reset in between leaks them rather than
+	// leaving a file with segments missing, and addr mustn't be taken
+	uint32_t key = fh;
+	for (SDHSegmentCount segNumber = 1; segNumber <= segments; ++segNumber) {
+		key = _incHash(key);
+		SDHAddress seg_addr;
+		ret = _findFree(_segmentAddr(addr, key), addr, &seg_addr);
+		if (ret != SDH_OK) return ret;
+		ret = _writeRingSegment(addr, seg_addr, NULL, 0, segNumber, (uint32_t)segNumber - 1 - segments);
+		if (ret != SDH_OK) return ret;
 	}
-	else return SDH_ERR_FILE_EXISTS;
+
+	ret = _createSegment0(addr, fh, filename, kSDHashFileRing, NULL, 0, NULL, 0, segments + 1);
+	if (ret != SDH_OK) return ret;
+
+	// which makes the last segment the newest
+	_ringSeg0 = addr;
+	_ringHead = segments;
+	_ringKey = key;
+	_ringSeq = (uint32_t)-1;
+	return SDH_OK;
 }
+#endif
 
 uint8_t SDHashClass::appendFile(SDHFilehandle fh, uint8_t* data, SDHDataSize len) {
-	if (data == NULL || len < 1) return SDH_ERR_INVALID_ARGUMENT;
+	if (data == NULL) return SDH_ERR_INVALID_ARGUMENT;
+
+	SDHWriteSource src = {data, NULL, NULL};
+	return _appendFile(fh, &src, len);
+}
+
+#ifdef SDHASH_LARGE_TRANSFERS
+uint8_t SDHashClass::appendFile32(SDHFilehandle fh, uint8_t* data, uint32_t len) {
+	if (data == NULL) return SDH_ERR_INVALID_ARGUMENT;
+
+	SDHWriteSource src = {data, NULL, NULL};
+	return _appendFile(fh, &src, len);
+}
+#endif
+
+uint8_t SDHashClass::appendFileFrom(SDHFilehandle fh, uint32_t len, SDHSource source, void *ctx) {
+	if (source == NULL) return SDH_ERR_INVALID_ARGUMENT;
+
+	SDHWriteSource src = {NULL, source, ctx};
+	return _appendFile(fh, &src, len);
+}
+
+uint8_t SDHashClass::_appendFile(SDHFilehandle fh, SDHWriteSource *src, SDHTransferSize len) {
+	SDHASH_TIMED(kSDHashOpAppend);
+
+	if (len < 1) return SDH_ERR_INVALID_ARGUMENT;
 
 	FileInfo finfo;
 	SDHAddress seg0addr;
 	uint8_t ret = statFile(fh, &finfo, &seg0addr);
 	if (ret != SDH_OK) return ret;
 
+#ifdef STREAM_FILES_ENABLED
+	if (finfo.flags & kSDHashFileStream) return _appendStream(seg0addr, src, len);
+#else
+	if (finfo.flags & kSDHashFileStream) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+#ifdef SDHASH_RING_FILES
+	if (finfo.flags & kSDHashFileRing) return _appendRing(fh, seg0addr, finfo.segments_count - 1, src, len);
+#else
+	if (finfo.flags & kSDHashFileRing) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+
+	// the segments of tagged tables hold their number too
+	SDHDataSize fill = kSDHashSegmentFillSize - _numberSize(_segmentNumber(finfo.segments_count));
+	SDHDataSize per = fill;
+#ifdef SDHASH_COMPRESSION
+	bool packed = finfo.flags & kSDHashFileCompressed;
+	// packing looks back at the data, which sources don't keep around
+	if (packed && src->source) return SDH_ERR_INVALID_ARGUMENT;
+	// segments that don't pack hold a little less
+	if (packed) per = fill - kSDHashPackedHeaderSize;
+#else
+	if (finfo.flags & kSDHashFileCompressed) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+#if defined(SDHASH_INLINE_FILES) || defined(SDHASH_LAZY_SEGMENT_COUNT)
+	bool spilled = false;
+#endif
+#ifdef SDHASH_INLINE_FILES
+	// once the data of an inline file moved to segment 1, its segment 0
+	// is written with the new count and without the data last
+	uint8_t head[kSDHashSegment0ExtOffset];
+	if (finfo.flags & kSDHashFileInline) {
+		spilled = true;
+		ret = _appendInline(fh, seg0addr, &finfo, src, len, head);
+		if (ret != SDH_OK || (finfo.flags & kSDHashFileInline)) return ret;
+	}
+#else
+	if (finfo.flags & kSDHashFileInline) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+
+	// the segment count can't wrap
+	uint32_t count = ((uint32_t)len + per - 1) / per;
+	if (count > kSDHashMaxSegments - finfo.segments_count) return SDH_ERR_DATA_OVERFLOW;
+
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	// __LOG is appended to between appends to other files, so it keeps
+	// writing its count rather than taking turns with them
+	if (fh != kSDHashLogFilenameHash && !spilled) {
+		ret = _setPending(seg0addr, finfo.segments_count);
+		if (ret != SDH_OK) return ret;
+	}
+#endif
+
 	// bring the hash 'up to date'
 	for(SDHSegmentCount cnt = 0; cnt < finfo.segments_count; ++cnt) {
 		fh = _incHash(fh);
@@ -235,23 +802,155 @@ uint8_t SDHashClass::appendFile(SDHFilehandle fh, uint8_t* data, SDHDataSize len
 
 	SDHDataSize seg_len;
 	do {
-		seg_len = min(kSDHashSegmentDataSize, len);
-		SDHAddress seg_addr = _foldHash(fh);
+		seg_len = min((SDHTransferSize)fill, len);
+		SDHAddress seg_addr = _segmentAddr(seg0addr, fh);
 
 		ret = findSeg(0, &seg_addr);
 		if (ret == SDH_ERR_FILE_NOT_FOUND) {
-			ret = _writeSegment(seg0addr, seg_addr, data, seg_len);
+#ifdef SDHASH_COMPRESSION
+			if (packed) {
+				// takes as much as packs into the segment
+				seg_len = min((SDHTransferSize)kSDHashMaxPackedLength, len);
+				ret = _writePacked(seg0addr, seg_addr, src, &seg_len, finfo.segments_count);
+			} else
+#endif
+			ret = _writeSegment(seg0addr, seg_addr, src, seg_len, finfo.segments_count);
+			if (ret == SDH_ERR_ABORTED) {
+				// keep what was appended before the source gave up
+#ifdef SDHASH_INLINE_FILES
+				if (spilled) _writeSpilled(seg0addr, head, finfo.segments_count);
+				else
+#endif
+				_appendedSegments(seg0addr, finfo.segments_count);
+				return ret;
+			}
 			if (ret != SDH_OK) return ret;
 
 			len -= seg_len;
-			data += seg_len;
 			fh = _incHash(fh);
 			finfo.segments_count += 1;
 		} else return ret;
 	} while (len > 0);
 
-	_updateSeg0SegmentsCount(seg0addr, finfo.segments_count);
-	
+#ifdef SDHASH_INLINE_FILES
+	if (spilled) return _writeSpilled(seg0addr, head, finfo.segments_count);
+#endif
+	return _appendedSegments(seg0addr, finfo.segments_count);
+}
+
+uint8_t SDHashClass::flush() {
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	if (_pendingSeg0) {
+		if (_pendingAppends) {
+			uint8_t ret = _updateSeg0SegmentsCount(_pendingSeg0, _pendingCount);
+			if (ret != SDH_OK) return ret;
+		}
+		_pendingSeg0 = 0;
+		return _writeHeader(0);
+	}
+#endif
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::writeAt(SDHFilehandle fh, uint32_t offset, uint8_t *data, SDHDataSize *len) {
+	if (data == NULL) return SDH_ERR_INVALID_ARGUMENT;
+
+	FileInfo finfo;
+	SDHAddress seg0addr;
+	uint8_t ret = statFile(fh, &finfo, &seg0addr);
+	if (ret != SDH_OK) return ret;
+	// packed data can't be overwritten in place, and ring files only
+	// change by appending
+	if (finfo.flags & (kSDHashFileCompressed | kSDHashFileRing)) return SDH_ERR_INVALID_ARGUMENT;
+#ifdef SDHASH_INLINE_FILES
+	if (finfo.flags & kSDHashFileInline) {
+		SDHDataSize used;
+		ret = _inlineLength(seg0addr, &used);
+		if (ret != SDH_OK || offset >= used) return ret;
+
+		SDHDataSize count = min((SDHDataSize)(used - offset), *len);
+		SDHWriteSource src = {data, NULL, NULL};
+		ret = _rewriteInline(seg0addr, used, offset, &src, count, used);
+		if (ret == SDH_OK) *len -= count;
+		return ret;
+	}
+#else
+	if (finfo.flags & kSDHashFileInline) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+
+	SDHBucketCount segments = finfo.segments_count;
+	SDHAddress extent = 0;
+#ifdef STREAM_FILES_ENABLED
+	if (finfo.flags & kSDHashFileStream) {
+		ret = _statExtent(seg0addr, &extent, NULL, &segments);
+		if (ret != SDH_OK) return ret;
+		// count segment 0 like hash chains do
+		segments += 1;
+	}
+#else
+	if (finfo.flags & kSDHashFileStream) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+
+	SDHWriteRun run;
+	run.count = 0;
+	uint8_t keep[kSDHashSegmentDataSize];
+
+	for (SDHBucketCount segNumber = 1; segNumber < segments && *len; ++segNumber) {
+		SDHAddress addr;
+		SegmentInfo sinfo;
+		if (extent) {
+			// stream files keep their segments in order
+			addr = extent + segNumber - 1;
+			ret = statSeg(addr, &sinfo);
+		} else {
+			fh = _incHash(fh);
+			addr = _segmentAddr(seg0addr, fh);
+			ret = _findSeg(seg0addr, &addr, &sinfo, segNumber);
+		}
+		if (ret == SDH_ERR_FILE_NOT_FOUND) return SDH_ERR_MISSIG_SEGMENT;
+		if (ret != SDH_OK) return ret;
+
+		if (offset >= sinfo.length) {
+			offset -= sinfo.length;
+			continue;
+		}
+
+		SDHDataSize count = min((SDHDataSize)(sinfo.length - offset), *len);
+		bool partial = count < sinfo.length;
+
+		// only segments right after the run can join it, and only one
+		// of them can be kept in memory
+		if (run.count && (addr != run.addr + run.count || run.count == kSDHashWriteRunLength ||
+				(partial && run.partial != kSDHashWriteRunLength))) {
+			ret = _writeRun(seg0addr, &run, keep);
+			if (ret != SDH_OK) return ret;
+			run.count = 0;
+		}
+		if (!run.count) {
+			run.addr = addr;
+			run.partial = kSDHashWriteRunLength;
+			run.data = data;
+		}
+
+		if (partial) {
+			// the block is about to be rewritten, so we need the bytes
+			// we keep
+			if (!_card.readData(addr, _dataOffset(&sinfo), sinfo.length, keep)) return SDH_ERR_SD;
+			memcpy(keep + offset, data, count);
+			// a partial segment can only start the run or end it
+			if (!run.count) run.data += count;
+			run.partial = run.count;
+		}
+		run.lengths[run.count] = sinfo.length;
+		run.numbers[run.count] = sinfo.number;
+		run.count += 1;
+
+		data += count;
+		*len -= count;
+		offset = 0;
+	}
+
+	if (run.count) return _writeRun(seg0addr, &run, keep);
 	return SDH_OK;
 }
 
@@ -261,46 +960,85 @@ uint8_t SDHashClass::replaceSegment(SDHFilehandle fh, uint16_t segNumber, uint8_
 	SDHAddress seg_addr;
 	uint8_t ret = findSeg(fh, segNumber, &seg_addr);
 	if (ret == SDH_OK) {
+		FileInfo finfo;
 		SDHAddress seg0addr;
-		ret = statFile(fh, NULL, &seg0addr);
+		ret = statFile(fh, &finfo, &seg0addr);
 		if (ret == SDH_OK) {
-			return _writeSegment(seg0addr, seg_addr, data, len);
+			if (finfo.flags & (kSDHashFileCompressed | kSDHashFileRing)) return SDH_ERR_INVALID_ARGUMENT;
+			SDHWriteSource src = {data, NULL, NULL};
+			return _writeSegment(seg0addr, seg_addr, &src, len, segNumber);
 		} else return ret;
 	} else return ret;
 }
 
 uint8_t SDHashClass::deleteFile(SDHFilehandle fh) {
+	SDHASH_TIMED(kSDHashOpDelete);
+
 	FileInfo finfo;
 	SDHAddress seg0addr;
 	uint8_t type[1] = {kSDHashFreeSegment};
+	uint8_t ret;
 
-	uint8_t ret = statFile(fh, &finfo, &seg0addr);
+#ifdef SDHASH_ONLINE_GROWTH
+	ret = growStep();
+	if (ret != SDH_OK) return ret;
+#endif
+	ret = statFile(fh, &finfo, &seg0addr);
 	if (ret != SDH_OK) return ret;
 
-#ifdef LOGGING_ENABLED	
-	// check to see if this is a hidden file
-	uint8_t prefix[kSDHashHiddenFilenamePrefixLen];
-	if (!_card.readData(seg0addr, kSDHashSegment0MetaHeaderSize,sizeof prefix, prefix)) {
-		return SDH_ERR_SD;
-	}
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	// statFile left the file's count slots behind, and appending to
+	// __LOG replaces them
+	SDHAddress slots[SDHASH_ROTATE_SEGMENT_COUNT - 1];
+	uint8_t slotCount = _rotSlotCount;
+	memcpy(slots, _rotSlots, slotCount * sizeof(SDHAddress));
+#endif
 
-	if (memcmp(prefix, kSDHashHiddenFilenamePrefix, sizeof prefix)) {
-		// if it ISN'T then append operation to the log
-		ret = _appendLog(kSDHashLogDelete, seg0addr);
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	if (seg0addr == _pendingSeg0) {
+		// no point writing the count, but the header mustn't name the
+		// file once its segment 0 is reused
+		_pendingAppends = 0;
+		ret = flush();
 		if (ret != SDH_OK) return ret;
 	}
 #endif
-	if (!_card.writeBlock(seg0addr, type, sizeof type)) {
-		return SDH_ERR_SD;
-	}
-
-	finfo.segments_count-=1;
+
+#ifdef LOGGING_ENABLED	
+	ret = _logDelete(seg0addr);
+	if (ret != SDH_OK) return ret;
+#endif
+#ifdef STREAM_FILES_ENABLED
+	if (finfo.flags & kSDHashFileStream) {
+		SDHAddress extent;
+		SDHBucketCount blocks;
+		ret = _statExtent(seg0addr, &extent, &blocks, NULL);
+		if (ret != SDH_OK) return ret;
+
+		// segment 0 goes first, so the extent is never handed out
+		// while something still points at it
+		if (!_card.writeBlock(seg0addr, type, sizeof type)) {
+			return SDH_ERR_SD;
+		}
+		return zero(extent, blocks);
+	}
+#endif
+	if (!_card.writeBlock(seg0addr, type, sizeof type)) {
+		return SDH_ERR_SD;
+	}
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	if (_rotSeg0 == seg0addr) _rotSeg0 = 0;
+	for (uint8_t idx = 0; idx < slotCount; ++idx) {
+		if (!_card.writeBlock(slots[idx], type, sizeof type)) return SDH_ERR_SD;
+	}
+#endif
 
 	SDHAddress seg_addr;
-	while(finfo.segments_count) {
+	SegmentInfo sinfo;
+	for (SDHSegmentCount segNumber = 1; segNumber < finfo.segments_count; ++segNumber) {
 		fh = _incHash(fh);
-		seg_addr = _foldHash(fh);
-		ret = findSeg(seg0addr, &seg_addr);
+		seg_addr = _segmentAddr(seg0addr, fh);
+		ret = _findSeg(seg0addr, &seg_addr, &sinfo, segNumber);
 
 		if (ret == SDH_OK) {
 ///			Serial_print("addr=");
@@ -310,46 +1048,154 @@ uint8_t SDHashClass::deleteFile(SDHFilehandle fh) {
 		// if a segment isn't found, don't stop. Otherwise a single
 		// missing segment could lead to a whole bunch of zombie ones
 		else if (ret != SDH_ERR_FILE_NOT_FOUND) return ret;
-
-		finfo.segments_count-=1;
 	}
 
 	return SDH_OK;
 }
 
 uint8_t SDHashClass::readFile(SDHFilehandle fh, uint32_t offset, uint8_t *dest, uint16_t *len) {
+	SDHReadTarget target = {dest, NULL, NULL};
+	SDHTransferSize left = *len;
+	uint8_t ret = _readFile(fh, offset, &target, &left);
+	*len = left;
+	return ret;
+}
+
+#ifdef SDHASH_LARGE_TRANSFERS
+uint8_t SDHashClass::readFile32(SDHFilehandle fh, uint32_t offset, uint8_t *dest, uint32_t *len) {
+	SDHReadTarget target = {dest, NULL, NULL};
+	return _readFile(fh, offset, &target, len);
+}
+#endif
+
+uint8_t SDHashClass::readFileTo(SDHFilehandle fh, uint32_t offset, uint32_t *len, SDHSink sink, void *ctx) {
+	if (sink == NULL) return SDH_ERR_INVALID_ARGUMENT;
+
+	SDHReadTarget target = {NULL, sink, ctx};
+	return _readFile(fh, offset, &target, len);
+}
+
+uint8_t SDHashClass::_readFile(SDHFilehandle fh, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len) {
+	SDHASH_TIMED(kSDHashOpRead);
+
 	FileInfo finfo;
 	SDHAddress seg0addr;
 	uint8_t ret;
 
 	ret = statFile(fh, &finfo, &seg0addr);
 	if (ret != SDH_OK) return ret;
-	
-	// the first segment doesn't hold data, so skip it
-	for (finfo.segments_count-=1; finfo.segments_count; finfo.segments_count-=1) {
-		fh = _incHash(fh);
-		SDHAddress addr = _foldHash(fh);
 
-		ret = findSeg(seg0addr, &addr);
-		if (ret == SDH_OK) {
-			SegmentInfo sinfo;
-			ret = statSeg(addr, &sinfo);
-			if (ret != SDH_OK) return ret;
+#ifdef STREAM_FILES_ENABLED
+	if (finfo.flags & kSDHashFileStream) return _readStream(seg0addr, offset, target, len);
+#else
+	if (finfo.flags & kSDHashFileStream) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+#ifndef SDHASH_COMPRESSION
+	if (finfo.flags & kSDHashFileCompressed) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+#ifndef SDHASH_INLINE_FILES
+	if (finfo.flags & kSDHashFileInline) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+	SDHSegmentCount first = 1;
+#ifdef SDHASH_RING_FILES
+	if (finfo.flags & kSDHashFileRing) {
+		// the oldest segment follows the newest
+		ret = _findRingHead(fh, seg0addr, finfo.segments_count - 1);
+		if (ret != SDH_OK) return ret;
+		first = _ringHead % (finfo.segments_count - 1) + 1;
+	}
+#else
+	if (finfo.flags & kSDHashFileRing) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+
+	// keep each block open between reading its metadata and its data
+	_card.partialBlockRead(true);
+#ifdef SDHASH_INLINE_FILES
+	if (finfo.flags & kSDHashFileInline) ret = _readInline(seg0addr, offset, target, len);
+	else
+#endif
+	ret = _readChain(fh, &finfo, seg0addr, first, offset, target, len);
+	_card.partialBlockRead(false);
+
+	return ret;
+}
+
+uint8_t SDHashClass::_readChain(SDHFilehandle fh, FileInfo *finfo, SDHAddress seg0addr, SDHSegmentCount first, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len) {
+	uint8_t ret;
+	uint32_t key = fh;
+	for (SDHSegmentCount segNumber = 1; segNumber < first; ++segNumber) {
+		key = _incHash(key);
+	}
+
+	// the first segment doesn't hold data, so skip it. Ring files start
+	// at their oldest segment, and go round to segment 1
+	SDHSegmentCount segNumber = first;
+	for (SDHSegmentCount cnt = 1; cnt < finfo->segments_count; ++cnt, ++segNumber) {
+		if (segNumber == finfo->segments_count) {
+			segNumber = 1;
+			key = fh;
+		}
+		key = _incHash(key);
+		SDHAddress addr = _segmentAddr(seg0addr, key);
 
-			if (offset > sinfo.length) {
+		SegmentInfo sinfo;
+		ret = _findSeg(seg0addr, &addr, &sinfo, segNumber);
+		if (ret == SDH_OK) {
+			SDHDataSize length = sinfo.length;
+			uint16_t start = _dataOffset(&sinfo);
+#ifdef SDHASH_COMPRESSION
+			bool packed = false;
+			uint32_t *check = NULL;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+			uint32_t crc;
+#endif
+			if (finfo->flags & kSDHashFileCompressed) {
+				// the segment says how much it unpacks to, so segments
+				// before offset needn't be unpacked
+				uint16_t header;
+				if (!_card.readData(addr, start, sizeof header, (uint8_t*)&header)) return SDH_ERR_SD;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+				if (sinfo.checked) {
+					crc = sdhCrc32c(_metaCrc(&sinfo), (uint8_t*)&header, sizeof header);
+					check = &crc;
+				}
+#endif
+				header = _BSWAP16(header);
+				packed = !(header & kSDHashPackedStored);
+				length = header & kSDHashMaxPackedLength;
+				start += sizeof header;
+			}
+#endif
+#ifdef SDHASH_RING_FILES
+			if (finfo->flags & kSDHashFileRing) {
+				// past the sequence number
+				if (length < kSDHashRingHeaderSize) return SDH_ERR_MISSIG_SEGMENT;
+				length -= kSDHashRingHeaderSize;
+				start += kSDHashRingHeaderSize;
+			}
+#endif
+			if (offset > length) {
 				// offset is past this segment, break out
 				// and do the next segment
-				offset -= sinfo.length;
+				offset -= length;
 			} else {
 				// offset is inside this segment, so do a read
 				// keeping in mind to skip the metadata
-				uint16_t bytesRead = min(sinfo.length-offset, *len);
-				if(!_card.readData(addr, kSDHashSegmentMetaSize+offset, bytesRead, dest)) return SDH_ERR_SD;
+				SDHDataSize bytesRead = min((SDHTransferSize)(length-offset), *len);
+#ifdef SDHASH_COMPRESSION
+				if (packed) ret = _unpackSegment(target, addr, start, sinfo.length - kSDHashPackedHeaderSize, offset, bytesRead, check);
+				else
+#endif
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+				if (sinfo.checked) ret = _readChecked(target, addr, &sinfo, start+offset, bytesRead);
+				else
+#endif
+				ret = _readData(target, addr, start+offset, bytesRead);
+				if (ret != SDH_OK) return ret;
 				if (bytesRead < *len) {
 					// reading this segment wasn't enough to fill dest.
 					// We need to read into one or more subsequent
 					// segments, and always at their offset 0
-					dest += bytesRead;
 					*len -= bytesRead;
 					offset = 0;
 				} else {
@@ -366,92 +1212,403 @@ uint8_t SDHashClass::readFile(SDHFilehandle fh, uint32_t offset, uint8_t *dest,
 	return SDH_OK;
 }
 
-uint8_t SDHashClass::findSeg(SDHAddress seg0addr, SDHAddress *addr) {
+SDHSegmentCount SDHashClass::_segmentNumber(SDHSegmentCount segNumber) {
+	if (!(_hashInfo.flags & kSDHashTableSegmentTags)) return 0;
+	return segNumber;
+}
+
+uint8_t SDHashClass::_readData(SDHReadTarget *target, SDHAddress addr, uint16_t offset, SDHDataSize count) {
+	if (!target->sink) {
+		if (!_card.readData(addr, offset, count, target->dest)) return SDH_ERR_SD;
+		target->dest += count;
+		return SDH_OK;
+	}
+
+	// hand the data over a few bytes at a time. Partial block reads keep
+	// the block open between chunks.
+	uint8_t chunk[SDHASH_SINK_CHUNK_SIZE];
+	while (count) {
+		uint8_t n = min(count, (SDHDataSize)sizeof chunk);
+		if (!_card.readData(addr, offset, n, chunk)) return SDH_ERR_SD;
+		if (!target->sink(target->ctx, chunk, n)) return SDH_ERR_ABORTED;
+
+		offset += n;
+		count -= n;
+	}
+	return SDH_OK;
+}
+
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+uint8_t SDHashClass::_markChecked() {
+	// older versions of the library would take checked segments for free
+	// ones, so the header says otherwise before the first is written. It
+	// can't be written while a segment is.
+	if (_hashInfo.version >= kSDHashVersionChecked) return SDH_OK;
+	_hashInfo.version = kSDHashVersionChecked;
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	return _writeHeader(_pendingSeg0);
+#else
+	return _writeHeader(0);
+#endif
+}
+
+uint32_t SDHashClass::_metaCrc(SegmentInfo *sinfo) {
+	// the metadata as _writeSegmentMeta wrote it
+	uint8_t meta[kSDHashSegmentMetaSize];
+	meta[0] = kSDHashSegmentChecked;
+	memcpy(meta + 1, &sinfo->segment0_addr, sizeof sinfo->segment0_addr);
+	uint16_t field = _BSWAP16(sinfo->length | (uint16_t)sinfo->tag << kSDHashSegmentTagShift);
+	memcpy(meta + 1 + sizeof sinfo->segment0_addr, &field, sizeof field);
+	uint32_t crc = sdhCrc32c(0, meta, sizeof meta);
+	if (!sinfo->tag) return crc;
+
+	SDHSegmentCount number = _BSWAP16(sinfo->number);
+	return sdhCrc32c(crc, (uint8_t*)&number, sizeof number);
+}
+
+uint8_t SDHashClass::_crcRange(SDHAddress addr, uint16_t ofs, uint16_t end, uint32_t *crc) {
+	uint8_t chunk[SDHASH_SINK_CHUNK_SIZE];
+	while (ofs < end) {
+		uint8_t n = min((uint16_t)(end - ofs), (uint16_t)sizeof chunk);
+		if (!_card.readData(addr, ofs, n, chunk)) return SDH_ERR_SD;
+		*crc = sdhCrc32c(*crc, chunk, n);
+		ofs += n;
+	}
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_checkRest(SDHAddress addr, uint16_t ofs, uint16_t end, uint32_t crc) {
+	uint8_t ret = _crcRange(addr, ofs, end, &crc);
+	if (ret != SDH_OK) return ret;
+
+	uint32_t stored;
+	if (!_card.readData(addr, end, sizeof stored, (uint8_t*)&stored)) return SDH_ERR_SD;
+	return _BSWAP32(stored) == crc?SDH_OK:SDH_ERR_CHECKSUM;
+}
+
+uint8_t SDHashClass::_readChecked(SDHReadTarget *target, SDHAddress addr, SegmentInfo *sinfo, uint16_t offset, SDHDataSize count) {
+	uint16_t end = _dataOffset(sinfo) + sinfo->length;
+	if (end + sizeof(uint32_t) > SDHASH_BLOCK_SIZE) return SDH_ERR_CHECKSUM;
+
+	// the card sends the whole block either way, so the data around
+	// what was asked for costs little more than its CRC
+	uint32_t crc = _metaCrc(sinfo);
+	uint8_t ret = _crcRange(addr, _dataOffset(sinfo), offset, &crc);
+	if (ret != SDH_OK) return ret;
+
+	if (!target->sink) {
+		if (!_card.readData(addr, offset, count, target->dest)) return SDH_ERR_SD;
+		crc = sdhCrc32c(crc, target->dest, count);
+		target->dest += count;
+		offset += count;
+	} else {
+		uint8_t chunk[SDHASH_SINK_CHUNK_SIZE];
+		while (count) {
+			uint8_t n = min(count, (SDHDataSize)sizeof chunk);
+			if (!_card.readData(addr, offset, n, chunk)) return SDH_ERR_SD;
+			crc = sdhCrc32c(crc, chunk, n);
+			if (!target->sink(target->ctx, chunk, n)) return SDH_ERR_ABORTED;
+
+			offset += n;
+			count -= n;
+		}
+	}
+
+	return _checkRest(addr, offset, end, crc);
+}
+#endif
+
+uint8_t SDHashClass::_findSeg(SDHAddress seg0addr, SDHAddress *addr, SegmentInfo *sinfo, SDHSegmentCount segNumber) {
 	SDHAddress addr0 = *addr;
-	SegmentInfo sinfo;
+	SDHSegmentCount number = _segmentNumber(segNumber);
 	uint8_t ret;
 
 	do {
-		ret = statSeg(*addr, &sinfo);
+		ret = statSeg(*addr, sinfo);
 		if (ret == SDH_OK) {
-			if (sinfo.segment0_addr == seg0addr) return SDH_OK;
+#ifdef SDHASH_ONLINE_GROWTH
+			// tombstones are segments of no file, and as good as free
+			// when looking for a free block
+			if (!sinfo->segment0_addr) {
+				if (!seg0addr) return SDH_ERR_FILE_NOT_FOUND;
+			} else
+#endif
+			// other segments of the same file can lie on the probe
+			// path, their numbers tell them apart
+			if (sinfo->segment0_addr == seg0addr && (!number || !sinfo->tag || sinfo->number == number)) return SDH_OK;
 		} else if (ret != SDH_ERR_WRONG_SEGMENT_TYPE) return ret;
 
-		*addr+=STEP(addr0);
+		*addr = _stepAddr(*addr, addr0);
 	} while (addr0 != *addr);
 
 	return SDH_ERR_NO_SPACE;
 }
 
+uint8_t SDHashClass::_findFree(SDHAddress addr0, SDHAddress skip, SDHAddress *addr) {
+	SegmentInfo sinfo;
+	*addr = addr0;
+	for (;;) {
+		uint8_t ret = statSeg(*addr, &sinfo);
+#ifdef SDHASH_ONLINE_GROWTH
+		if (ret == SDH_OK && !sinfo.segment0_addr) ret = SDH_ERR_FILE_NOT_FOUND;
+#endif
+		if (ret == SDH_ERR_FILE_NOT_FOUND && *addr != skip) return SDH_OK;
+		if (ret != SDH_OK && ret != SDH_ERR_WRONG_SEGMENT_TYPE && ret != SDH_ERR_FILE_NOT_FOUND) return ret;
+		*addr = _stepAddr(*addr, addr0);
+		if (*addr == addr0) return SDH_ERR_NO_SPACE;
+	}
+}
+
 uint8_t SDHashClass::findSeg(SDHFilehandle fh, uint16_t segmentNumber, SDHAddress *addr) {
-	uint8_t ret = statFile(fh, NULL, addr);
+	FileInfo finfo;
+	uint8_t ret = statFile(fh, &finfo, addr);
 	if (ret == SDH_OK) {
-		if (segmentNumber == 0) SDH_OK;
+		if (segmentNumber == 0) return SDH_OK;
+#ifdef STREAM_FILES_ENABLED
+		else if (finfo.flags & kSDHashFileStream) {
+			SDHAddress extent;
+			SDHBucketCount used;
+			ret = _statExtent(*addr, &extent, NULL, &used);
+			if (ret != SDH_OK) return ret;
+			if (segmentNumber > used) return SDH_ERR_FILE_NOT_FOUND;
+
+			*addr = extent + segmentNumber - 1;
+			return SDH_OK;
+		}
+#endif
 		else {
 			SDHAddress seg0addr = *addr;
-			while(segmentNumber) {
+			for (SDHSegmentCount cnt = segmentNumber; cnt; --cnt) {
 				fh = _incHash(fh);
-				segmentNumber -= 1;
 			}
 
-			*addr = _foldHash(fh);
-			return findSeg(seg0addr, addr);
+			*addr = _segmentAddr(seg0addr, fh);
+			SegmentInfo sinfo;
+			return _findSeg(seg0addr, addr, &sinfo, segmentNumber);
 		}
 	} else return ret;
 }
 		
-uint8_t SDHashClass::statFile(SDHFilehandle fh, FileInfo *finfo, SDHAddress *addrPtr) {
+uint8_t SDHashClass::statFile(SDHFilehandle fh, const char *filename, FileInfo *finfo, SDHAddress *addrPtr) {
+#ifdef SDHASH_ONLINE_GROWTH
+	// new files go where the bigger table puts them
+	_hashInfo.probeBuckets = _hashInfo.buckets;
+#endif
+#ifdef SDHASH_BLOOM_FILTER_BITS
+	if (!_bloomMayContain(fh)) {
+		// certainly not there, the card is only needed to tell where
+		// it would go
+		if (!addrPtr) return SDH_ERR_FILE_NOT_FOUND;
+		*addrPtr = _foldHash(fh);
+		SegmentInfo sinfo;
+		return _findSeg(0, addrPtr, &sinfo, 0);
+	}
+#endif
+#ifdef SDHASH_ONLINE_GROWTH
+	FileInfo info;
+	uint8_t ret = _findFile(fh, filename, &info, addrPtr);
+	if ((ret == SDH_ERR_FILE_NOT_FOUND || ret == SDH_ERR_NO_SPACE) && _hashInfo.oldBuckets) {
+		// files that haven't moved yet are along their old probe path
+		SDHAddress addr;
+		_hashInfo.probeBuckets = _hashInfo.oldBuckets;
+		uint8_t oldRet = _findFile(fh, filename, &info, &addr);
+		if (oldRet != SDH_ERR_FILE_NOT_FOUND && oldRet != SDH_ERR_NO_SPACE) {
+			ret = oldRet;
+			if (addrPtr) *addrPtr = addr;
+		}
+		_hashInfo.probeBuckets = _hashInfo.buckets;
+	}
+	if (ret == SDH_OK) {
+		// later lookups of the file's segments happen in its table
+		_useGeometry(info.flags);
+		if (finfo) *finfo = info;
+	}
+	return ret;
+#else
+	return _findFile(fh, filename, finfo, addrPtr);
+#endif
+}
+
+uint8_t SDHashClass::_findFile(SDHFilehandle fh, const char *filename, FileInfo *finfo, SDHAddress *addrPtr) {
 	SDHAddress addr = _foldHash(fh);
 	SDHAddress addr0 = addr;
 
 	uint8_t ret;
 	FileInfo info;
+	uint8_t name[kSDHashMaxFilenameLength + 1];
 	do {
 		if (addrPtr) *addrPtr = addr;
-		ret = statSeg0(addr, &info);
+		// the name comes with the same block read as the hash
+		ret = _statSeg(addr, kSDHashSegment0, &info, filename?name:NULL);
 		if (ret == SDH_OK) {
 			if (info.hash == fh) {
+				// only look at the name if the hashes match
+				if (filename && !_nameMatches(name, filename)) return SDH_ERR_HANDLE_COLLISION;
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+				ret = _resolveSegmentsCount(addr, &info);
+				if (ret != SDH_OK) return ret;
+#endif
 				if (finfo) *finfo = info;
 				return SDH_OK;
 			}
 		} else if (ret == SDH_ERR_FILE_NOT_FOUND) return ret;
 
-		addr+=STEP(addr0);
+		addr = _stepAddr(addr, addr0);
 	} while (addr != addr0);
 	
 	return SDH_ERR_NO_SPACE;
 }
 
+SDHFilehandle SDHashClass::logFilehandle() {
+	return kSDHashLogFilenameHash;
+}
+
+uint8_t SDHashClass::readFilename(SDHAddress seg0addr, char *filename) {
+	uint8_t name[kSDHashMaxFilenameLength + 1];
+	uint8_t ret = _statSeg(seg0addr, kSDHashSegment0, NULL, NULL);
+	if (ret != SDH_OK) return ret;
+	if (!_card.readData(seg0addr, kSDHashSegment0MetaHeaderSize, sizeof name, name)) return SDH_ERR_SD;
+
+	// the padding byte tells us the length
+	uint8_t padding = name[kSDHashMaxFilenameLength];
+	if (padding < 1 || padding > kSDHashMaxFilenameLength + 1) return SDH_ERR_FILENAME;
+
+	uint8_t namelen = kSDHashMaxFilenameLength + 1 - padding;
+	memcpy(filename, name, namelen);
+	filename[namelen] = '\0';
+	return SDH_OK;
+}
+
 uint8_t SDHashClass::truncateFile(SDHFilehandle fh, SDHSegmentCount count) {
 	FileInfo finfo;
 	SDHAddress seg0addr;
 	uint8_t ret = statFile(fh, &finfo, &seg0addr);
 	if (ret != SDH_OK) return ret;
+	// ring files keep all their segments
+	if (finfo.flags & kSDHashFileRing) return SDH_ERR_INVALID_ARGUMENT;
+
+#ifdef STREAM_FILES_ENABLED
+	if (finfo.flags & kSDHashFileStream) {
+		// blocks stay reserved, later appends simply overwrite them
+		SDHBucketCount used;
+		ret = _statExtent(seg0addr, NULL, NULL, &used);
+		if (ret != SDH_OK) return ret;
+		if (count > used) return SDH_ERR_INVALID_ARGUMENT;
+
+		used = _BSWAP32(used - count);
+		return _updateSeg0Meta(seg0addr, kSDHashSegment0ExtOffset + sizeof(SDHAddress) + sizeof(SDHBucketCount), &used, sizeof used);
+	}
+#else
+	if (finfo.flags & kSDHashFileStream) return SDH_ERR_INVALID_ARGUMENT;
+#endif
 
-	if (count > finfo.segments_count) {
+	if (count >= finfo.segments_count) {
 		return SDH_ERR_INVALID_ARGUMENT;
 	}
-	
-	while (count) {
-		SDHAddress seg_addr;
-		finfo.segments_count-=1;
-		ret = findSeg(fh, finfo.segments_count, &seg_addr);
+	if (!count) return SDH_OK;
+
+	SDHSegmentCount first = finfo.segments_count - count;
+	uint32_t key = fh;
+	for (SDHSegmentCount cnt = 0; cnt < first; ++cnt) {
+		key = _incHash(key);
+	}
+	return _truncateChain(seg0addr, key, first, finfo.segments_count);
+}
+
+uint8_t SDHashClass::truncateTo(SDHFilehandle fh, uint32_t length) {
+	FileInfo finfo;
+	SDHAddress seg0addr;
+	uint8_t ret = statFile(fh, &finfo, &seg0addr);
+	if (ret != SDH_OK) return ret;
+	if (finfo.flags & (kSDHashFileCompressed | kSDHashFileRing)) return SDH_ERR_INVALID_ARGUMENT;
+#ifdef SDHASH_INLINE_FILES
+	if (finfo.flags & kSDHashFileInline) {
+		SDHDataSize used;
+		ret = _inlineLength(seg0addr, &used);
 		if (ret != SDH_OK) return ret;
-		
-		uint8_t ret = zero(seg_addr, 1);
+		if (length > used) return SDH_ERR_INVALID_ARGUMENT;
+		if (length == used) return SDH_OK;
+		return _rewriteInline(seg0addr, used, length, NULL, 0, length);
+	}
+#else
+	if (finfo.flags & kSDHashFileInline) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+
+	SDHBucketCount segments = finfo.segments_count;
+	SDHAddress extent = 0;
+#ifdef STREAM_FILES_ENABLED
+	if (finfo.flags & kSDHashFileStream) {
+		ret = _statExtent(seg0addr, &extent, NULL, &segments);
+		if (ret != SDH_OK) return ret;
+		segments += 1;
+	}
+#else
+	if (finfo.flags & kSDHashFileStream) return SDH_ERR_INVALID_ARGUMENT;
+#endif
+
+	// find the segment the file will end in
+	SDHBucketCount segNumber;
+	SDHAddress addr;
+	SegmentInfo sinfo;
+	uint32_t key = fh;
+	for (segNumber = 1; segNumber < segments; ++segNumber) {
+		if (extent) {
+			addr = extent + segNumber - 1;
+			ret = statSeg(addr, &sinfo);
+		} else {
+			key = _incHash(key);
+			addr = _segmentAddr(seg0addr, key);
+			ret = _findSeg(seg0addr, &addr, &sinfo, segNumber);
+		}
+		// right at the cut it may be gone already, freed by a truncation
+		// that got reset part way
+		if (ret == SDH_ERR_FILE_NOT_FOUND && !length) break;
+		if (ret == SDH_ERR_FILE_NOT_FOUND) return SDH_ERR_MISSIG_SEGMENT;
 		if (ret != SDH_OK) return ret;
 
-		count-=1;
+		if (length < sinfo.length) break;
+		length -= sinfo.length;
 	}
-	
-	// update segments count
-	return _updateSeg0SegmentsCount(seg0addr, finfo.segments_count);
+	if (segNumber == segments) return length?SDH_ERR_INVALID_ARGUMENT:SDH_OK;
+
+	// the file is cut behind the segment it ends in before that is
+	// shortened, so a reset in between leaves it a little longer
+	SDHSegmentCount first = length?segNumber + 1:segNumber;
+#ifdef STREAM_FILES_ENABLED
+	if (extent) {
+		SDHBucketCount used = _BSWAP32(first - 1);
+		ret = _updateSeg0Meta(seg0addr, kSDHashSegment0ExtOffset + sizeof(SDHAddress) + sizeof(SDHBucketCount), &used, sizeof used);
+	} else
+#endif
+	ret = _truncateChain(seg0addr, length?_incHash(key):key, first, finfo.segments_count);
+	if (ret != SDH_OK || !length) return ret;
+
+	// shorten it in place, which means writing the data it keeps all
+	// over again
+	uint8_t keep[kSDHashSegmentDataSize];
+	if (!_card.readData(addr, _dataOffset(&sinfo), length, keep)) return SDH_ERR_SD;
+
+	SDHWriteRun run;
+	run.addr = addr;
+	run.count = 1;
+	run.lengths[0] = length;
+	run.numbers[0] = sinfo.number;
+	run.partial = 0;
+	return _writeRun(seg0addr, &run, keep);
 }
 
 /***************************************************************
  * Private Methods
  * *************************************************************/
-uint8_t SDHashClass::_statSeg(SDHAddress addr, SDHSegmentType type, void *info) {
+bool SDHashClass::_nameMatches(uint8_t *name, const char *filename) {
+	uint8_t namelen = strlen(filename);
+	if (namelen >= kSDHashMaxFilenameLength) return false;
+
+	// the stored name is followed by PKCS7 padding
+	return !memcmp(name, filename, namelen) && name[namelen] == kSDHashMaxFilenameLength + 1 - namelen;
+}
+
+uint8_t SDHashClass::_statSeg(SDHAddress addr, SDHSegmentType type, void *info, uint8_t *name) {
 	switch(type) {
 		case kSDHashSegment0:
 		case kSDHashSegment:
@@ -460,30 +1617,85 @@ uint8_t SDHashClass::_statSeg(SDHAddress addr, SDHSegmentType type, void *info)
 			return SDH_ERR_INVALID_ARGUMENT;
 	}
 
-	uint8_t meta[kSDHashSegment0MetaHeaderSize];
-	if (!_card.readData(addr, 0, sizeof meta, meta)) {
+	// read up to and including the file flags in one go. Other segments
+	// only need their metadata, and their number in tables with segment
+	// tags, which leaves partial block reads positioned at the data.
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	// and the rotation state, which comes with the same read
+	uint8_t meta[kSDHashSegment0ExtOffset + kSDHashRotateExtSize];
+#else
+	uint8_t meta[kSDHashSegment0FlagsOffset + 1];
+#endif
+	uint8_t size = sizeof meta;
+	if (type != kSDHashSegment0) size = kSDHashSegmentMetaSize + _numberSize(_segmentNumber(1));
+	if (!_card.readData(addr, 0, size, meta)) {
 		return SDH_ERR_SD;
 	}
 
-	if (meta[0] == type) {
+	// checked segments are segments with a checksum after their data
+	if (meta[0] == type || (type == kSDHashSegment && meta[0] == kSDHashSegmentChecked)) {
 		if (info) {
 			if (type == kSDHashSegment0) {
 				FileInfo *finfo = (FileInfo*)info;
 				memcpy(&finfo->hash, meta+1, sizeof finfo->hash);
 				memcpy(&finfo->segments_count, meta+1+sizeof finfo->hash, sizeof finfo->segments_count);
 				finfo->segments_count = _BSWAP16(finfo->segments_count);
+				finfo->flags = meta[kSDHashSegment0FlagsOffset];
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+				if (addr == _pendingSeg0) finfo->segments_count = _pendingCount;
+#endif
+				if (name) memcpy(name, meta+kSDHashSegment0MetaHeaderSize, kSDHashMaxFilenameLength + 1);
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+				uint8_t *ext = meta + kSDHashSegment0ExtOffset;
+				_rotSeg0 = addr;
+				_rotResolved = false;
+				_rotSlotCount = 0;
+				_rotLatest = 0;
+				// the per file type data of stream and inline files
+				// isn't rotation state
+				if ((_hashInfo.flags & kSDHashTableRotatedCounts) && !(finfo->flags & (kSDHashFileStream | kSDHashFileInline))) {
+					memcpy(&_rotRewrites, ext + kSDHashRotateRewritesOffset, sizeof _rotRewrites);
+					memcpy(&_rotSeq, ext + kSDHashRotateSeqOffset, sizeof _rotSeq);
+					_rotRewrites = _BSWAP16(_rotRewrites);
+					_rotSeq = _BSWAP16(_rotSeq);
+					_rotSlotCount = min(ext[kSDHashRotateSlotCountOffset], (uint8_t)(SDHASH_ROTATE_SEGMENT_COUNT - 1));
+					memcpy(_rotSlots, ext + kSDHashRotateSlotsOffset, _rotSlotCount * sizeof(SDHAddress));
+					for (uint8_t idx = 0; idx < _rotSlotCount; ++idx) _rotSlots[idx] = _BSWAP32(_rotSlots[idx]);
+				}
+#endif
 			} else if (type == kSDHashSegment) {
 				SegmentInfo *sinfo = (SegmentInfo*)info;
 				memcpy(&sinfo->segment0_addr, meta+1, sizeof sinfo->segment0_addr);
 				memcpy(&sinfo->length, meta+1+sizeof sinfo->segment0_addr, sizeof sinfo->length);
 				sinfo->length = _BSWAP16(sinfo->length);
+				sinfo->tag = sinfo->length >> kSDHashSegmentTagShift;
+				sinfo->length &= kSDHashSegmentLengthMask;
+				sinfo->checked = meta[0] == kSDHashSegmentChecked;
+				sinfo->number = 0;
+				if (sinfo->tag) {
+					if (size == kSDHashSegmentMetaSize && !_card.readData(addr, size, kSDHashSegmentNumberSize, meta+size)) return SDH_ERR_SD;
+					memcpy(&sinfo->number, meta+kSDHashSegmentMetaSize, sizeof sinfo->number);
+					sinfo->number = _BSWAP16(sinfo->number);
+				}
 			} 
 		}
 		return SDH_OK;
 	} else {
+#ifdef SDHASH_ONLINE_GROWTH
+		// a tombstone reads as a segment of no file
+		if (meta[0] == kSDHashSegmentTombstone && type == kSDHashSegment) {
+			if (info) memset(info, 0, sizeof(SegmentInfo));
+			return SDH_OK;
+		}
+#endif
 		switch(meta[0]) {
 			case kSDHashSegment:
 			case kSDHashSegment0:
+			case kSDHashSegmentCount:
+			case kSDHashSegmentChecked:
+#ifdef SDHASH_ONLINE_GROWTH
+			case kSDHashSegmentTombstone:
+#endif
 				return SDH_ERR_WRONG_SEGMENT_TYPE;
 			default:
 				return SDH_ERR_FILE_NOT_FOUND;
@@ -491,73 +1703,2275 @@ uint8_t SDHashClass::_statSeg(SDHAddress addr, SDHSegmentType type, void *info)
 	}
 }
 uint8_t SDHashClass::_updateSeg0SegmentsCount(SDHAddress seg0addr, uint16_t segments_count) {
-	// we have to read in the entire metadata b/c we need to preserve 
-	// the filename too
-	uint8_t meta[kSDHashSegment0MetaSize];
-	if (!_card.readData(seg0addr, 0, sizeof meta, meta)) return SDH_ERR_SD;
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	if (seg0addr == _pendingSeg0) {
+		_pendingCount = segments_count;
+		_pendingAppends = 0;
+	}
+#endif
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	if (_hashInfo.flags & kSDHashTableRotatedCounts) return _rotateSegmentsCount(seg0addr, segments_count);
+#endif
 	segments_count = _BSWAP16(segments_count);
-	memcpy(meta+1+sizeof(SDHFilehandle), &segments_count, sizeof segments_count);
-	if (!_card.writeBlock(seg0addr, meta, sizeof meta)) return SDH_ERR_SD;
-	return SDH_OK;
+	return _updateSeg0Meta(seg0addr, 1+sizeof(SDHFilehandle), &segments_count, sizeof segments_count);
 }
 
-uint8_t SDHashClass::_writeSegment(SDHAddress seg0addr, SDHAddress addr, uint8_t *data, SDHDataSize len) {
-	if (!_card.writeStart(addr, 1)) return SDH_ERR_SD;
+uint8_t SDHashClass::_appendedSegments(SDHAddress seg0addr, SDHSegmentCount segments_count) {
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	if (seg0addr == _pendingSeg0) {
+		_pendingCount = segments_count;
+		// write it every so often anyway, which also bounds how far
+		// recovery has to look
+		if (++_pendingAppends < SDHASH_LAZY_SEGMENT_COUNT) return SDH_OK;
+	}
+#endif
+	return _updateSeg0SegmentsCount(seg0addr, segments_count);
+}
 
-	uint8_t ofs = 0;
-	uint8_t type[1] = {kSDHashSegment};
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+uint8_t SDHashClass::_resolveSegmentsCount(SDHAddress seg0addr, FileInfo *finfo) {
+	// starts from the state of segment 0 as just read
+	if (_rotSeg0 != seg0addr || _rotResolved) {
+		uint8_t ret = _statSeg(seg0addr, kSDHashSegment0, finfo, NULL);
+		if (ret != SDH_OK) return ret;
+	}
 
-	if (!_card.writeData(type, sizeof type, ofs)) return SDH_ERR_SD;
-	ofs += sizeof type;
+	// the newest count is the one with the highest sequence number, in
+	// serial number arithmetic. They only ever go up by one at a time.
+	_rotLatest = 0;
+	for (uint8_t idx = 0; idx < _rotSlotCount; ++idx) {
+		uint8_t slot[kSDHashCountSlotSize];
+		if (!_card.readData(_rotSlots[idx], 0, sizeof slot, slot)) return SDH_ERR_SD;
+
+		SDHAddress owner;
+		uint16_t seq;
+		memcpy(&owner, slot + 1, sizeof owner);
+		memcpy(&seq, slot + 1 + sizeof owner, sizeof seq);
+		seq = _BSWAP16(seq);
+		if (slot[0] != kSDHashSegmentCount || _BSWAP32(owner) != seg0addr) continue;
+
+		if ((int16_t)(seq - _rotSeq) > 0) {
+			_rotSeq = seq;
+			_rotLatest = idx + 1;
+			memcpy(&finfo->segments_count, slot + 1 + sizeof owner + sizeof seq, sizeof finfo->segments_count);
+			finfo->segments_count = _BSWAP16(finfo->segments_count);
+		}
+	}
+	_rotResolved = true;
 
-	seg0addr = _BSWAP32(seg0addr);
-	if (!_card.writeData((uint8_t*)&seg0addr, sizeof seg0addr, ofs)) return SDH_ERR_SD;
-	ofs += sizeof seg0addr;
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	if (seg0addr == _pendingSeg0) finfo->segments_count = _pendingCount;
+#endif
+	return SDH_OK;
+}
 
-	len = _BSWAP16(len);
-	if (!_card.writeData((uint8_t*)&len, sizeof len, ofs)) return SDH_ERR_SD;
-	len = _BSWAP16(len);
-	ofs += sizeof len;
+uint8_t SDHashClass::_rotateSegmentsCount(SDHAddress seg0addr, SDHSegmentCount segments_count) {
+	if (_rotSeg0 != seg0addr || !_rotResolved) {
+		FileInfo finfo;
+		uint8_t ret = _resolveSegmentsCount(seg0addr, &finfo);
+		if (ret != SDH_OK) return ret;
+	}
 
-	if (!_card.writeData(data, len, ofs)) return SDH_ERR_SD;
-	// don't add len to ofs, since len is 16 bit while ret is 8
+	uint8_t slot[kSDHashCountSlotSize];
+	SDHAddress owner = _BSWAP32(seg0addr);
+	uint16_t count = _BSWAP16(segments_count);
+	slot[0] = kSDHashSegmentCount;
+	memcpy(slot + 1, &owner, sizeof owner);
+	memcpy(slot + 1 + sizeof owner + sizeof _rotSeq, &count, sizeof count);
+
+	uint8_t meta[kSDHashSegment0ExtOffset + kSDHashRotateExtSize];
+	uint8_t *ext = meta + kSDHashSegment0ExtOffset;
+
+	if (_rotSlotCount) {
+		uint8_t next = (_rotLatest + 1) % (_rotSlotCount + 1);
+		uint16_t seq = _BSWAP16(_rotSeq + 1);
+		if (next) {
+			memcpy(slot + 1 + sizeof owner, &seq, sizeof seq);
+			if (!_card.writeBlock(_rotSlots[next - 1], slot, sizeof slot)) return SDH_ERR_SD;
+		} else {
+			if (!_card.readData(seg0addr, 0, sizeof meta, meta)) return SDH_ERR_SD;
+			memcpy(meta + 1 + sizeof(SDHFilehandle), &count, sizeof count);
+			memcpy(ext + kSDHashRotateSeqOffset, &seq, sizeof seq);
+			if (!_card.writeBlock(seg0addr, meta, sizeof meta)) return SDH_ERR_SD;
+		}
+		_rotLatest = next;
+		_rotSeq += 1;
+		return SDH_OK;
+	}
 
-	if (!_card.writeDataPadding(512-ofs-len)) return SDH_ERR_SD;
-	if (!_card.writeStop()) return SDH_ERR_SD;
+	// still in segment 0 alone, which counts its own rewrites
+	if (!_card.readData(seg0addr, 0, sizeof meta, meta)) return SDH_ERR_SD;
+	memcpy(meta + 1 + sizeof(SDHFilehandle), &count, sizeof count);
+	if (meta[kSDHashSegment0FlagsOffset] & kSDHashFileStream) {
+		return _card.writeBlock(seg0addr, meta, sizeof meta)?SDH_OK:SDH_ERR_SD;
+	}
 
+	if (++_rotRewrites >= SDHASH_ROTATE_AFTER) {
+		// hot enough to spread out. The slots are claimed next to
+		// segment 0 before it points at them, with the same count and
+		// sequence number, so being reset in between only leaks them.
+		memcpy(slot + 1 + sizeof owner, ext + kSDHashRotateSeqOffset, sizeof _rotSeq);
+		SDHAddress addr = seg0addr;
+		for (uint8_t idx = 0; idx < SDHASH_ROTATE_SEGMENT_COUNT - 1; ++idx) {
+			SegmentInfo sinfo;
+			uint8_t ret = _findSeg(0, &addr, &sinfo, 0);
+			if (ret == SDH_ERR_NO_SPACE) break;
+			if (ret != SDH_ERR_FILE_NOT_FOUND) return ret;
+			if (!_card.writeBlock(addr, slot, sizeof slot)) return SDH_ERR_SD;
+
+			_rotSlots[idx] = addr;
+			SDHAddress stored = _BSWAP32(addr);
+			memcpy(ext + kSDHashRotateSlotsOffset + idx*sizeof stored, &stored, sizeof stored);
+			_rotSlotCount = idx + 1;
+		}
+		ext[kSDHashRotateSlotCountOffset] = _rotSlotCount;
+	}
+	uint16_t rewrites = _BSWAP16(_rotRewrites);
+	memcpy(ext + kSDHashRotateRewritesOffset, &rewrites, sizeof rewrites);
+	if (!_card.writeBlock(seg0addr, meta, sizeof meta)) return SDH_ERR_SD;
 	return SDH_OK;
 }
+#endif
 
-#ifdef LOGGING_ENABLED
-uint8_t SDHashClass::_appendLog(SDHLogEntryType type, SDHAddress seg0addr) {
-	uint8_t entry[sizeof type + sizeof seg0addr];
-	seg0addr = _BSWAP32(seg0addr);
-	memcpy(entry, &seg0addr, sizeof seg0addr);
-	entry[sizeof seg0addr] = type;
-	return appendFile(kSDHashLogFilenameHash, entry, sizeof entry);
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+uint8_t SDHashClass::_setPending(SDHAddress seg0addr, SDHSegmentCount segments_count) {
+	if (seg0addr == _pendingSeg0) return SDH_OK;
+
+	// only one file can be pending. Its count has to be on the card
+	// before the header stops naming it, and the header has to name the
+	// next one before any of its segments go uncounted.
+	if (_pendingSeg0 && _pendingAppends) {
+		uint8_t ret = _updateSeg0SegmentsCount(_pendingSeg0, _pendingCount);
+		if (ret != SDH_OK) return ret;
+	}
+	_pendingSeg0 = 0;
+
+	uint8_t ret = _writeHeader(seg0addr);
+	if (ret != SDH_OK) return ret;
+
+	_pendingSeg0 = seg0addr;
+	_pendingCount = segments_count;
+	_pendingAppends = 0;
+	return SDH_OK;
 }
 #endif
-uint32_t SDHashClass::_incHash(uint32_t hash) {
-	return fnv((uint8_t*)&hash, sizeof hash, hash);
-}
 
-SDHAddress SDHashClass::_foldHash(uint32_t hash) {
-	return 1+hash%(_hashInfo.buckets-1);
+uint8_t SDHashClass::_writeHeader(SDHAddress pendingSeg0) {
+	uint8_t header[kSDHashHeaderSizeGrown];
+	memset(header, 0, sizeof header);
+	memcpy(header, kSDHashMagic, sizeof kSDHashMagic);
+	header[sizeof kSDHashMagic] = _hashInfo.version;
+
+	SDHBucketCount buckets = _BSWAP32(_hashInfo.buckets);
+	memcpy(header + sizeof kSDHashMagic + 1, &buckets, sizeof buckets);
+	header[kSDHashHeaderSizeV1] = _hashInfo.hash;
+	header[kSDHashHeaderSizeV2] = _hashInfo.flags;
+
+	uint8_t headerSize = kSDHashHeaderSize;
+	if (pendingSeg0) {
+		// the flag needs a version 3 header, which remembers the
+		// version to go back to
+		if (_hashInfo.version < 3) header[sizeof kSDHashMagic] = 3;
+		header[kSDHashHeaderSizeV2] |= kSDHashTablePendingCount;
+		pendingSeg0 = _BSWAP32(pendingSeg0);
+		memcpy(header + kSDHashHeaderSize, &pendingSeg0, sizeof pendingSeg0);
+		header[kSDHashHeaderSize + sizeof pendingSeg0] = _hashInfo.version;
+		headerSize = kSDHashHeaderSizePending;
+	}
+	else if (_hashInfo.version == 1) headerSize = kSDHashHeaderSizeV1;
+	else if (_hashInfo.version == 2) headerSize = kSDHashHeaderSizeV2;
+	if (_hashInfo.flags & (kSDHashTableLocalSegments | kSDHashTableTunedRate | kSDHashTableGrown)) {
+		// the unit comes after the pending count, whether or not there is one
+		header[kSDHashHeaderSizePending] = _hashInfo.unitShift;
+		headerSize = kSDHashHeaderSizeLocal;
+	}
+#ifdef SDHASH_AUTO_SCK_RATE
+	if (_hashInfo.flags & kSDHashTableTunedRate) {
+		uint8_t *profile = header + kSDHashHeaderSizeLocal;
+		uint16_t ticks[3] = {
+			_BSWAP16(_profile.readBlockTicks),
+			_BSWAP16(_profile.writeBlockTicks),
+			_BSWAP16(_profile.multiWriteBlockTicks)};
+		profile[0] = _profile.sckRate;
+		memcpy(profile + 1, ticks, sizeof ticks);
+		headerSize = kSDHashHeaderSizeTuned;
+	}
+#endif
+#ifdef SDHASH_ONLINE_GROWTH
+	if (_hashInfo.flags & kSDHashTableGrown) {
+		// after the profile, whether or not there is one
+		uint8_t *growth = header + kSDHashHeaderSizeTuned;
+		SDHAddress fields[4] = {
+			_BSWAP32(_hashInfo.oldBuckets),
+			_BSWAP32(_growCursor),
+			_BSWAP32(_moveFrom),
+			_BSWAP32(_moveTo)};
+		growth[0] = _hashInfo.generation;
+		memcpy(growth + 1, fields, sizeof fields);
+		headerSize = kSDHashHeaderSizeGrown;
+	}
+#endif
+
+	if (!_card.writeBlock(_hashInfo.base, header, headerSize)) return SDH_ERR_SD;
+	return SDH_OK;
 }
 
-bool SDHashClass::_getHashInfo() {
-	_hashInfo.buckets = 0;
-	uint8_t header[kSDHashHeaderSize];
+uint8_t SDHashClass::_recoverSegmentsCount() {
+	uint8_t pending[kSDHashHeaderSizePending - kSDHashHeaderSize];
+	if (!_card.readData(_hashInfo.base, kSDHashHeaderSize, sizeof pending, pending)) return SDH_ERR_SD;
 
-	_card.readData(0, 0, sizeof header, header);
+	SDHAddress seg0addr;
+	memcpy(&seg0addr, pending, sizeof seg0addr);
+	seg0addr = _BSWAP32(seg0addr);
+	_hashInfo.version = pending[sizeof seg0addr];
+	_hashInfo.flags &= ~kSDHashTablePendingCount;
 
-	if (memcmp(header, kSDHashMagic, sizeof kSDHashMagic)) return false;
+	FileInfo finfo;
+	uint8_t ret = SDH_ERR_FILE_NOT_FOUND;
+	if (seg0addr > _hashInfo.base && seg0addr < _hashInfo.base + _hashInfo.buckets) {
+		ret = statSeg0(seg0addr, &finfo);
+	}
 
-	_hashInfo.version = header[sizeof kSDHashMagic];
-	
-	memcpy(&_hashInfo.buckets, header+sizeof kSDHashMagic + 1, sizeof _hashInfo.buckets);
+	if (ret == SDH_OK && !(finfo.flags & kSDHashFileStream)) {
+#ifdef SDHASH_ONLINE_GROWTH
+		_useGeometry(finfo.flags);
+#endif
+		// segments appended since the count was last written are where
+		// the next ones would have gone
+		SDHFilehandle fh = finfo.hash;
+		for (SDHSegmentCount cnt = 0; cnt < finfo.segments_count; ++cnt) {
+			fh = _incHash(fh);
+		}
 
-	_hashInfo.buckets = _BSWAP32(_hashInfo.buckets);
+		SDHSegmentCount segments_count = finfo.segments_count;
+		while (segments_count < kSDHashMaxSegments) {
+			SDHAddress addr = _segmentAddr(seg0addr, fh);
+			SegmentInfo sinfo;
+			ret = _findSeg(seg0addr, &addr, &sinfo, segments_count);
+			if (ret == SDH_ERR_FILE_NOT_FOUND || ret == SDH_ERR_NO_SPACE) break;
+			if (ret != SDH_OK) return ret;
+
+			fh = _incHash(fh);
+			segments_count += 1;
+		}
+
+		Serial_print("recovered segments=");
+		Serial_println(segments_count - finfo.segments_count, DEC);
+		if (segments_count != finfo.segments_count) {
+			ret = _updateSeg0SegmentsCount(seg0addr, segments_count);
+			if (ret != SDH_OK) return ret;
+		}
+	} else if (ret == SDH_ERR_SD) return ret;
+
+	return _writeHeader(0);
+}
+
+uint8_t SDHashClass::_updateSeg0Meta(SDHAddress seg0addr, uint8_t ofs, void *src, uint8_t len) {
+	// we have to read in the entire metadata b/c we need to preserve 
+	// the filename and flags too
+	uint8_t meta[kSDHashSegment0ExtOffset + kSDHashSegment0ExtSize];
+	if (!_card.readData(seg0addr, 0, sizeof meta, meta)) return SDH_ERR_SD;
+	memcpy(meta+ofs, src, len);
+	if (!_card.writeBlock(seg0addr, meta, sizeof meta)) return SDH_ERR_SD;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_createSegment0(SDHAddress addr, SDHFilehandle fh, const char *filename, uint8_t flags, uint8_t *ext, uint8_t extlen, const uint8_t *data, SDHDataSize len, SDHSegmentCount segments_count) {
+	uint8_t namelen = strlen(filename);
+	char name_padding = kSDHashMaxFilenameLength - namelen;
+	if (name_padding <= 0) return SDH_ERR_FILENAME;
+	name_padding+=1;
+
+	if(!_card.writeStart(addr, 1)) return SDH_ERR_SD;
+	
+	uint16_t ofs = 0;
+	uint8_t type = kSDHashSegment0;
+
+	if(!_card.writeData(&type, sizeof type, ofs)) return SDH_ERR_SD;
+	ofs+= sizeof type;
+
+	if(!_card.writeData((uint8_t*)&fh, sizeof fh, ofs)) return SDH_ERR_SD;
+	ofs += sizeof fh;
+
+	uint16_t seg_count = _BSWAP16(segments_count);
+	if(!_card.writeData((uint8_t*)&seg_count, sizeof seg_count, ofs)) return SDH_ERR_SD;
+	ofs += sizeof seg_count;
+
+	if(!_card.writeData((uint8_t*)filename, namelen, ofs)) return SDH_ERR_SD;
+	ofs += namelen;
+
+	for(uint8_t cnt = 0; cnt < name_padding; ++cnt) {
+		if(!_card.writeData((uint8_t*)&name_padding, sizeof name_padding, ofs)) return SDH_ERR_SD;
+		ofs += sizeof name_padding;
+	}
+
+#ifdef SDHASH_ONLINE_GROWTH
+	flags |= _hashInfo.generation;
+#endif
+
+	if(!_card.writeData(&flags, sizeof flags, ofs)) return SDH_ERR_SD;
+	ofs += sizeof flags;
+
+	if(!_card.writeData(ext, extlen, ofs)) return SDH_ERR_SD;
+	ofs += extlen;
+
+	// inline data
+	if(len && !_card.writeData(data, len, ofs)) return SDH_ERR_SD;
+	ofs += len;
+	
+	if(!_card.writeDataPadding(SDHASH_BLOCK_SIZE - ofs)) return SDH_ERR_SD;
+	
+	if(!_card.writeStop()) return SDH_ERR_SD;
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	if (addr == _rotSeg0) _rotSeg0 = 0;
+#endif
+#ifdef SDHASH_RING_FILES
+	if (addr == _ringSeg0) _ringSeg0 = 0;
+#endif
+
+#ifdef SDHASH_BLOOM_FILTER_BITS
+	_bloomAdd(fh);
+#endif
+#ifdef LOGGING_ENABLED
+	return _logCreate(addr, fh, filename);
+#else
+	return SDH_OK;
+#endif
+}
+
+uint8_t SDHashClass::_writeSegment(SDHAddress seg0addr, SDHAddress addr, SDHWriteSource *src, SDHDataSize len, SDHSegmentCount segNumber) {
+	SDHSegmentCount number = _segmentNumber(segNumber);
+	// the number takes room from the data
+	if (len + _numberSize(number) > kSDHashSegmentDataSize) return SDH_ERR_DATA_OVERFLOW;
+
+	uint8_t ret;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	if (len + _numberSize(number) <= kSDHashSegmentFillSize) {
+		ret = _markChecked();
+		if (ret != SDH_OK) return ret;
+	}
+#endif
+	if (!_card.writeStart(addr, 1)) return SDH_ERR_SD;
+
+	ret = _writeSegmentData(seg0addr, src, len, number);
+	if (ret == SDH_ERR_ABORTED) {
+		// the segment is incomplete, so free it again
+		uint8_t type[1] = {kSDHashFreeSegment};
+		if (!_card.writeStop()) return SDH_ERR_SD;
+		if (!_card.writeBlock(addr, type, sizeof type)) return SDH_ERR_SD;
+		return ret;
+	}
+	if (ret != SDH_OK) return ret;
+
+	if (!_card.writeStop()) return SDH_ERR_SD;
+
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_writeRun(SDHAddress seg0addr, SDHWriteRun *run, uint8_t *keep) {
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	for (uint8_t idx = 0; idx < run->count; ++idx) {
+		if (run->lengths[idx] + _numberSize(run->numbers[idx]) > kSDHashSegmentFillSize) continue;
+		uint8_t ret = _markChecked();
+		if (ret != SDH_OK) return ret;
+	}
+#endif
+	if (!_card.writeStart(run->addr, run->count)) return SDH_ERR_SD;
+
+	SDHWriteSource data = {run->data, NULL, NULL};
+	SDHWriteSource kept = {keep, NULL, NULL};
+	for (uint8_t idx = 0; idx < run->count; ++idx) {
+		uint8_t ret = _writeSegmentData(seg0addr, idx == run->partial?&kept:&data, run->lengths[idx], run->numbers[idx]);
+		if (ret != SDH_OK) return ret;
+	}
+
+	if (!_card.writeStop()) return SDH_ERR_SD;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_truncateChain(SDHAddress seg0addr, uint32_t key, SDHSegmentCount first, SDHSegmentCount segments_count) {
+	if (first >= segments_count) return SDH_OK;
+	uint8_t ret;
+
+	// freeing a segment can cut the probe path of segments looked up
+	// after it, so the tail is looked up and freed a batch at a time,
+	// last batch first. Keys only go forward, so remember a few to replay
+	// the batches' keys from.
+	uint32_t marks[kSDHashTruncateMarks];
+	SDHSegmentCount spacing = (segments_count - first + kSDHashTruncateMarks - 1) / kSDHashTruncateMarks;
+	for (SDHSegmentCount segNumber = first; segNumber < segments_count; ++segNumber) {
+		if ((segNumber - first) % spacing == 0) marks[(segNumber - first) / spacing] = key;
+		key = _incHash(key);
+	}
+
+	SDHAddress addrs[SDHASH_TRUNCATE_BATCH];
+	SDHSegmentCount end = segments_count;
+	while (end > first) {
+		SDHSegmentCount start = end - first > SDHASH_TRUNCATE_BATCH?end - SDHASH_TRUNCATE_BATCH:first;
+		SDHSegmentCount segNumber = first + (start - first) / spacing * spacing;
+		key = marks[(start - first) / spacing];
+		for (; segNumber < start; ++segNumber) key = _incHash(key);
+
+		uint8_t found = 0;
+		for (; segNumber < end; ++segNumber) {
+			SDHAddress addr = _segmentAddr(seg0addr, key);
+			SegmentInfo sinfo;
+			ret = _findSeg(seg0addr, &addr, &sinfo, segNumber);
+			if (ret == SDH_OK) addrs[found++] = addr;
+			// like deleteFile, don't stop at a missing segment
+			else if (ret != SDH_ERR_FILE_NOT_FOUND) return ret;
+			key = _incHash(key);
+		}
+
+		// free them last first, those in adjacent blocks in one go
+		while (found) {
+			SDHAddress addr = addrs[--found];
+			uint16_t count = 1;
+			while (found && addrs[found-1] == addr - 1) {
+				addr -= 1;
+				count += 1;
+				found -= 1;
+			}
+			ret = zero(addr, count);
+			if (ret != SDH_OK) return ret;
+		}
+
+		end = start;
+	}
+
+	// the count goes last. A reset part way leaves the old count with
+	// the end of the tail gone, so reads past the cut fail with
+	// SDH_ERR_MISSIG_SEGMENT until the file is truncated again, and no
+	// stale segment is left right past the new count for the next
+	// append or lazy count recovery to pick up.
+	return _updateSeg0SegmentsCount(seg0addr, first);
+}
+
+uint8_t SDHashClass::_writeSegmentMeta(SDHAddress seg0addr, SDHDataSize len, SDHSegmentCount number) {
+	uint8_t meta[kSDHashSegmentMetaSize + kSDHashSegmentNumberSize];
+	meta[0] = kSDHashSegment;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	// a segment written full without a checksum, which writeAt or
+	// growing the table can rewrite, has no room for one
+	_writeChecked = len + _numberSize(number) <= kSDHashSegmentFillSize;
+	if (_writeChecked) meta[0] = kSDHashSegmentChecked;
+#endif
+
+	seg0addr = _BSWAP32(seg0addr);
+	memcpy(meta + 1, &seg0addr, sizeof seg0addr);
+
+	uint8_t tag = number?number % kSDHashSegmentTagModulus + 1:0;
+	uint16_t field = _BSWAP16(len | (uint16_t)tag << kSDHashSegmentTagShift);
+	memcpy(meta + 1 + sizeof seg0addr, &field, sizeof field);
+
+	uint8_t size = kSDHashSegmentMetaSize + _numberSize(number);
+	number = _BSWAP16(number);
+	memcpy(meta + kSDHashSegmentMetaSize, &number, sizeof number);
+
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	_writeCrc = sdhCrc32c(0, meta, size);
+#endif
+	if (!_card.writeData(meta, size, 0)) return SDH_ERR_SD;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_writeSegmentBytes(const uint8_t *data, SDHDataSize len, uint16_t ofs) {
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	if (_writeChecked) _writeCrc = sdhCrc32c(_writeCrc, data, len);
+#endif
+	if (!_card.writeData(data, len, ofs)) return SDH_ERR_SD;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_finishSegment(SDHDataSize padding) {
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	// the checksum follows the data
+	if (_writeChecked) {
+		uint32_t crc = _BSWAP32(_writeCrc);
+		if (!_card.writeData((uint8_t*)&crc, sizeof crc, SDHASH_BLOCK_SIZE - padding)) return SDH_ERR_SD;
+		padding -= sizeof crc;
+	}
+#endif
+	if (!_card.writeDataPadding(padding)) return SDH_ERR_SD;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_writeSegmentData(SDHAddress seg0addr, SDHWriteSource *src, SDHDataSize len, SDHSegmentCount number) {
+	uint8_t ofs = kSDHashSegmentMetaSize + _numberSize(number);
+
+	uint8_t ret = _writeSegmentMeta(seg0addr, len, number);
+	if (ret != SDH_OK) return ret;
+
+	if (src && src->source) {
+		// pull the data from the source a few bytes at a time, straight
+		// into the block being written
+		uint8_t chunk[SDHASH_SOURCE_CHUNK_SIZE];
+		uint16_t done = 0;
+		while (done < len) {
+			uint8_t n = min((SDHDataSize)(len - done), (SDHDataSize)sizeof chunk);
+			if (!src->source(src->ctx, chunk, n)) {
+				// the block still has to be completed
+				if (!_card.writeDataPadding(SDHASH_BLOCK_SIZE-ofs-done)) return SDH_ERR_SD;
+				return SDH_ERR_ABORTED;
+			}
+			ret = _writeSegmentBytes(chunk, n, ofs + done);
+			if (ret != SDH_OK) return ret;
+			done += n;
+		}
+	} else if (len) {
+		ret = _writeSegmentBytes(src->data, len, ofs);
+		if (ret != SDH_OK) return ret;
+		src->data += len;
+	}
+	// don't add len to ofs, since len is 16 bit while ret is 8
+
+	return _finishSegment(SDHASH_BLOCK_SIZE-ofs-len);
+}
+
+#ifdef SDHASH_INLINE_FILES
+uint8_t SDHashClass::_inlineLength(SDHAddress seg0addr, SDHDataSize *used) {
+	if (!_card.readData(seg0addr, kSDHashSegment0ExtOffset, sizeof *used, (uint8_t*)used)) return SDH_ERR_SD;
+	*used = _BSWAP16(*used);
+	if (*used > kSDHashInlineSize) return SDH_ERR_CARD;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_rewriteInline(SDHAddress seg0addr, SDHDataSize used, SDHDataSize offset, SDHWriteSource *src, SDHDataSize count, SDHDataSize length) {
+	// segment 0 is written in one go, so whatever it keeps is read first
+	uint8_t block[SDHASH_BLOCK_SIZE];
+	if (!_card.readData(seg0addr, 0, kSDHashInlineDataOffset + min(used, length), block)) return SDH_ERR_SD;
+
+	uint8_t *data = block + kSDHashInlineDataOffset + offset;
+	if (src && src->source) {
+		for (SDHDataSize done = 0; done < count;) {
+			uint8_t n = min((SDHDataSize)(count - done), (SDHDataSize)SDHASH_SOURCE_CHUNK_SIZE);
+			if (!src->source(src->ctx, data + done, n)) return SDH_ERR_ABORTED;
+			done += n;
+		}
+	} else if (count) {
+		memcpy(data, src->data, count);
+		src->data += count;
+	}
+
+	SDHDataSize stored = _BSWAP16(length);
+	memcpy(block + kSDHashSegment0ExtOffset, &stored, sizeof stored);
+	if (!_card.writeBlock(seg0addr, block, kSDHashInlineDataOffset + length)) return SDH_ERR_SD;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_appendInline(SDHFilehandle fh, SDHAddress seg0addr, FileInfo *finfo, SDHWriteSource *src, SDHTransferSize len, uint8_t *head) {
+	SDHDataSize used;
+	uint8_t ret = _inlineLength(seg0addr, &used);
+	if (ret != SDH_OK) return ret;
+	if (len <= kSDHashInlineSize - used) return _rewriteInline(seg0addr, used, used, src, len, used + len);
+
+	// it doesn't fit anymore, so the data moves to segment 1, and the
+	// file carries on like any other
+	uint8_t block[SDHASH_BLOCK_SIZE];
+	if (!_card.readData(seg0addr, 0, kSDHashInlineDataOffset + used, block)) return SDH_ERR_SD;
+	memcpy(head, block, kSDHashSegment0ExtOffset);
+	finfo->flags &= ~kSDHashFileInline;
+	if (!used) return SDH_OK;
+
+	// a segment 1 left behind by a move cut short is written over
+	SDHAddress addr = _segmentAddr(seg0addr, _incHash(fh));
+	SegmentInfo sinfo;
+	ret = _findSeg(seg0addr, &addr, &sinfo, 1);
+	if (ret != SDH_OK && ret != SDH_ERR_FILE_NOT_FOUND) return ret;
+
+	SDHWriteSource kept = {block + kSDHashInlineDataOffset, NULL, NULL};
+	ret = _writeSegment(seg0addr, addr, &kept, used, 1);
+	if (ret != SDH_OK) return ret;
+
+	finfo->segments_count = 2;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_writeSpilled(SDHAddress seg0addr, uint8_t *head, SDHSegmentCount segments_count) {
+	// the count and the flags change together, and the per file type
+	// data starts out zeroed like that of new files
+	uint16_t count = _BSWAP16(segments_count);
+	memcpy(head + 1 + sizeof(SDHFilehandle), &count, sizeof count);
+	head[kSDHashSegment0FlagsOffset] &= ~kSDHashFileInline;
+	if (!_card.writeBlock(seg0addr, head, kSDHashSegment0ExtOffset)) return SDH_ERR_SD;
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	if (seg0addr == _rotSeg0) _rotSeg0 = 0;
+#endif
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_readInline(SDHAddress seg0addr, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len) {
+	SDHDataSize used;
+	uint8_t ret = _inlineLength(seg0addr, &used);
+	if (ret != SDH_OK || offset >= used) return ret;
+
+	SDHDataSize count = min((SDHTransferSize)(used - offset), *len);
+	ret = _readData(target, seg0addr, kSDHashInlineDataOffset + offset, count);
+	if (ret == SDH_OK) *len -= count;
+	return ret;
+}
+#endif
+
+#ifdef SDHASH_COMPRESSION
+// the longest earlier repeat of the bytes at pos within the window, 0 if
+// it is shorter than kSDHashPackMinMatch. Repeats may run into pos.
+static SDHDataSize _packMatch(const uint8_t *data, SDHDataSize pos, SDHDataSize end, uint8_t *dist) {
+	SDHDataSize max = min((SDHDataSize)(end - pos), (SDHDataSize)kSDHashPackMaxMatch);
+	if (max < kSDHashPackMinMatch) return 0;
+
+	SDHDataSize best = 0;
+	SDHDataSize from = pos > kSDHashPackWindow?pos - kSDHashPackWindow:0;
+	// nearest first
+	for (SDHDataSize cand = pos; cand-- > from;) {
+		if (data[cand] != data[pos]) continue;
+
+		SDHDataSize n = 1;
+		while (n < max && data[cand + n] == data[pos + n]) ++n;
+		if (n > best) {
+			best = n;
+			*dist = pos - cand - 1;
+			if (n == max) break;
+		}
+	}
+	return best >= kSDHashPackMinMatch?best:0;
+}
+
+uint8_t SDHashClass::_writePacked(SDHAddress seg0addr, SDHAddress addr, SDHWriteSource *src, SDHDataSize *len, SDHSegmentCount segNumber) {
+	SDHSegmentCount number = _segmentNumber(segNumber);
+	uint16_t ofs = kSDHashSegmentMetaSize + _numberSize(number) + kSDHashPackedHeaderSize;
+	SDHDataSize room = SDHASH_BLOCK_SIZE - kSDHashSegmentCrcSize - ofs;
+
+	// the length goes before the data, so see how much packs into the
+	// segment first, and pack it again while writing
+	SDHDataSize raw = *len;
+	SDHDataSize packed;
+	_packSegment(src->data, &raw, &packed, ofs, false);
+
+	uint16_t header = raw;
+	SDHDataSize stored = packed;
+	if (raw <= min(*len, room)) {
+		// storing it takes as many segments
+		raw = min(*len, room);
+		header = raw | kSDHashPackedStored;
+		stored = raw;
+	}
+
+	uint8_t ret;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	ret = _markChecked();
+	if (ret != SDH_OK) return ret;
+#endif
+	if (!_card.writeStart(addr, 1)) return SDH_ERR_SD;
+
+	ret = _writeSegmentMeta(seg0addr, kSDHashPackedHeaderSize + stored, number);
+	if (ret != SDH_OK) return ret;
+
+	uint16_t field = _BSWAP16(header);
+	ret = _writeSegmentBytes((uint8_t*)&field, sizeof field, ofs - kSDHashPackedHeaderSize);
+	if (ret != SDH_OK) return ret;
+
+	if (header & kSDHashPackedStored) ret = _writeSegmentBytes(src->data, raw, ofs);
+	else ret = _packSegment(src->data, &raw, &packed, ofs, true);
+	if (ret != SDH_OK) return ret;
+
+	ret = _finishSegment(SDHASH_BLOCK_SIZE - ofs - stored);
+	if (ret != SDH_OK) return ret;
+	if (!_card.writeStop()) return SDH_ERR_SD;
+
+	src->data += raw;
+	*len = raw;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_packSegment(const uint8_t *data, SDHDataSize *raw, SDHDataSize *packed, uint16_t ofs, bool emit) {
+	// a group is written once all its items are known
+	uint8_t group[1 + 8*2];
+	uint8_t used = 0;
+	uint8_t items = 0;
+	SDHDataSize room = SDHASH_BLOCK_SIZE - kSDHashSegmentCrcSize - ofs;
+	SDHDataSize pos = 0;
+	SDHDataSize out = 0;
+
+	while (pos < *raw) {
+		uint8_t dist;
+		SDHDataSize n = _packMatch(data, pos, *raw, &dist);
+
+		uint8_t size = n?2:1;
+		if (!items) size += 1;
+		if (out + size > room) break;
+		out += size;
+
+		if (!items) {
+			group[0] = 0;
+			used = 1;
+		}
+		if (n) {
+			group[0] |= 1 << items;
+			group[used++] = dist;
+			group[used++] = n - kSDHashPackMinMatch;
+			pos += n;
+		} else group[used++] = data[pos++];
+
+		if (++items == 8) {
+			if (emit && _writeSegmentBytes(group, used, ofs) != SDH_OK) return SDH_ERR_SD;
+			ofs += used;
+			items = 0;
+		}
+	}
+	if (items && emit && _writeSegmentBytes(group, used, ofs) != SDH_OK) return SDH_ERR_SD;
+
+	*raw = pos;
+	*packed = out;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_unpackSegment(SDHReadTarget *target, SDHAddress addr, uint16_t ofs, SDHDataSize packed, SDHDataSize offset, SDHDataSize count, uint32_t *crc) {
+#ifndef SDHASH_SEGMENT_CHECKSUMS
+	(void)crc;
+#endif
+	if (!count) return SDH_OK;
+
+	// the bytes unpacked last, indexed by their position modulo the
+	// window, which copies come from and which are handed over from
+	uint8_t ring[kSDHashPackWindow];
+	uint8_t in[kSDHashUnpackChunk];
+	uint8_t inPos = 0;
+	uint8_t inLen = 0;
+
+	SDHDataSize pos = 0;
+	SDHDataSize end = offset + count;
+	uint8_t pending = 0;
+	uint8_t flags = 0;
+	uint8_t items = 0;
+	uint8_t ret;
+
+	while (pos < end) {
+		// an item with its flag byte is at most 3 bytes
+		if (inLen - inPos < 3 && packed) {
+			memmove(in, in + inPos, inLen - inPos);
+			inLen -= inPos;
+			inPos = 0;
+			uint8_t n = min(packed, (SDHDataSize)(sizeof in - inLen));
+			if (!_card.readData(addr, ofs, n, in + inLen)) return SDH_ERR_SD;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+			if (crc) *crc = sdhCrc32c(*crc, in + inLen, n);
+#endif
+			ofs += n;
+			packed -= n;
+			inLen += n;
+		}
+
+		if (!items) {
+			if (inPos == inLen) return SDH_ERR_CARD;
+			flags = in[inPos++];
+			items = 8;
+		}
+
+		SDHDataSize n = 1;
+		uint16_t dist = 0;
+		if (flags & 1) {
+			if (inLen - inPos < 2) return SDH_ERR_CARD;
+			dist = in[inPos] + 1;
+			n = in[inPos + 1] + kSDHashPackMinMatch;
+			inPos += 2;
+			if (dist > pos) return SDH_ERR_CARD;
+		} else if (inPos == inLen) return SDH_ERR_CARD;
+		flags >>= 1;
+		items -= 1;
+
+		for (; n && pos < end; --n) {
+			// the window is 256 bytes, so a byte wide position wraps
+			// around it
+			ring[(uint8_t)pos] = dist?ring[(uint8_t)(pos - dist)]:in[inPos++];
+			pos += 1;
+
+			if (pos > offset && ++pending == SDHASH_SINK_CHUNK_SIZE) {
+				ret = _unpackedOut(target, ring, (uint8_t)pos, pending);
+				if (ret != SDH_OK) return ret;
+				pending = 0;
+			}
+		}
+	}
+
+	ret = SDH_OK;
+	if (pending) ret = _unpackedOut(target, ring, (uint8_t)pos, pending);
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	// the packed bytes past what was unpacked are checked too
+	if (ret == SDH_OK && crc) ret = _checkRest(addr, ofs, ofs + packed, *crc);
+#endif
+	return ret;
+}
+
+uint8_t SDHashClass::_unpackedOut(SDHReadTarget *target, const uint8_t *ring, uint8_t end, uint8_t count) {
+	uint8_t start = end - count;
+	while (count) {
+		uint8_t n = min((uint16_t)count, (uint16_t)(kSDHashPackWindow - start));
+		if (!target->sink) {
+			memcpy(target->dest, ring + start, n);
+			target->dest += n;
+		} else if (!target->sink(target->ctx, ring + start, n)) return SDH_ERR_ABORTED;
+
+		start += n;
+		count -= n;
+	}
+	return SDH_OK;
+}
+#endif
+
+#ifdef SDHASH_RING_FILES
+uint8_t SDHashClass::_ringSeqAt(SDHAddress seg0addr, SDHFilehandle fh, SDHSegmentCount segNumber, uint32_t *key, uint32_t *seq) {
+	*key = fh;
+	for (SDHSegmentCount cnt = 0; cnt < segNumber; ++cnt) {
+		*key = _incHash(*key);
+	}
+
+	SDHAddress addr = _segmentAddr(seg0addr, *key);
+	SegmentInfo sinfo;
+	uint8_t ret = _findSeg(seg0addr, &addr, &sinfo, segNumber);
+	if (ret == SDH_ERR_FILE_NOT_FOUND) return SDH_ERR_MISSIG_SEGMENT;
+	if (ret != SDH_OK) return ret;
+	if (sinfo.length < kSDHashRingHeaderSize) return SDH_ERR_MISSIG_SEGMENT;
+
+	if (!_card.readData(addr, _dataOffset(&sinfo), sizeof *seq, (uint8_t*)seq)) return SDH_ERR_SD;
+	*seq = _BSWAP32(*seq);
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_findRingHead(SDHFilehandle fh, SDHAddress seg0addr, SDHSegmentCount capacity) {
+	if (seg0addr == _ringSeg0) return SDH_OK;
+
+	// segments are numbered one more than the segment before, so those
+	// up to the newest follow on from segment 1, while the ones after it
+	// were written a round earlier
+	uint32_t key, seq, first;
+	uint8_t ret = _ringSeqAt(seg0addr, fh, 1, &key, &first);
+	if (ret != SDH_OK) return ret;
+
+	SDHSegmentCount head = 1, last = capacity;
+	uint32_t headKey = key, headSeq = first;
+	while (head < last) {
+		SDHSegmentCount mid = last - (last - head) / 2;
+		ret = _ringSeqAt(seg0addr, fh, mid, &key, &seq);
+		if (ret != SDH_OK) return ret;
+
+		if (seq == first + mid - 1) {
+			head = mid;
+			headKey = key;
+			headSeq = seq;
+		} else last = mid - 1;
+	}
+
+	_ringSeg0 = seg0addr;
+	_ringHead = head;
+	_ringKey = headKey;
+	_ringSeq = headSeq;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_appendRing(SDHFilehandle fh, SDHAddress seg0addr, SDHSegmentCount capacity, SDHWriteSource *src, SDHTransferSize len) {
+	// a source giving up would leave the oldest segment lost for
+	// nothing
+	if (src->source) return SDH_ERR_INVALID_ARGUMENT;
+	// an append can't overwrite itself
+	if (((uint32_t)len + kSDHashRingDataSize - 1) / kSDHashRingDataSize > capacity) return SDH_ERR_DATA_OVERFLOW;
+
+	uint8_t ret = _findRingHead(fh, seg0addr, capacity);
+	if (ret != SDH_OK) return ret;
+
+	SDHDataSize seg_len;
+	do {
+		seg_len = min((SDHTransferSize)kSDHashRingDataSize, len);
+		// the oldest segment follows the newest, and segment 1 the last
+		SDHSegmentCount segNumber = _ringHead % capacity + 1;
+		uint32_t key = _incHash(segNumber == 1?(uint32_t)fh:_ringKey);
+		SDHAddress seg_addr = _segmentAddr(seg0addr, key);
+
+		SegmentInfo sinfo;
+		ret = _findSeg(seg0addr, &seg_addr, &sinfo, segNumber);
+		if (ret == SDH_ERR_FILE_NOT_FOUND) ret = SDH_ERR_MISSIG_SEGMENT;
+		if (ret == SDH_OK) ret = _writeRingSegment(seg0addr, seg_addr, src->data, seg_len, segNumber, _ringSeq + 1);
+		if (ret != SDH_OK) {
+			// look for the newest segment again next time
+			_ringSeg0 = 0;
+			return ret;
+		}
+
+		_ringHead = segNumber;
+		_ringKey = key;
+		_ringSeq += 1;
+		src->data += seg_len;
+		len -= seg_len;
+	} while (len > 0);
+
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_writeRingSegment(SDHAddress seg0addr, SDHAddress addr, const uint8_t *data, SDHDataSize len, SDHSegmentCount segNumber, uint32_t seq) {
+	uint8_t ret;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	ret = _markChecked();
+	if (ret != SDH_OK) return ret;
+#endif
+	if (!_card.writeStart(addr, 1)) return SDH_ERR_SD;
+
+	ret = _writeSegmentMeta(seg0addr, kSDHashRingHeaderSize + len, _segmentNumber(segNumber));
+	if (ret != SDH_OK) return ret;
+
+	seq = _BSWAP32(seq);
+	ret = _writeSegmentBytes((uint8_t*)&seq, sizeof seq, kSDHashRingHeaderOffset);
+	if (ret != SDH_OK) return ret;
+	if (len) {
+		ret = _writeSegmentBytes(data, len, kSDHashRingHeaderOffset + kSDHashRingHeaderSize);
+		if (ret != SDH_OK) return ret;
+	}
+
+	ret = _finishSegment(SDHASH_BLOCK_SIZE - kSDHashRingHeaderOffset - kSDHashRingHeaderSize - len);
+	if (ret != SDH_OK) return ret;
+	if (!_card.writeStop()) return SDH_ERR_SD;
+	return SDH_OK;
+}
+#endif
+
+#ifdef STREAM_FILES_ENABLED
+uint8_t SDHashClass::_statExtent(SDHAddress seg0addr, SDHAddress *extent, SDHBucketCount *blocks, SDHBucketCount *used) {
+	uint8_t ext[kSDHashStreamExtSize];
+	if (!_card.readData(seg0addr, kSDHashSegment0ExtOffset, sizeof ext, ext)) return SDH_ERR_SD;
+
+	if (extent) {
+		memcpy(extent, ext, sizeof *extent);
+		*extent = _BSWAP32(*extent);
+	}
+	if (blocks) {
+		memcpy(blocks, ext + sizeof(SDHAddress), sizeof *blocks);
+		*blocks = _BSWAP32(*blocks);
+	}
+	if (used) {
+		memcpy(used, ext + sizeof(SDHAddress) + sizeof(SDHBucketCount), sizeof *used);
+		*used = _BSWAP32(*used);
+	}
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_findExtent(SDHAddress addr, SDHAddress skip, SDHBucketCount blocks, SDHAddress *extent) {
+	SDHAddress end = _hashInfo.base + _hashInfo.buckets;
+	if (blocks > _hashInfo.buckets - 1) return SDH_ERR_NO_SPACE;
+
+	// walk the table once with a multi-block read, looking at the type
+	// byte of every bucket. Runs can't wrap around the end of the table.
+	if (!_card.readStart(addr)) return SDH_ERR_SD;
+
+	SDHBucketCount run = 0;
+	for (SDHBucketCount scanned = 1; scanned < _hashInfo.buckets; ++scanned) {
+		uint8_t type;
+		if (!_card.readNext(&type, sizeof type)) return SDH_ERR_SD;
+
+		if (addr != skip && type != kSDHashSegment0 && type != kSDHashSegment && type != kSDHashSegmentCount && type != kSDHashSegmentChecked) {
+			run += 1;
+			if (run == blocks) {
+				*extent = addr + 1 - blocks;
+				return _card.readStop()?SDH_OK:SDH_ERR_SD;
+			}
+		} else run = 0;
+
+		addr += 1;
+		if (addr == end) {
+			addr = _hashInfo.base + 1;
+			run = 0;
+			if (!_card.readStop()) return SDH_ERR_SD;
+			if (!_card.readStart(addr)) return SDH_ERR_SD;
+		} else if (!_card.readNext(NULL, SDHASH_BLOCK_SIZE - sizeof type)) return SDH_ERR_SD;
+	}
+
+	if (!_card.readStop()) return SDH_ERR_SD;
+	return SDH_ERR_NO_SPACE;
+}
+
+uint8_t SDHashClass::_appendStream(SDHAddress seg0addr, SDHWriteSource *src, SDHTransferSize len) {
+	SDHAddress extent;
+	SDHBucketCount blocks, used;
+	uint8_t ret = _statExtent(seg0addr, &extent, &blocks, &used);
+	if (ret != SDH_OK) return ret;
+
+	SDHBucketCount count = ((SDHBucketCount)len + kSDHashSegmentFillSize - 1) / kSDHashSegmentFillSize;
+	if (count > blocks - used) return SDH_ERR_NO_SPACE;
+
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	ret = _markChecked();
+	if (ret != SDH_OK) return ret;
+#endif
+	// everything goes out in one multi-block write, no probing required
+	if (!_card.writeStart(extent + used, count)) return SDH_ERR_SD;
+
+	SDHDataSize seg_len;
+	SDHBucketCount written = 0;
+	do {
+		seg_len = min((SDHTransferSize)kSDHashSegmentFillSize, len);
+		ret = _writeSegmentData(seg0addr, src, seg_len, 0);
+		// an aborted segment is left past the end of the used blocks,
+		// where nobody looks at it
+		if (ret == SDH_ERR_ABORTED) break;
+		if (ret != SDH_OK) return ret;
+
+		len -= seg_len;
+		written += 1;
+	} while (len > 0);
+
+	if (!_card.writeStop()) return SDH_ERR_SD;
+
+	used = _BSWAP32(used + written);
+	uint8_t err = _updateSeg0Meta(seg0addr, kSDHashSegment0ExtOffset + sizeof(SDHAddress) + sizeof(SDHBucketCount), &used, sizeof used);
+	return err == SDH_OK?ret:err;
+}
+
+uint8_t SDHashClass::_readNext(SDHReadTarget *target, SDHDataSize count, uint32_t *crc) {
+#ifndef SDHASH_SEGMENT_CHECKSUMS
+	(void)crc;
+#endif
+	if (!target->sink && target->dest) {
+		if (!_card.readNext(target->dest, count)) return SDH_ERR_SD;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+		if (crc) *crc = sdhCrc32c(*crc, target->dest, count);
+#endif
+		target->dest += count;
+		return SDH_OK;
+	}
+
+	// a target without a buffer or sink only takes the CRC
+	uint8_t chunk[SDHASH_SINK_CHUNK_SIZE];
+	while (count) {
+		uint8_t n = min(count, (SDHDataSize)sizeof chunk);
+		if (!_card.readNext(chunk, n)) return SDH_ERR_SD;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+		if (crc) *crc = sdhCrc32c(*crc, chunk, n);
+#endif
+		if (target->sink && !target->sink(target->ctx, chunk, n)) {
+			_card.readStop();
+			return SDH_ERR_ABORTED;
+		}
+
+		count -= n;
+	}
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_readStream(SDHAddress seg0addr, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len) {
+	SDHAddress extent;
+	SDHBucketCount used;
+	uint8_t ret = _statExtent(seg0addr, &extent, NULL, &used);
+	if (ret != SDH_OK) return ret;
+
+	if (!used || !*len) return SDH_OK;
+
+	// read the extent front to back in one multi-block read. We still
+	// have to look at every block's metadata since appends don't
+	// necessarily fill their last block.
+	if (!_card.readStart(extent)) return SDH_ERR_SD;
+
+	for (; used && *len; used-=1) {
+		uint8_t meta[kSDHashSegmentMetaSize];
+		if (!_card.readNext(meta, sizeof meta)) return SDH_ERR_SD;
+
+		SDHDataSize seg_len;
+		memcpy(&seg_len, meta+1+sizeof(SDHAddress), sizeof seg_len);
+		seg_len = _BSWAP16(seg_len) & kSDHashSegmentLengthMask;
+
+		SDHDataSize skip = kSDHashSegmentDataSize;
+		if (offset >= seg_len) {
+			offset -= seg_len;
+		} else {
+			SDHDataSize bytesRead = min((SDHTransferSize)(seg_len-offset), *len);
+			uint32_t *check = NULL;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+			// segments read from are read through the CRC up to
+			// their checksum
+			uint32_t crc;
+			SDHReadTarget around = {NULL, NULL, NULL};
+			if (meta[0] == kSDHashSegmentChecked) {
+				if (seg_len + sizeof crc > kSDHashSegmentDataSize) {
+					_card.readStop();
+					return SDH_ERR_CHECKSUM;
+				}
+				crc = sdhCrc32c(0, meta, sizeof meta);
+				check = &crc;
+				ret = _readNext(&around, offset, check);
+				if (ret != SDH_OK) return ret;
+			} else
+#endif
+			if (!_card.readNext(NULL, offset)) return SDH_ERR_SD;
+			ret = _readNext(target, bytesRead, check);
+			if (ret != SDH_OK) return ret;
+
+			*len -= bytesRead;
+			skip -= offset + bytesRead;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+			if (check) {
+				uint32_t stored;
+				ret = _readNext(&around, seg_len - offset - bytesRead, check);
+				if (ret != SDH_OK) return ret;
+				if (!_card.readNext((uint8_t*)&stored, sizeof stored)) return SDH_ERR_SD;
+				skip -= seg_len - offset - bytesRead + sizeof stored;
+				if (_BSWAP32(stored) != crc) {
+					_card.readStop();
+					return SDH_ERR_CHECKSUM;
+				}
+			}
+#endif
+			offset = 0;
+		}
+
+		// no point reading the rest of the block if we are done
+		if (*len && !_card.readNext(NULL, skip)) return SDH_ERR_SD;
+	}
+
+	if (!_card.readStop()) return SDH_ERR_SD;
+
+	return SDH_OK;
+}
+#endif
+
+#ifdef LOGGING_ENABLED
+uint8_t SDHashClass::_appendLog(SDHLogEntryType type, SDHAddress seg0addr) {
+	uint8_t entry[sizeof type + sizeof seg0addr];
+	SDHAddress stored = _BSWAP32(seg0addr);
+	memcpy(entry, &stored, sizeof stored);
+	entry[sizeof stored] = type;
+#ifdef SDHASH_ONLINE_GROWTH
+	// the log may be in the other table than the file being changed
+	SDHBucketCount probeBuckets = _hashInfo.probeBuckets;
+#endif
+	uint8_t ret = appendFile(kSDHashLogFilenameHash, entry, sizeof entry);
+#ifdef SDHASH_NAME_INDEX
+	if (ret == SDH_OK) ret = _indexEntry(type, seg0addr);
+#endif
+#ifdef SDHASH_ONLINE_GROWTH
+	_hashInfo.probeBuckets = probeBuckets;
+#endif
+	return ret;
+}
+
+uint8_t SDHashClass::_logCreate(SDHAddress seg0addr, SDHFilehandle fh, const char *filename) {
+	// names shorter than the prefix aren't hidden either, deleteFile logs them
+	if (strncmp(filename, kSDHashHiddenFilenamePrefix, kSDHashHiddenFilenamePrefixLen)) {
+		return _appendLog(kSDHashLogCreate, seg0addr);
+	}
+	// so begin() can find every file in the log
+	if ((_hashInfo.flags & kSDHashTableLoggedCreates) && fh != kSDHashLogFilenameHash) {
+		return _appendLog(kSDHashLogCreateHidden, seg0addr);
+	}
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_logDelete(SDHAddress seg0addr) {
+	// check to see if this is a hidden file
+	uint8_t prefix[kSDHashHiddenFilenamePrefixLen];
+	if (!_card.readData(seg0addr, kSDHashSegment0MetaHeaderSize,sizeof prefix, prefix)) {
+		return SDH_ERR_SD;
+	}
+
+	// if it ISN'T then append operation to the log
+	if (memcmp(prefix, kSDHashHiddenFilenamePrefix, sizeof prefix)) return _appendLog(kSDHashLogDelete, seg0addr);
+	return SDH_OK;
+}
+#endif
+
+#ifdef SDHASH_BLOOM_FILTER_BITS
+// the filehandle is a hash already, so the indices are derived from it by
+// double hashing
+static uint16_t _bloomIndex(SDHFilehandle fh, uint8_t idx) {
+	uint32_t h1 = (uint32_t)fh;
+	uint32_t h2 = ((uint32_t)(fh >> 16) ^ (h1 << 16)) | 1;
+	return (h1 + idx * h2) % SDHASH_BLOOM_FILTER_BITS;
+}
+
+void SDHashClass::_bloomAdd(SDHFilehandle fh) {
+	for (uint8_t idx = 0; idx < kSDHashBloomHashes; ++idx) {
+		uint16_t bit = _bloomIndex(fh, idx);
+		_bloom[bit >> 3] |= 1 << (bit & 7);
+	}
+}
+
+bool SDHashClass::_bloomMayContain(SDHFilehandle fh) {
+	for (uint8_t idx = 0; idx < kSDHashBloomHashes; ++idx) {
+		uint16_t bit = _bloomIndex(fh, idx);
+		if (!(_bloom[bit >> 3] & (1 << (bit & 7)))) return false;
+	}
+	return true;
+}
+
+uint8_t SDHashClass::_buildBloom() {
+#ifdef LOGGING_ENABLED
+	if (_hashInfo.flags & kSDHashTableLoggedCreates) {
+		memset(_bloom, 0, sizeof _bloom);
+		_bloomAdd(kSDHashLogFilenameHash);
+		uint8_t ret = _bloomFromLog();
+		if (ret != SDH_ERR_MISSIG_SEGMENT) return ret;
+	}
+#endif
+	// finding the files otherwise means reading every bucket, which takes
+	// minutes on a big card, so the filter is left off and lookups go to
+	// the card
+	memset(_bloom, 0xff, sizeof _bloom);
+	return SDH_OK;
+}
+
+#ifdef LOGGING_ENABLED
+uint8_t SDHashClass::_bloomFromLog() {
+	FileInfo finfo;
+	SDHAddress logAddr;
+	uint8_t ret = statFile(kSDHashLogFilenameHash, &finfo, &logAddr);
+	if (ret == SDH_ERR_FILE_NOT_FOUND) return SDH_ERR_MISSIG_SEGMENT;
+	if (ret != SDH_OK) return ret;
+
+	// every entry was appended on its own, so fills a segment, and is as
+	// wide as the SDHLogEntryType of the build that wrote it
+	uint32_t key = kSDHashLogFilenameHash;
+	_card.partialBlockRead(true);
+	for (SDHSegmentCount seg = 1; seg < finfo.segments_count && ret == SDH_OK; ++seg) {
+		key = _incHash(key);
+		SDHAddress addr = _segmentAddr(logAddr, key);
+		SegmentInfo sinfo;
+		ret = _findSeg(logAddr, &addr, &sinfo, seg);
+		if (ret == SDH_ERR_FILE_NOT_FOUND) ret = SDH_ERR_MISSIG_SEGMENT;
+		if (ret != SDH_OK || sinfo.length <= sizeof(SDHAddress)) continue;
+
+		uint8_t entry[sizeof(SDHAddress) + 1];
+		if (!_card.readData(addr, _dataOffset(&sinfo), sizeof entry, entry)) {
+			ret = SDH_ERR_SD;
+			break;
+		}
+		uint8_t type = entry[sizeof(SDHAddress)];
+		if (type != kSDHashLogCreate && type != kSDHashLogCreateHidden) continue;
+
+		SDHAddress seg0addr;
+		memcpy(&seg0addr, entry, sizeof seg0addr);
+		seg0addr = _BSWAP32(seg0addr);
+		if (seg0addr <= _hashInfo.base || seg0addr >= _hashInfo.base + _hashInfo.buckets) continue;
+
+		// the file may have been deleted since, and its bucket
+		// reused by another file, which is logged as well then
+		FileInfo info;
+		ret = _statSeg(seg0addr, kSDHashSegment0, &info, NULL);
+		if (ret == SDH_OK) _bloomAdd(info.hash);
+		else if (ret != SDH_ERR_SD) ret = SDH_OK;
+	}
+	_card.partialBlockRead(false);
+	return ret;
+}
+#endif
+#endif
+
+#ifdef SDHASH_NAME_INDEX
+// orders names byte by byte, shorter names before longer ones they start
+static int8_t _nameCmp(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen) {
+	int cmp = memcmp(a, b, min(alen, blen));
+	if (cmp) return cmp < 0?-1:1;
+	return alen < blen?-1:alen > blen;
+}
+
+// offset of the first record of a leaf that isn't before name, or for inner
+// pages of the first record past the child name belongs in
+static SDHDataSize _indexSeek(const uint8_t *page, SDHDataSize len, const uint8_t *name, size_t namelen, SDHSegmentCount *child) {
+	uint8_t valueSize = page[0]?sizeof(SDHSegmentCount):sizeof(SDHAddress);
+	SDHDataSize ofs = kSDHashIndexPageHeader;
+	if (child) {
+		memcpy(child, page + 1, sizeof *child);
+		*child = _BSWAP16(*child);
+	}
+	while (ofs < len) {
+		int8_t cmp = _nameCmp(page + ofs + 1, page[ofs], name, namelen);
+		if (cmp > 0 || (!cmp && !page[0])) break;
+		if (child) {
+			memcpy(child, page + ofs + 1 + page[ofs], sizeof *child);
+			*child = _BSWAP16(*child);
+		}
+		ofs += 1 + page[ofs] + valueSize;
+	}
+	return ofs;
+}
+
+uint8_t SDHashClass::_checkIndex() {
+	if (!(_hashInfo.flags & kSDHashTableSegmentTags)) return SDH_OK;
+	FileInfo finfo;
+	uint8_t ret = statFile(kSDHashLogFilenameHash, &finfo, NULL);
+	if (ret == SDH_ERR_SD) return ret;
+	if (ret != SDH_OK) return SDH_OK;
+
+	// updates after the last one that completed got lost to a reset
+	SDHIndexInfo idx;
+	SDHSegmentCount stamp;
+	ret = _openIndex(&idx, &stamp);
+	if (ret == SDH_ERR_SD) return ret;
+	_indexValid = ret == SDH_OK && stamp == finfo.segments_count;
+	if (!_indexValid) {
+		Serial_println("name index is out of date");
+	}
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_openIndex(SDHIndexInfo *idx, SDHSegmentCount *stamp) {
+	FileInfo finfo;
+	idx->fh = kSDHashIndexFilenameHash;
+	uint8_t ret = statFile(idx->fh, &finfo, &idx->seg0addr);
+	if (ret != SDH_OK) return ret;
+	idx->flags = finfo.flags;
+	idx->segments = finfo.segments_count;
+	// rebuildIndex got reset before writing the meta page
+	if (idx->segments <= kSDHashIndexMetaPage) return SDH_ERR_MISSIG_SEGMENT;
+
+	uint8_t meta[kSDHashIndexMetaSize];
+	SDHDataSize len = sizeof meta;
+	ret = _loadPage(idx, kSDHashIndexMetaPage, meta, &len, &idx->metaAddr);
+	if (ret != SDH_OK) return ret;
+	if (len != sizeof meta) return SDH_ERR_MISSIG_SEGMENT;
+
+	SDHSegmentCount fields[3];
+	memcpy(fields, meta, sizeof fields);
+	*stamp = _BSWAP16(fields[0]);
+	idx->root = _BSWAP16(fields[1]);
+	idx->pages = _BSWAP16(fields[2]);
+	if (idx->pages > idx->segments || idx->root <= kSDHashIndexMetaPage || idx->root >= idx->pages) return SDH_ERR_MISSIG_SEGMENT;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_storeMeta(SDHIndexInfo *idx, SDHSegmentCount stamp) {
+	SDHSegmentCount fields[3] = {_BSWAP16(stamp), _BSWAP16(idx->root), _BSWAP16(idx->pages)};
+	uint8_t meta[kSDHashIndexMetaSize];
+	memcpy(meta, fields, sizeof meta);
+	SDHWriteSource src = {meta, NULL, NULL};
+	return _writeSegment(idx->seg0addr, idx->metaAddr, &src, sizeof meta, kSDHashIndexMetaPage);
+}
+
+uint8_t SDHashClass::_pageAddr(SDHIndexInfo *idx, SDHSegmentCount page, SDHAddress *addr, SegmentInfo *sinfo) {
+#ifdef SDHASH_ONLINE_GROWTH
+	// visitors and the log may have been looked up since
+	_useGeometry(idx->flags);
+#endif
+	SDHFilehandle key = idx->fh;
+	for (SDHSegmentCount cnt = page; cnt; --cnt) key = _incHash(key);
+
+	*addr = _segmentAddr(idx->seg0addr, key);
+	uint8_t ret = _findSeg(idx->seg0addr, addr, sinfo, page);
+	if (ret == SDH_ERR_FILE_NOT_FOUND || ret == SDH_ERR_NO_SPACE) return SDH_ERR_MISSIG_SEGMENT;
+	return ret;
+}
+
+uint8_t SDHashClass::_loadPage(SDHIndexInfo *idx, SDHSegmentCount page, uint8_t *data, SDHDataSize *len, SDHAddress *addrPtr) {
+	SDHAddress addr;
+	SegmentInfo sinfo;
+	uint8_t ret = _pageAddr(idx, page, &addr, &sinfo);
+	if (ret != SDH_OK) return ret;
+	if (sinfo.length > *len) return SDH_ERR_MISSIG_SEGMENT;
+
+	*len = sinfo.length;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+	if (sinfo.checked) {
+		SDHReadTarget target = {data, NULL, NULL};
+		ret = _readChecked(&target, addr, &sinfo, _dataOffset(&sinfo), sinfo.length);
+		if (ret != SDH_OK) return ret;
+	} else
+#endif
+	if (sinfo.length && !_card.readData(addr, _dataOffset(&sinfo), sinfo.length, data)) return SDH_ERR_SD;
+	if (addrPtr) *addrPtr = addr;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_newPage(SDHIndexInfo *idx, uint8_t *data, SDHDataSize len) {
+	// the index never gives segments back, freeing them would end the
+	// probe paths of files that were put past them
+	if (idx->pages < idx->segments) {
+		SDHAddress addr;
+		SegmentInfo sinfo;
+		uint8_t ret = _pageAddr(idx, idx->pages, &addr, &sinfo);
+		if (ret != SDH_OK) return ret;
+		SDHWriteSource src = {data, NULL, NULL};
+		ret = _writeSegment(idx->seg0addr, addr, &src, len, idx->pages);
+		if (ret != SDH_OK) return ret;
+	} else {
+		uint8_t ret = appendFile(idx->fh, data, len);
+		if (ret != SDH_OK) return ret;
+		idx->segments += 1;
+	}
+	idx->pages += 1;
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::_findLeaf(SDHIndexInfo *idx, const uint8_t *name, size_t namelen, uint8_t *page, SDHDataSize *len, SDHAddress *addr, SDHSegmentCount *path, uint8_t *depth) {
+	SDHSegmentCount pageNumber = idx->root;
+	for (uint8_t level = 0;; ++level) {
+		// a loop in the tree
+		if (level == kSDHashIndexMaxDepth) return SDH_ERR_MISSIG_SEGMENT;
+		if (path) {
+			path[level] = pageNumber;
+			*depth = level + 1;
+		}
+
+		*len = kSDHashSegmentDataSize;
+		uint8_t ret = _loadPage(idx, pageNumber, page, len, addr);
+		if (ret != SDH_OK) return ret;
+		if (*len < kSDHashIndexPageHeader) return SDH_ERR_MISSIG_SEGMENT;
+		if (!page[0]) return SDH_OK;
+
+		_indexSeek(page, *len, name, namelen, &pageNumber);
+		if (pageNumber <= kSDHashIndexMetaPage || pageNumber >= idx->pages) return SDH_ERR_MISSIG_SEGMENT;
+	}
+}
+
+uint8_t SDHashClass::_indexInsert(SDHIndexInfo *idx, const uint8_t *name, uint8_t namelen, SDHAddress seg0addr) {
+	// room for a page and the record that overflows it
+	uint8_t page[kSDHashSegmentDataSize + kSDHashIndexMaxRecord];
+	SDHSegmentCount path[kSDHashIndexMaxDepth];
+	uint8_t depth;
+	SDHDataSize len;
+	SDHAddress addr;
+	uint8_t ret = _findLeaf(idx, name, namelen, page, &len, &addr, path, &depth);
+	if (ret != SDH_OK) return ret;
+
+	seg0addr = _BSWAP32(seg0addr);
+	SDHDataSize ofs = _indexSeek(page, len, name, namelen, NULL);
+	if (ofs < len && !_nameCmp(page + ofs + 1, page[ofs], name, namelen)) {
+		// the file moved, only its address changes
+		memcpy(page + ofs + 1 + namelen, &seg0addr, sizeof seg0addr);
+	} else {
+		uint8_t reclen = 1 + namelen + sizeof seg0addr;
+		memmove(page + ofs + reclen, page + ofs, len - ofs);
+		page[ofs] = namelen;
+		memcpy(page + ofs + 1, name, namelen);
+		memcpy(page + ofs + 1 + namelen, &seg0addr, sizeof seg0addr);
+		len += reclen;
+	}
+
+	for (;;) {
+		SDHWriteSource src = {page, NULL, NULL};
+		if (len <= kSDHashIndexPageSize) return _writeSegment(idx->seg0addr, addr, &src, len, path[depth - 1]);
+
+		// split the page in half at a record, the new page taking the
+		// upper half. Inner pages hand the middle record's key up and
+		// its child to the new page as its first.
+		uint8_t level = page[0];
+		uint8_t valueSize = level?sizeof(SDHSegmentCount):sizeof(SDHAddress);
+		SDHDataSize split = kSDHashIndexPageHeader;
+		while (split + 1 + page[split] + valueSize < len / 2) split += 1 + page[split] + valueSize;
+		uint8_t sep[1 + kSDHashMaxFilenameLength];
+		memcpy(sep, page + split, 1 + page[split]);
+		SDHDataSize start = level?split + 1 + sep[0] + valueSize:split;
+
+		// the new page's header goes right before its records, over
+		// bytes that are put back after, or the middle record whose
+		// child is in place already
+		uint8_t header[kSDHashIndexPageHeader];
+		memcpy(header, page + start - sizeof header, sizeof header);
+		page[start - sizeof header] = level;
+		if (!level) memcpy(page + start - sizeof(SDHSegmentCount), page + 1, sizeof(SDHSegmentCount));
+
+		// the new page goes first, it isn't referenced yet
+		SDHSegmentCount right = idx->pages;
+		ret = _newPage(idx, page + start - sizeof header, len - start + sizeof header);
+		if (ret != SDH_OK) return ret;
+		memcpy(page + start - sizeof header, header, sizeof header);
+
+		SDHSegmentCount rightRef = _BSWAP16(right);
+		if (!level) memcpy(page + 1, &rightRef, sizeof rightRef);
+		ret = _writeSegment(idx->seg0addr, addr, &src, split, path[depth - 1]);
+		if (ret != SDH_OK) return ret;
+
+		uint8_t reclen = 1 + sep[0] + sizeof rightRef;
+		if (depth == 1) {
+			// a new root above the old one, which keeps its number
+			SDHSegmentCount leftRef = _BSWAP16(path[0]);
+			page[0] = level + 1;
+			memcpy(page + 1, &leftRef, sizeof leftRef);
+			memcpy(page + kSDHashIndexPageHeader, sep, 1 + sep[0]);
+			memcpy(page + kSDHashIndexPageHeader + 1 + sep[0], &rightRef, sizeof rightRef);
+			SDHSegmentCount root = idx->pages;
+			ret = _newPage(idx, page, kSDHashIndexPageHeader + reclen);
+			if (ret != SDH_OK) return ret;
+			idx->root = root;
+			return SDH_OK;
+		}
+
+		depth -= 1;
+		len = kSDHashSegmentDataSize;
+		ret = _loadPage(idx, path[depth - 1], page, &len, &addr);
+		if (ret != SDH_OK) return ret;
+		ofs = _indexSeek(page, len, sep + 1, sep[0], NULL);
+		memmove(page + ofs + reclen, page + ofs, len - ofs);
+		memcpy(page + ofs, sep, 1 + sep[0]);
+		memcpy(page + ofs + 1 + sep[0], &rightRef, sizeof rightRef);
+		len += reclen;
+	}
+}
+
+uint8_t SDHashClass::_indexRemove(SDHIndexInfo *idx, const uint8_t *name, uint8_t namelen, SDHAddress seg0addr) {
+	uint8_t page[kSDHashSegmentDataSize];
+	SDHSegmentCount path[kSDHashIndexMaxDepth];
+	uint8_t depth;
+	SDHDataSize len;
+	SDHAddress addr;
+	uint8_t ret = _findLeaf(idx, name, namelen, page, &len, &addr, path, &depth);
+	if (ret != SDH_OK) return ret;
+
+	SDHDataSize ofs = _indexSeek(page, len, name, namelen, NULL);
+	if (ofs >= len || _nameCmp(page + ofs + 1, page[ofs], name, namelen)) return SDH_OK;
+	// the file moved here from seg0addr, and is indexed already
+	SDHAddress indexed;
+	memcpy(&indexed, page + ofs + 1 + namelen, sizeof indexed);
+	if (_BSWAP32(indexed) != seg0addr) return SDH_OK;
+
+	// pages are never merged, they are too few to bother
+	uint8_t reclen = 1 + namelen + sizeof indexed;
+	memmove(page + ofs, page + ofs + reclen, len - ofs - reclen);
+	SDHWriteSource src = {page, NULL, NULL};
+	return _writeSegment(idx->seg0addr, addr, &src, len - reclen, path[depth - 1]);
+}
+
+uint8_t SDHashClass::_indexAt(SDHIndexInfo *idx, SDHLogEntryType type, SDHAddress seg0addr) {
+	FileInfo finfo;
+	uint8_t name[kSDHashMaxFilenameLength + 1];
+	uint8_t ret = _statSeg(seg0addr, kSDHashSegment0, &finfo, name);
+	if (ret == SDH_ERR_SD) return ret;
+	if (ret != SDH_OK) return SDH_OK;
+	uint8_t padding = name[kSDHashMaxFilenameLength];
+	if (padding < 1 || padding > kSDHashMaxFilenameLength + 1) return SDH_OK;
+	uint8_t namelen = kSDHashMaxFilenameLength + 1 - padding;
+	// hidden files aren't indexed
+	if (namelen >= kSDHashHiddenFilenamePrefixLen && !memcmp(name, kSDHashHiddenFilenamePrefix, kSDHashHiddenFilenamePrefixLen)) return SDH_OK;
+
+	if (type == kSDHashLogCreate) return _indexInsert(idx, name, namelen, seg0addr);
+	return _indexRemove(idx, name, namelen, seg0addr);
+}
+
+uint8_t SDHashClass::_indexEntry(SDHLogEntryType type, SDHAddress seg0addr) {
+	if (!_indexValid) return SDH_OK;
+
+	// what the index is up to date with once this is done
+	FileInfo finfo;
+	uint8_t ret = statFile(kSDHashLogFilenameHash, &finfo, NULL);
+	if (ret != SDH_OK) return ret;
+	SDHSegmentCount stamp = finfo.segments_count;
+
+	// a reset before the stamp is written leaves the index out of date
+	_indexValid = false;
+	SDHIndexInfo idx;
+	SDHSegmentCount indexed;
+	ret = _openIndex(&idx, &indexed);
+	if (ret == SDH_ERR_SD) return ret;
+	// deleted or broken, findPrefix builds it anew
+	if (ret != SDH_OK) return SDH_OK;
+
+	if (type != kSDHashLogCreateHidden) {
+		ret = _indexAt(&idx, type, seg0addr);
+		if (ret != SDH_OK) return ret;
+	}
+
+	ret = _storeMeta(&idx, stamp);
+	_indexValid = ret == SDH_OK;
+	return ret;
+}
+
+uint8_t SDHashClass::_indexFromLog(SDHIndexInfo *idx, SDHSegmentCount *stamp) {
+	FileInfo logInfo;
+	SDHAddress logAddr;
+	uint8_t ret = statFile(kSDHashLogFilenameHash, &logInfo, &logAddr);
+	if (ret != SDH_OK) return ret;
+	*stamp = logInfo.segments_count;
+
+	// replay the log, looking at whatever is at each address now. A file
+	// deleted since isn't there anymore, and a file that took its bucket
+	// since is removed by the delete and added again by its own entry.
+	// Every entry fills a segment, and is as wide as the SDHLogEntryType of
+	// the build that wrote it. The entries of a segment that went missing
+	// are lost, the files they added aren't indexed.
+	uint32_t key = kSDHashLogFilenameHash;
+	for (SDHSegmentCount seg = 1; seg < logInfo.segments_count; ++seg) {
+		key = _incHash(key);
+#ifdef SDHASH_ONLINE_GROWTH
+		_useGeometry(logInfo.flags);
+#endif
+		SDHAddress addr = _segmentAddr(logAddr, key);
+		SegmentInfo sinfo;
+		ret = _findSeg(logAddr, &addr, &sinfo, seg);
+		if (ret == SDH_ERR_FILE_NOT_FOUND || ret == SDH_ERR_NO_SPACE) continue;
+		if (ret != SDH_OK) return ret;
+		if (sinfo.length <= sizeof(SDHAddress)) continue;
+
+		uint8_t entry[sizeof(SDHAddress) + 1];
+		if (!_card.readData(addr, _dataOffset(&sinfo), sizeof entry, entry)) return SDH_ERR_SD;
+		uint8_t type = entry[sizeof(SDHAddress)];
+		if (type != kSDHashLogCreate && type != kSDHashLogDelete) continue;
+		SDHAddress seg0addr;
+		memcpy(&seg0addr, entry, sizeof seg0addr);
+		seg0addr = _BSWAP32(seg0addr);
+		if (seg0addr <= _hashInfo.base || seg0addr >= _hashInfo.base + _hashInfo.buckets) continue;
+
+		ret = _indexAt(idx, (SDHLogEntryType)type, seg0addr);
+		if (ret != SDH_OK) return ret;
+	}
+	return SDH_OK;
+}
+
+uint8_t SDHashClass::rebuildIndex() {
+	_indexValid = false;
+	if (!_validCard) return SDH_ERR_CARD;
+	// pages of a file can only be told apart by their tags
+	if (!(_hashInfo.flags & kSDHashTableSegmentTags)) return SDH_ERR_CARD;
+
+	// the pages are written over rather than the file deleted, see _newPage
+	SDHIndexInfo idx;
+	FileInfo finfo;
+	idx.fh = kSDHashIndexFilenameHash;
+	uint8_t ret = statFile(idx.fh, &finfo, &idx.seg0addr);
+	if (ret == SDH_ERR_FILE_NOT_FOUND) {
+		ret = createFile(idx.fh, kSDHashIndexFilename);
+		if (ret != SDH_OK) return ret;
+		ret = statFile(idx.fh, &finfo, &idx.seg0addr);
+	}
+	if (ret != SDH_OK) return ret;
+	idx.flags = finfo.flags;
+	idx.segments = finfo.segments_count;
+	idx.pages = kSDHashIndexMetaPage + 1;
+	idx.root = idx.pages;
+
+	// a stamp no log matches until the end, and an empty leaf as the root
+	if (idx.segments <= kSDHashIndexMetaPage) {
+		uint8_t meta[kSDHashIndexMetaSize] = {0};
+		ret = appendFile(idx.fh, meta, sizeof meta);
+		if (ret != SDH_OK) return ret;
+		idx.segments += 1;
+	}
+	SegmentInfo sinfo;
+	ret = _pageAddr(&idx, kSDHashIndexMetaPage, &idx.metaAddr, &sinfo);
+	if (ret != SDH_OK) return ret;
+	ret = _storeMeta(&idx, 0);
+	if (ret != SDH_OK) return ret;
+	uint8_t leaf[kSDHashIndexPageHeader] = {0};
+	ret = _newPage(&idx, leaf, sizeof leaf);
+	if (ret != SDH_OK) return ret;
+
+	SDHSegmentCount stamp;
+	ret = _indexFromLog(&idx, &stamp);
+	if (ret != SDH_OK) return ret;
+
+	ret = _storeMeta(&idx, stamp);
+	_indexValid = ret == SDH_OK;
+	return ret;
+}
+
+uint8_t SDHashClass::findPrefix(const char *prefix, SDHNameVisitor visitor, void *ctx) {
+	if (prefix == NULL) return SDH_ERR_INVALID_ARGUMENT;
+	return _walkIndex(prefix, true, NULL, visitor, ctx);
+}
+
+uint8_t SDHashClass::findRange(const char *first, const char *last, SDHNameVisitor visitor, void *ctx) {
+	if (first == NULL) return SDH_ERR_INVALID_ARGUMENT;
+	return _walkIndex(first, false, last, visitor, ctx);
+}
+
+uint8_t SDHashClass::_walkIndex(const char *first, bool prefix, const char *last, SDHNameVisitor visitor, void *ctx) {
+	if (visitor == NULL) return SDH_ERR_INVALID_ARGUMENT;
+	if (!_validCard) return SDH_ERR_CARD;
+
+	uint8_t ret;
+	if (!_indexValid) {
+		ret = rebuildIndex();
+		if (ret != SDH_OK) return ret;
+	}
+
+	SDHIndexInfo idx;
+	SDHSegmentCount stamp;
+	ret = _openIndex(&idx, &stamp);
+	if (ret != SDH_OK) return ret;
+
+	uint8_t page[kSDHashSegmentDataSize];
+	SDHDataSize len;
+	size_t firstLen = strlen(first);
+	ret = _findLeaf(&idx, (const uint8_t*)first, firstLen, page, &len, NULL, NULL, NULL);
+	if (ret != SDH_OK) return ret;
+	SDHDataSize ofs = _indexSeek(page, len, (const uint8_t*)first, firstLen, NULL);
+
+	// leaves are linked in name order
+	char name[kSDHashMaxFilenameLength + 1];
+	for (SDHSegmentCount leaves = 1;;) {
+		if (ofs >= len) {
+			SDHSegmentCount next;
+			memcpy(&next, page + 1, sizeof next);
+			next = _BSWAP16(next);
+			if (!next) return SDH_OK;
+			if (next <= kSDHashIndexMetaPage || next >= idx.pages || ++leaves >= idx.pages) return SDH_ERR_MISSIG_SEGMENT;
+
+			len = sizeof page;
+			ret = _loadPage(&idx, next, page, &len, NULL);
+			if (ret != SDH_OK) return ret;
+			if (len < kSDHashIndexPageHeader || page[0]) return SDH_ERR_MISSIG_SEGMENT;
+			ofs = kSDHashIndexPageHeader;
+			continue;
+		}
+
+		uint8_t namelen = page[ofs];
+		if (prefix && (namelen < firstLen || memcmp(page + ofs + 1, first, firstLen))) return SDH_OK;
+		if (last && _nameCmp(page + ofs + 1, namelen, (const uint8_t*)last, strlen(last)) >= 0) return SDH_OK;
+
+		memcpy(name, page + ofs + 1, namelen);
+		name[namelen] = '\0';
+		SDHAddress seg0addr;
+		memcpy(&seg0addr, page + ofs + 1 + namelen, sizeof seg0addr);
+		ofs += 1 + namelen + sizeof seg0addr;
+		if (!visitor(ctx, name, _BSWAP32(seg0addr))) return SDH_ERR_ABORTED;
+	}
+}
+#endif
+
+uint32_t SDHashClass::_incHash(uint32_t hash) {
+	return sdhIncHash(hashFunction(), hash);
+}
+
+SDHBucketCount SDHashClass::_probeBuckets() {
+#ifdef SDHASH_ONLINE_GROWTH
+	return _hashInfo.probeBuckets;
+#else
+	return _hashInfo.buckets;
+#endif
+}
+
+SDHAddress SDHashClass::_foldHash(uint32_t hash) {
+	return _hashInfo.base+1+hash%(_probeBuckets()-1);
+}
+
+SDHAddress SDHashClass::_segmentAddr(SDHAddress seg0addr, uint32_t key) {
+#ifdef SDHASH_LOCAL_SEGMENTS
+	if (_hashInfo.flags & kSDHashTableLocalSegments) {
+		// the part of segment 0's allocation unit that lies in the table
+		SDHAddress first = seg0addr & ~(((SDHAddress)1 << _hashInfo.unitShift) - 1);
+		SDHAddress end = first + ((SDHAddress)1 << _hashInfo.unitShift);
+		if (first <= _hashInfo.base) first = _hashInfo.base + 1;
+		if (end > _hashInfo.base + _probeBuckets() || end < first) end = _hashInfo.base + _probeBuckets();
+		return first + key%(end - first);
+	}
+#else
+	(void)seg0addr;
+#endif
+	return _foldHash(key);
+}
+
+SDHAddress SDHashClass::_stepAddr(SDHAddress addr, SDHAddress addr0) {
+	addr += STEP(addr0);
+
+	// wrap around within the table, never onto its header
+	if (addr <= _hashInfo.base) addr = _hashInfo.base + _probeBuckets() - 1;
+	else if (addr >= _hashInfo.base + _probeBuckets()) addr = _hashInfo.base + 1;
+
+	return addr;
+}
+
+uint8_t SDHashClass::_getPartition(SDHBucketCount *limit) {
+	uint8_t dir[sizeof kSDHashPartitionMagic + 1];
+	if (!_card.readData(0, 0, sizeof dir, dir)) return SDH_ERR_SD;
+
+	if (memcmp(dir, kSDHashPartitionMagic, sizeof kSDHashPartitionMagic)) {
+		// not partitioned, the table is the whole card
+		if (_partition) return SDH_ERR_CARD;
+		_hashInfo.base = 0;
+		*limit = _card.cardSize();
+		return SDH_OK;
+	}
+
+	if (_partition >= dir[sizeof kSDHashPartitionMagic]) return SDH_ERR_CARD;
+
+	uint8_t entry[kSDHashPartitionEntrySize];
+	if (!_card.readData(0, sizeof dir + _partition*kSDHashPartitionEntrySize, sizeof entry, entry)) return SDH_ERR_SD;
+
+	memcpy(&_hashInfo.base, entry, sizeof _hashInfo.base);
+	_hashInfo.base = _BSWAP32(_hashInfo.base);
+	memcpy(limit, entry + sizeof _hashInfo.base, sizeof *limit);
+	*limit = _BSWAP32(*limit);
+
+	Serial_print("partition=");
+	Serial_print(_partition, DEC);
+	Serial_print(" base=");
+	Serial_println(_hashInfo.base);
+
+	if (_hashInfo.base + *limit > _card.cardSize()) return SDH_ERR_CARD;
+	return SDH_OK;
+}
+
+#ifdef SDHASH_AUTO_SCK_RATE
+// CRC-16-CCITT
+static uint16_t _crc16(uint16_t crc, const uint8_t *data, uint8_t len) {
+	while (len--) {
+		crc ^= (uint16_t)*data++ << 8;
+		for (uint8_t bit = 0; bit < 8; ++bit) {
+			crc = crc & 0x8000?(crc << 1) ^ 0x1021:crc << 1;
+		}
+	}
+	return crc;
+}
+
+// fills chunk with the next bytes of a pattern flipping plenty of bits
+static void _scratchPattern(uint8_t *chunk, uint8_t len, uint8_t *state) {
+	for (uint8_t idx = 0; idx < len; ++idx) {
+		*state = *state * 29 + 113;
+		chunk[idx] = idx & 1?*state:~*state;
+	}
+}
+
+bool SDHashClass::_roundTrip(SDHAddress addr, uint8_t salt) {
+	// the block goes out and comes back a chunk at a time, so only its
+	// CRC is kept rather than a copy of it
+	uint8_t chunk[16];
+	uint8_t state = salt;
+	uint16_t crc = 0xffff;
+	if (!_card.writeStart(addr, 1)) return false;
+	for (uint16_t ofs = 0; ofs < SDHASH_BLOCK_SIZE; ofs += sizeof chunk) {
+		_scratchPattern(chunk, sizeof chunk, &state);
+		crc = _crc16(crc, chunk, sizeof chunk);
+		if (!_card.writeData(chunk, sizeof chunk, ofs)) return false;
+	}
+	if (!_card.writeStop()) return false;
+
+	uint16_t readCrc = 0xffff;
+	if (!_card.readStart(addr)) return false;
+	for (uint16_t ofs = 0; ofs < SDHASH_BLOCK_SIZE; ofs += sizeof chunk) {
+		if (!_card.readNext(chunk, sizeof chunk)) return false;
+		readCrc = _crc16(readCrc, chunk, sizeof chunk);
+	}
+	return _card.readStop() && readCrc == crc;
+}
+
+uint8_t SDHashClass::tuneSckRate() {
+	if (!(_hashInfo.flags & kSDHashTableTunedRate)) return SDH_ERR_INVALID_ARGUMENT;
+	SDHAddress scratch = _hashInfo.base + _hashInfo.buckets;
+
+	uint8_t rate;
+	for (rate = 0; rate <= kSDHashSlowestSckRate; ++rate) {
+		// the card may have to be brought back after failing
+		if (rate) {
+			_card.writeStop();
+			_card.readEnd();
+		}
+		if (_card.setSckRate(rate) && _roundTrip(scratch, rate)) break;
+	}
+	if (rate > kSDHashSlowestSckRate) {
+		_card.setSckRate(kSDHashSlowestSckRate);
+		return SDH_ERR_SD;
+	}
+
+	// time the transfers at that rate over all the scratch blocks
+	uint8_t chunk[16];
+	uint8_t state = 0;
+	_scratchPattern(chunk, sizeof chunk, &state);
+
+	uint32_t start = SDHASH_LATENCY_CLOCK();
+	for (uint8_t idx = 0; idx < kSDHashScratchBlocks; ++idx) {
+		if (!_card.writeBlock(scratch + idx, chunk, sizeof chunk)) return SDH_ERR_SD;
+	}
+	uint32_t single = SDHASH_LATENCY_CLOCK() - start;
+
+	start = SDHASH_LATENCY_CLOCK();
+	if (!_card.writeStart(scratch, kSDHashScratchBlocks)) return SDH_ERR_SD;
+	for (uint8_t idx = 0; idx < kSDHashScratchBlocks; ++idx) {
+		if (!_card.writeData(chunk, sizeof chunk, 0)) return SDH_ERR_SD;
+		if (!_card.writeDataPadding(SDHASH_BLOCK_SIZE - sizeof chunk)) return SDH_ERR_SD;
+	}
+	if (!_card.writeStop()) return SDH_ERR_SD;
+	uint32_t multi = SDHASH_LATENCY_CLOCK() - start;
+
+	start = SDHASH_LATENCY_CLOCK();
+	if (!_card.readStart(scratch)) return SDH_ERR_SD;
+	for (uint16_t idx = 0; idx < kSDHashScratchBlocks*(SDHASH_BLOCK_SIZE/sizeof chunk); ++idx) {
+		if (!_card.readNext(chunk, sizeof chunk)) return SDH_ERR_SD;
+	}
+	if (!_card.readStop()) return SDH_ERR_SD;
+	uint32_t read = SDHASH_LATENCY_CLOCK() - start;
+
+	_profile.sckRate = rate;
+	_profile.readBlockTicks = min(read / kSDHashScratchBlocks, 0xffffUL);
+	_profile.writeBlockTicks = min(single / kSDHashScratchBlocks, 0xffffUL);
+	_profile.multiWriteBlockTicks = min(multi / kSDHashScratchBlocks, 0xffffUL);
+	Serial_print("sck rate=");
+	Serial_println(rate, DEC);
+
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+	return _writeHeader(_pendingSeg0);
+#else
+	return _writeHeader(0);
+#endif
+}
+
+uint8_t SDHashClass::_setupSckRate() {
+	// tables from before tuning run at full speed, as they always have
+	if (!(_hashInfo.flags & kSDHashTableTunedRate)) {
+		_profile.sckRate = 0;
+		return _card.setSckRate(0)?SDH_OK:SDH_ERR_SD;
+	}
+
+	if (_profile.sckRate <= kSDHashSlowestSckRate) {
+		// the stored rate is kept as long as it reads the header the
+		// same as the slowest rate did
+		uint8_t slow[kSDHashHeaderSizeTuned], fast[kSDHashHeaderSizeTuned];
+		if (!_card.readData(_hashInfo.base, 0, sizeof slow, slow)) return SDH_ERR_SD;
+		if (_card.setSckRate(_profile.sckRate) &&
+				_card.readData(_hashInfo.base, 0, sizeof fast, fast) &&
+				!memcmp(slow, fast, sizeof slow)) {
+			return SDH_OK;
+		}
+		_card.readEnd();
+		Serial_println("stored sck rate failed");
+	}
+	return tuneSckRate();
+}
+#endif
+
+#ifdef SDHASH_ONLINE_GROWTH
+uint8_t SDHashClass::growTable(SDHBucketCount buckets) {
+	if (!_validCard) return SDH_ERR_CARD;
+	if (_hashInfo.oldBuckets) return SDH_ERR_INVALID_ARGUMENT;
+
+	SDHBucketCount limit;
+	uint8_t ret = _getPartition(&limit);
+	if (ret != SDH_OK) return ret;
+	// the scratch blocks move along to the new end
+	if (_hashInfo.flags & kSDHashTableTunedRate) limit -= min(limit, (SDHBucketCount)kSDHashScratchBlocks);
+	if (!buckets) buckets = limit;
+	if (buckets > limit) return SDH_ERR_CARD;
+	if (buckets <= _hashInfo.buckets) return SDH_ERR_INVALID_ARGUMENT;
+
+	// the header mustn't name a pending file across the switch
+	ret = flush();
+	if (ret != SDH_OK) return ret;
+
+	// whatever a copied card held past the table mustn't look like
+	// files, neither must old scratch blocks. Erased blocks read as all
+	// 0x00 or all 0xff depending on the card, both of which are free
+	// blocks, and the card erases them in a fraction of the time writing
+	// zeros over each one takes. Cards that can't erase single blocks
+	// get the zeros.
+	SDHAddress addr = _hashInfo.base + _hashInfo.buckets;
+	SDHAddress end = _hashInfo.base + buckets;
+	if (_card.erase(addr, end - 1)) addr = end;
+	while (addr < end) {
+		uint16_t count = min(end - addr, (SDHAddress)0xffff);
+		ret = zero(addr, count);
+		if (ret != SDH_OK) return ret;
+		addr += count;
+	}
+
+	Serial_print("growing to buckets=");
+	Serial_println(buckets);
+	_hashInfo.oldBuckets = _hashInfo.buckets;
+	_hashInfo.buckets = buckets;
+	_hashInfo.probeBuckets = buckets;
+	_hashInfo.generation ^= kSDHashFileGeneration;
+	_hashInfo.flags |= kSDHashTableGrown;
+	if (_hashInfo.version < 3) _hashInfo.version = 3;
+	_growCursor = _hashInfo.base + 1;
+	_moveFrom = _moveTo = 0;
+	return _writeHeader(0);
+}
+
+uint8_t SDHashClass::growStep() {
+	if (!_hashInfo.oldBuckets) return SDH_OK;
+
+	uint8_t ret;
+	if (_moveFrom) {
+		// a move that failed earlier has to be finished first, its
+		// partial copy is where it would go again
+		ret = _moveFile(_moveFrom, _moveTo, true);
+		if (ret != SDH_OK) return ret;
+	}
+
+	SDHAddress end = _hashInfo.base + _hashInfo.oldBuckets;
+	for (uint8_t cnt = 0; cnt < SDHASH_GROWTH_STEP && _growCursor < end; ++cnt, ++_growCursor) {
+		FileInfo finfo;
+		ret = _statSeg(_growCursor, kSDHashSegment0, &finfo, NULL);
+		if (ret == SDH_ERR_SD) return ret;
+		if (ret != SDH_OK || (finfo.flags & kSDHashFileGeneration) == _hashInfo.generation) continue;
+
+		// the count has to be on the card before copying
+		ret = flush();
+		if (ret != SDH_OK) return ret;
+
+		// where a new file of that name would go
+		_hashInfo.probeBuckets = _hashInfo.buckets;
+		SDHAddress to = _foldHash(finfo.hash);
+		SegmentInfo sinfo;
+		ret = _findSeg(0, &to, &sinfo, 0);
+		if (ret != SDH_ERR_FILE_NOT_FOUND) return ret;
+
+		// begin() finishes the move if we get reset
+		_moveFrom = _growCursor;
+		_moveTo = to;
+		ret = _writeHeader(0);
+		if (ret != SDH_OK) return ret;
+
+		ret = _moveFile(_moveFrom, _moveTo, false);
+		if (ret != SDH_OK) return ret;
+	}
+
+	if (_growCursor >= end) {
+		Serial_println("every file moved");
+		_hashInfo.oldBuckets = 0;
+		_hashInfo.probeBuckets = _hashInfo.buckets;
+		return _writeHeader(0);
+	}
+	return SDH_OK;
+}
+
+SDHBucketCount SDHashClass::growthLeft() {
+	return _hashInfo.oldBuckets?_hashInfo.base + _hashInfo.oldBuckets - _growCursor:0;
+}
+
+void SDHashClass::_useGeometry(uint8_t fileFlags) {
+	// files of the last generation are still where the old table put them
+	bool old = _hashInfo.oldBuckets && (fileFlags & kSDHashFileGeneration) != _hashInfo.generation;
+	_hashInfo.probeBuckets = old?_hashInfo.oldBuckets:_hashInfo.buckets;
+}
+
+uint8_t SDHashClass::_moveFile(SDHAddress from, SDHAddress to, bool resume) {
+	FileInfo finfo;
+	uint8_t name[kSDHashMaxFilenameLength + 1];
+	uint8_t ret = _statSeg(from, kSDHashSegment0, &finfo, name);
+	if (ret == SDH_ERR_SD) return ret;
+	if (ret != SDH_OK || (finfo.flags & kSDHashFileGeneration) == _hashInfo.generation) {
+		// only the header was left to update
+		_moveFrom = _moveTo = 0;
+		return _writeHeader(0);
+	}
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	ret = _resolveSegmentsCount(from, &finfo);
+	if (ret != SDH_OK) return ret;
+	// appending to __LOG replaces the slots left behind
+	SDHAddress slots[SDHASH_ROTATE_SEGMENT_COUNT - 1];
+	uint8_t slotCount = _rotSlotCount;
+	memcpy(slots, _rotSlots, slotCount * sizeof(SDHAddress));
+#endif
+
+	// the padding byte tells us the length
+	uint8_t padding = name[kSDHashMaxFilenameLength];
+	if (padding < 1 || padding > kSDHashMaxFilenameLength + 1) return SDH_ERR_FILENAME;
+	name[kSDHashMaxFilenameLength + 1 - padding] = 0;
+
+	// a copy is complete once it has a segment 0, so a move that got
+	// that far only has to free the original
+	FileInfo moved;
+	bool copied = resume && _statSeg(to, kSDHashSegment0, &moved, NULL) == SDH_OK &&
+		moved.hash == finfo.hash && (moved.flags & kSDHashFileGeneration) == _hashInfo.generation;
+
+	uint8_t ext[kSDHashStreamExtSize];
+	uint8_t extlen = 0;
+	uint8_t keep[kSDHashSegmentDataSize];
+	SDHDataSize inlined = 0;
+	SDHFilehandle key;
+	SegmentInfo sinfo;
+#ifdef SDHASH_INLINE_FILES
+	if (finfo.flags & kSDHashFileInline) {
+		// the data goes along with segment 0
+		ret = _inlineLength(from, &inlined);
+		if (ret != SDH_OK) return ret;
+		if (inlined && !_card.readData(from, kSDHashInlineDataOffset, inlined, keep)) return SDH_ERR_SD;
+		SDHDataSize stored = _BSWAP16(inlined);
+		memcpy(ext, &stored, sizeof stored);
+		extlen = sizeof stored;
+	}
+#endif
+#ifdef STREAM_FILES_ENABLED
+	if (finfo.flags & kSDHashFileStream) {
+		// the extent stays where it is, but its blocks name segment 0
+		if (!_card.readData(from, kSDHashSegment0ExtOffset, sizeof ext, ext)) return SDH_ERR_SD;
+		extlen = sizeof ext;
+		if (!copied) {
+			ret = _moveExtent(from, to);
+			if (ret != SDH_OK) return ret;
+		}
+	} else
+#endif
+	if (!copied) {
+		key = finfo.hash;
+		for (SDHSegmentCount segNumber = 1; segNumber < finfo.segments_count; ++segNumber) {
+			key = _incHash(key);
+			SDHAddress addr;
+			if (resume) {
+				// copied before being reset
+				_hashInfo.probeBuckets = _hashInfo.buckets;
+				addr = _segmentAddr(to, key);
+				ret = _findSeg(to, &addr, &sinfo, segNumber);
+				if (ret == SDH_OK) continue;
+				if (ret != SDH_ERR_FILE_NOT_FOUND && ret != SDH_ERR_NO_SPACE) return ret;
+			}
+
+			_hashInfo.probeBuckets = _hashInfo.oldBuckets;
+			addr = _segmentAddr(from, key);
+			ret = _findSeg(from, &addr, &sinfo, segNumber);
+			// a lost segment stays lost
+			if (ret == SDH_ERR_FILE_NOT_FOUND || ret == SDH_ERR_NO_SPACE) continue;
+			if (ret != SDH_OK) return ret;
+			SDHDataSize length = sinfo.length;
+			if (length && !_card.readData(addr, _dataOffset(&sinfo), length, keep)) return SDH_ERR_SD;
+
+			// to is free until segment 0 is written last, and mustn't
+			// be taken
+			_hashInfo.probeBuckets = _hashInfo.buckets;
+			ret = _findFree(_segmentAddr(to, key), to, &addr);
+			if (ret != SDH_OK) return ret;
+			SDHWriteSource src = {keep, NULL, NULL};
+			ret = _writeSegment(to, addr, &src, length, segNumber);
+			if (ret != SDH_OK) return ret;
+		}
+	}
+
+	if (!copied) {
+		// rotated counts start over with the count in segment 0
+		ret = _createSegment0(to, finfo.hash, (char*)name, finfo.flags & ~kSDHashFileGeneration, ext, extlen, keep, inlined, finfo.segments_count);
+		if (ret != SDH_OK) return ret;
+	}
+#ifdef LOGGING_ENABLED
+	// the reset may have come before the copy was logged, listing it
+	// twice does no harm
+	else ret = _logCreate(to, finfo.hash, (char*)name);
+	if (ret != SDH_OK) return ret;
+	ret = _logDelete(from);
+	if (ret != SDH_OK) return ret;
+#endif
+
+	// files that haven't moved yet may lie past the original's blocks
+	// on their probe paths, so those become tombstones rather than free
+	uint8_t type[1] = {kSDHashSegmentTombstone};
+	if (!(finfo.flags & kSDHashFileStream)) {
+		_hashInfo.probeBuckets = _hashInfo.oldBuckets;
+		key = finfo.hash;
+		for (SDHSegmentCount segNumber = 1; segNumber < finfo.segments_count; ++segNumber) {
+			key = _incHash(key);
+			SDHAddress addr = _segmentAddr(from, key);
+			ret = _findSeg(from, &addr, &sinfo, segNumber);
+			if (ret == SDH_OK) {
+				if (!_card.writeBlock(addr, type, sizeof type)) return SDH_ERR_SD;
+			} else if (ret != SDH_ERR_FILE_NOT_FOUND && ret != SDH_ERR_NO_SPACE) return ret;
+		}
+		_hashInfo.probeBuckets = _hashInfo.buckets;
+	}
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	if (_rotSeg0 == from) _rotSeg0 = 0;
+	for (uint8_t idx = 0; idx < slotCount; ++idx) {
+		if (!_card.writeBlock(slots[idx], type, sizeof type)) return SDH_ERR_SD;
+	}
+#endif
+	// segment 0 last, the others are found through it after a reset
+	if (!_card.writeBlock(from, type, sizeof type)) return SDH_ERR_SD;
+
+	_moveFrom = _moveTo = 0;
+	return _writeHeader(0);
+}
+
+#ifdef STREAM_FILES_ENABLED
+uint8_t SDHashClass::_moveExtent(SDHAddress from, SDHAddress to) {
+	SDHAddress extent;
+	SDHBucketCount blocks, used;
+	uint8_t ret = _statExtent(from, &extent, &blocks, &used);
+	if (ret != SDH_OK) return ret;
+
+	// blocks in use are rewritten one at a time, keeping their data
+	uint8_t keep[kSDHashSegmentDataSize];
+	for (SDHBucketCount idx = 0; idx < used; ++idx) {
+		SegmentInfo sinfo;
+		ret = statSeg(extent + idx, &sinfo);
+		if (ret == SDH_ERR_SD) return ret;
+		// done before being reset
+		if (ret != SDH_OK || sinfo.segment0_addr == to) continue;
+
+		if (sinfo.length && !_card.readData(extent + idx, _dataOffset(&sinfo), sinfo.length, keep)) return SDH_ERR_SD;
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+		if (sinfo.length <= kSDHashSegmentFillSize) {
+			ret = _markChecked();
+			if (ret != SDH_OK) return ret;
+		}
+#endif
+		if (!_card.writeStart(extent + idx, 1)) return SDH_ERR_SD;
+		SDHWriteSource src = {keep, NULL, NULL};
+		ret = _writeSegmentData(to, &src, sinfo.length, sinfo.number);
+		if (ret != SDH_OK) return ret;
+		if (!_card.writeStop()) return SDH_ERR_SD;
+	}
+
+	// and the empty rest in one go
+	if (used < blocks) {
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+		ret = _markChecked();
+		if (ret != SDH_OK) return ret;
+#endif
+		if (!_card.writeStart(extent + used, blocks - used)) return SDH_ERR_SD;
+		for (SDHBucketCount idx = used; idx < blocks; ++idx) {
+			ret = _writeSegmentData(to, NULL, 0, 0);
+			if (ret != SDH_OK) return ret;
+		}
+		if (!_card.writeStop()) return SDH_ERR_SD;
+	}
+	return SDH_OK;
+}
+#endif
+#endif
+
+#ifdef SDHASH_LATENCY_STATS
+uint32_t SDHashClass::latencyPercentile(SDHOperation op, uint8_t percent) {
+	SDHLatencyStats *stats = &_latency[op];
+	uint32_t total = 0;
+	for (uint8_t n = 0; n < kSDHashLatencyBuckets; ++n) total += stats->buckets[n];
+	if (!total) return 0;
+
+	// the bucket the percent-th call falls into
+	uint32_t rank = (total * min(percent, (uint8_t)100) + 99) / 100;
+	uint32_t seen = 0;
+	uint8_t bucket = 0;
+	for (; bucket < kSDHashLatencyBuckets - 1; ++bucket) {
+		seen += stats->buckets[bucket];
+		if (seen >= rank && seen) break;
+	}
+	if (bucket == kSDHashLatencyBuckets - 1) return stats->max;
+	return min((2UL << bucket) - 1, stats->max);
+}
+
+void SDHashClass::resetLatencyStats() {
+	memset(_latency, 0, sizeof _latency);
+	_timing = false;
+}
+#endif
+
+bool SDHashClass::_getHashInfo() {
+	_hashInfo.buckets = 0;
+	uint8_t header[kSDHashHeaderSizeGrown];
+
+	_card.readData(_hashInfo.base, 0, sizeof header, header);
+
+	if (memcmp(header, kSDHashMagic, sizeof kSDHashMagic)) return false;
+
+	_hashInfo.version = header[sizeof kSDHashMagic];
+	
+	memcpy(&_hashInfo.buckets, header+sizeof kSDHashMagic + 1, sizeof _hashInfo.buckets);
+
+	_hashInfo.buckets = _BSWAP32(_hashInfo.buckets);
+
+	// v1 tables predate the hash function byte
+	_hashInfo.hash = _hashInfo.version < 2?(uint8_t)kSDHashFNV1a:header[kSDHashHeaderSizeV1];
+	_hashInfo.flags = _hashInfo.version < 3?0:header[kSDHashHeaderSizeV2];
+	_hashInfo.unitShift = header[kSDHashHeaderSizePending];
+#ifdef SDHASH_AUTO_SCK_RATE
+	uint8_t *profile = header + kSDHashHeaderSizeLocal;
+	uint16_t ticks[3];
+	memcpy(ticks, profile + 1, sizeof ticks);
+	_profile.sckRate = (_hashInfo.flags & kSDHashTableTunedRate)?profile[0]:0xff;
+	_profile.readBlockTicks = _BSWAP16(ticks[0]);
+	_profile.writeBlockTicks = _BSWAP16(ticks[1]);
+	_profile.multiWriteBlockTicks = _BSWAP16(ticks[2]);
+#endif
+#ifdef SDHASH_ONLINE_GROWTH
+	uint8_t *growth = header + kSDHashHeaderSizeTuned;
+	SDHAddress fields[4];
+	memset(fields, 0, sizeof fields);
+	if (_hashInfo.flags & kSDHashTableGrown) memcpy(fields, growth + 1, sizeof fields);
+	_hashInfo.generation = (_hashInfo.flags & kSDHashTableGrown)?growth[0]:0;
+	_hashInfo.oldBuckets = _BSWAP32(fields[0]);
+	_hashInfo.probeBuckets = _hashInfo.buckets;
+	_growCursor = _BSWAP32(fields[1]);
+	_moveFrom = _BSWAP32(fields[2]);
+	_moveTo = _BSWAP32(fields[3]);
+#endif
 
 	return true;
 }
@@ -21,11 +21,23 @@
 
 #ifndef SDHASH_H
 #define SDHASH_H
+#include "SDHashConfig.h"
+
+#ifdef ARDUINO
 #include "WProgram.h"
+#else
+#include "utility/SDHashHost.h"
+#endif
 
 #include <stdint.h>
 
-#include "utility/Sd2Card.h"
+// readFile32 and appendFile32 only exist where buffers can be that large
+#if !defined(SDHASH_LARGE_TRANSFERS) && defined(SIZE_MAX) && SIZE_MAX > 0xffff
+#define SDHASH_LARGE_TRANSFERS
+#endif
+
+#include SDHASH_BLOCK_DEVICE_HEADER
+#include "utility/SDHashFunc.h"
 
 enum {
 	SDH_OK,
@@ -38,60 +50,337 @@ enum {
 	SDH_ERR_MISSIG_SEGMENT,
 	SDH_ERR_SD, // error occur relating to Sd2Card
 	SDH_ERR_CARD, // something is wrong about the card
+	SDH_ERR_HANDLE_COLLISION, // another file has the same filehandle
+	SDH_ERR_DATA_OVERFLOW, // the file can't hold that much more data
+	SDH_ERR_ABORTED, // a callback asked to stop
+	SDH_ERR_CHECKSUM, // a segment doesn't match its checksum
 };
 
 typedef enum {
 	kSDHashLogCreate = 'c',
 	kSDHashLogDelete = 'd',
+	// a hidden file was created, only logged by tables with
+	// kSDHashTableLoggedCreates
+	kSDHashLogCreateHidden = 'h',
 } SDHLogEntryType;
 
 typedef enum {
 	kSDHashFreeSegment = 0x00,
 	kSDHashSegment0 = 0x01,
 	kSDHashSegment = 0x02,
+	// holds one of the rotated segment counts of a file
+	kSDHashSegmentCount = 0x03,
+	// a block a file moved out of while the table grew. Probing passes
+	// over it, but it can be reused
+	kSDHashSegmentTombstone = 0x04,
+	// a segment ending in a CRC32C of its metadata and data, which
+	// version 4 tables can hold
+	kSDHashSegmentChecked = 0x05,
 } SDHSegmentType;
 
+typedef enum {
+	kSDHashFileStream = 0x01,
+	// set if the file was placed in an odd generation of a grown table
+	kSDHashFileGeneration = 0x02,
+	// the segments of the file are compressed, see createCompressedFile
+	kSDHashFileCompressed = 0x04,
+	// the data of the file is in segment 0, see SDHASH_INLINE_FILES
+	kSDHashFileInline = 0x08,
+	// appends overwrite the oldest segment, see createRingFile
+	kSDHashFileRing = 0x10,
+} SDHFileFlag;
+
+typedef enum {
+	kSDHashTableWideHandles = 0x01,
+	kSDHashTableSegmentTags = 0x02,
+	kSDHashTablePendingCount = 0x04,
+	kSDHashTableRotatedCounts = 0x08,
+	kSDHashTableLocalSegments = 0x10,
+	kSDHashTableTunedRate = 0x20,
+	// __LOG names every file created, hidden ones included
+	kSDHashTableLoggedCreates = 0x40,
+	// the table was grown, and may still be moving files
+	kSDHashTableGrown = 0x80,
+} SDHTableFlag;
+
 typedef uint32_t SDHAddress;
+#ifdef SDHASH_WIDE_HANDLES
+// the low 32 bits are the table's hash and key the hash chain, the high 32
+// bits a second hash that is only compared
+typedef uint64_t SDHFilehandle;
+#else
 typedef uint32_t SDHFilehandle;
+#endif
 typedef uint16_t SDHSegmentCount;
 typedef uint16_t SDHDataSize;
+// lengths of whole transfers, which can span many segments
+typedef uint32_t SDHTransferSize;
 typedef uint32_t SDHBucketCount;
 
+typedef SDHASH_BLOCK_DEVICE SDHBlockDevice;
+
 typedef struct {
 	uint8_t version;
 	SDHBucketCount buckets;
+	uint8_t hash;
+	uint8_t flags;
+	// first block of the table, where its header lives
+	SDHAddress base;
+	// log2 of the allocation unit in blocks, tables with local segments
+	uint8_t unitShift;
+#ifdef SDHASH_ONLINE_GROWTH
+	// buckets before the table was grown, 0 once every file moved
+	SDHBucketCount oldBuckets;
+	// buckets of the geometry files are being looked for in
+	SDHBucketCount probeBuckets;
+	// kSDHashFileGeneration or 0, whatever files placed now get
+	uint8_t generation;
+#endif
 } HashInfo;
 
+// what begin() found out about the card, see cardProfile()
+typedef struct {
+	// the fastest setSckRate rate that passed the round trip
+	uint8_t sckRate;
+	// clock ticks per block read, per block written with writeBlock, and
+	// per block of a multiple block write, all at that rate
+	uint16_t readBlockTicks;
+	uint16_t writeBlockTicks;
+	uint16_t multiWriteBlockTicks;
+} SDHCardProfile;
+
 typedef struct {
 	SDHAddress segment0_addr;
 	SDHDataSize length;
+	// segment number modulo 127 plus 1, or 0 if the segment isn't tagged
+	uint8_t tag;
+	// the segment number tagged segments store after their metadata
+	SDHSegmentCount number;
+	// the segment ends in a checksum
+	bool checked;
 } SegmentInfo;
 
 typedef struct {
 	SDHFilehandle hash;
 	SDHSegmentCount segments_count;
+	uint8_t flags;
 } Segment0Info;	
 
 typedef Segment0Info FileInfo;
 
+/**
+ * Receives file data from readFileTo, at most SDHASH_SINK_CHUNK_SIZE bytes
+ * at a time. Return false to stop reading.
+ */
+typedef bool (*SDHSink)(void *ctx, const uint8_t *data, uint8_t len);
+
+// where reads put their data, either a buffer or a sink
+typedef struct {
+	uint8_t *dest;
+	SDHSink sink;
+	void *ctx;
+} SDHReadTarget;
+
+/**
+ * Produces file data for appendFileFrom, filling data with exactly len
+ * bytes, at most SDHASH_SOURCE_CHUNK_SIZE at a time. Return false to stop
+ * appending.
+ */
+typedef bool (*SDHSource)(void *ctx, uint8_t *data, uint8_t len);
+
+// where appends get their data from, either a buffer or a source
+typedef struct {
+	uint8_t *data;
+	SDHSource source;
+	void *ctx;
+} SDHWriteSource;
+
+// most adjacent segments writeAt rewrites in one multiple block write
+#define kSDHashWriteRunLength 8
+
+/**
+ * Segments writeAt found adjacent to each other, which get written
+ * together
+ */
+typedef struct {
+	SDHAddress addr;
+	uint8_t count;
+	SDHDataSize lengths[kSDHashWriteRunLength];
+	SDHSegmentCount numbers[kSDHashWriteRunLength];
+	// the segment only partly overwritten, whose data was read
+	// into a buffer, or kSDHashWriteRunLength if there is none
+	uint8_t partial;
+	// data for the segments that are overwritten completely
+	uint8_t *data;
+} SDHWriteRun;
+
+#ifdef SDHASH_NAME_INDEX
+/**
+ * Receives the names findPrefix and findRange found, in name order, along
+ * with the segment 0 address of each file. Return false to stop.
+ */
+typedef bool (*SDHNameVisitor)(void *ctx, const char *filename, SDHAddress seg0addr);
+
+// the name index file, as far as looking through it goes
+typedef struct {
+	SDHFilehandle fh;
+	SDHAddress seg0addr;
+	uint8_t flags;
+	// pages in use, the file may have more left over from before a rebuild
+	SDHSegmentCount pages;
+	SDHSegmentCount segments;
+	SDHSegmentCount root;
+	SDHAddress metaAddr;
+} SDHIndexInfo;
+#endif
+
+typedef enum {
+	kSDHashOpCreate,
+	kSDHashOpAppend,
+	kSDHashOpRead,
+	kSDHashOpDelete,
+	kSDHashOpCount,
+} SDHOperation;
+
+// bucket n of a latency histogram counts calls taking 2^n to 2^(n+1)-1
+// clock ticks, bucket 0 those under 2 ticks, and the last one everything
+// longer
+#define kSDHashLatencyBuckets 24
+
+typedef struct {
+	// calls recorded since the last reset
+	uint32_t count;
+	// longest of them
+	uint32_t max;
+	// halved whenever one would overflow, so only their ratios matter
+	uint16_t buckets[kSDHashLatencyBuckets];
+} SDHLatencyStats;
+
 class SDHashClass {
 	private:
-		Sd2Card _card;
+		SDHBlockDevice _card;
 		HashInfo _hashInfo;
 
 		bool _validCard;
+		uint8_t _partition;
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+		// the file whose segment count on the card may lag behind,
+		// and its actual count
+		SDHAddress _pendingSeg0;
+		SDHSegmentCount _pendingCount;
+		uint8_t _pendingAppends;
+#endif
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+		// the rotation state of the segment 0 looked at last, and
+		// whether the newest of its counts has been found
+		SDHAddress _rotSeg0;
+		bool _rotResolved;
+		uint16_t _rotRewrites;
+		uint8_t _rotSlotCount;
+		SDHAddress _rotSlots[SDHASH_ROTATE_SEGMENT_COUNT - 1];
+		// which count is the newest, 0 being the one in segment 0
+		uint8_t _rotLatest;
+		uint16_t _rotSeq;
+#endif
+#ifdef SDHASH_RING_FILES
+		// the ring file appended to or read last, its newest segment,
+		// and that segment's key and sequence number
+		SDHAddress _ringSeg0;
+		SDHSegmentCount _ringHead;
+		uint32_t _ringKey;
+		uint32_t _ringSeq;
+#endif
+#ifdef SDHASH_AUTO_SCK_RATE
+		SDHCardProfile _profile;
+#endif
+#ifdef SDHASH_ONLINE_GROWTH
+		// the next old bucket to look for files to move at, and the
+		// file being moved, if any
+		SDHAddress _growCursor;
+		SDHAddress _moveFrom;
+		SDHAddress _moveTo;
+#endif
+#ifdef SDHASH_NAME_INDEX
+		// the name index is up to date with __LOG
+		bool _indexValid;
+#endif
+#ifdef SDHASH_BLOOM_FILTER_BITS
+		// filehandles of the files created since begin() and those it
+		// found. Bits are never cleared, so deleted files stay in it
+		uint8_t _bloom[(SDHASH_BLOOM_FILTER_BITS + 7) / 8];
+#endif
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+		// whether the segment being written gets a checksum, and its CRC
+		// so far
+		bool _writeChecked;
+		uint32_t _writeCrc;
+#endif
+#ifdef SDHASH_LATENCY_STATS
+		SDHLatencyStats _latency[kSDHashOpCount];
+		// whether a call is being timed already
+		bool _timing;
+#endif
 
 	public:
-		static SDHFilehandle filehandle(char *str);
-		static SDHFilehandle filehandle(uint8_t *buf, size_t len);
+		/**
+		 * Filehandles depend on the hash function of the table, so
+		 * only compute them after begin()
+		 */
+		SDHFilehandle filehandle(char *str);
+		SDHFilehandle filehandle(uint8_t *buf, size_t len);
 
 		static uint32_t fnv(uint8_t *buf, size_t len, uint32_t hval); 
 
-		SDHashClass(): _validCard(false){};
+		/**
+		 * Filehandle of __LOG, which isn't filehandle("__LOG") in v1
+		 * tables
+		 */
+		SDHFilehandle logFilehandle();
+
+		/**
+		 * partition selects which table of a partitioned card this
+		 * instance mounts. Partition 0 of an unpartitioned card is the
+		 * whole card.
+		 */
+		SDHashClass(uint8_t partition = 0): _validCard(false), _partition(partition) {
+			_hashInfo.hash = kSDHashFNV1a;
+			_hashInfo.base = 0;
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+			_pendingSeg0 = 0;
+#endif
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+			_rotSeg0 = 0;
+#endif
+#ifdef SDHASH_RING_FILES
+			_ringSeg0 = 0;
+#endif
+#ifdef SDHASH_LATENCY_STATS
+			resetLatencyStats();
+#endif
+		};
 
 		uint8_t begin();
+
+		/**
+		 * Writes a partition directory into block 0, splitting the card into
+		 * count independent tables of blocks[n] blocks each. They are laid
+		 * out back to back after block 0, and a size of 0 for the last one
+		 * uses the rest of the card. Every partition is formatted by the
+		 * first begin() of an instance using it.
+		 *
+		 * This destroys whatever was on the card.
+		 */
+		uint8_t createPartitions(SDHBucketCount *blocks, uint8_t count);
+		uint8_t partition() {return _partition;}
 		bool validCard() {return _validCard;}
-		Sd2Card *card() {return &_card;}
+#ifdef SDHASH_FIXED_HASH
+		uint8_t hashFunction() {return SDHASH_FIXED_HASH;}
+#else
+		uint8_t hashFunction() {return _hashInfo.hash;}
+#endif
+		SDHBlockDevice *card() {return &_card;}
+		/** the mounted table's header, and where it starts */
+		const HashInfo *hashInfo() {return &_hashInfo;}
 
 		/**
 		 * following returns 0 on success, error code otherwise
@@ -105,7 +394,8 @@ class SDHashClass {
 		uint8_t zero(SDHAddress startblock, uint16_t count);
 		
 		/**
-		 * zeros the first block, so card is no longer a valid SDHash card
+		 * zeros the first block of the table, so card or partition is no
+		 * longer a valid SDHash table
 		 */ 
 		uint8_t zeroMagic();
 
@@ -114,10 +404,67 @@ class SDHashClass {
 		/**
 		 * Creates a file with or without data. 
 		 *
-		 * If file already exists, SDH_ERR_FILE_EXISTS is returned.
+		 * If file already exists, SDH_ERR_FILE_EXISTS is returned. If a
+		 * file with a different name but the same filehandle exists
+		 * SDH_ERR_HANDLE_COLLISION is returned, and another name has to
+		 * be used. Filehandles therefore identify files unambiguously.
+		 *
+		 * With SDHASH_INLINE_FILES, files created with data that fits
+		 * into segment 0 keep it there, unless their name is hidden.
+		 * See Inline Files.
 		 */ 
 		uint8_t createFile(SDHFilehandle fh, const char *filename, uint8_t *data, SDHDataSize len);
 		uint8_t createFile(SDHFilehandle fh, const char *filename);
+
+#ifdef STREAM_FILES_ENABLED
+		/**
+		 * Creates a stream file, reserving blocks contiguous blocks up front.
+		 * Appends to stream files don't probe, they are written into the
+		 * next unused blocks of the extent in a single multi-block write,
+		 * and reads use multi-block reads.
+		 *
+		 * SDH_ERR_NO_SPACE is returned if no run of blocks free buckets
+		 * can be found, or when appending past the end of the extent.
+		 */
+		uint8_t createStreamFile(SDHFilehandle fh, const char *filename, SDHBucketCount blocks);
+#endif
+
+#ifdef SDHASH_COMPRESSION
+		/**
+		 * Creates a file whose segments are compressed. Each append
+		 * packs as much of its data as fits into every segment it
+		 * writes, and readFile unpacks them again, so only appends of
+		 * more than a segment's worth take fewer blocks. Segments
+		 * that wouldn't hold more data compressed are stored as they
+		 * are.
+		 *
+		 * Compressed files can't be appended to with appendFileFrom,
+		 * nor changed with writeAt, replaceSegment or truncateTo, which
+		 * return SDH_ERR_INVALID_ARGUMENT. Reading one takes about 256
+		 * bytes of stack.
+		 */
+		uint8_t createCompressedFile(SDHFilehandle fh, const char *filename);
+#endif
+
+#ifdef SDHASH_RING_FILES
+		/**
+		 * Creates a ring file of segments segments, for logging to
+		 * continuously. All of them are written up front, empty, and
+		 * each append overwrites the oldest ones in turn, a single
+		 * block write per segment, so the file keeps the newest
+		 * segments worth of data. readFile reads from the oldest
+		 * segment to the newest.
+		 *
+		 * Segments hold 4 bytes less than those of other files.
+		 * Appending more than the file holds returns
+		 * SDH_ERR_DATA_OVERFLOW. Ring files can't be appended to with
+		 * appendFileFrom, nor changed with writeAt, replaceSegment,
+		 * truncateTo or truncateFile, which return
+		 * SDH_ERR_INVALID_ARGUMENT. Tables without segment tags can't
+		 * hold ring files, SDH_ERR_CARD is returned for them.
+		 */
+		uint8_t createRingFile(SDHFilehandle fh, const char *filename, SDHSegmentCount segments);
+#endif
 	
 		/**
 		 * writes file info into given FileInfo struct which can be
@@ -134,6 +481,19 @@ class SDHashClass {
 		 * SDH_ERR_NO_SPACE is returned.
 		 */
 		uint8_t statFile(SDHFilehandle fh, FileInfo *finfo, SDHAddress *addr);
+		/**
+		 * Same as above, but also verifies the filename when the
+		 * filehandles match, returning SDH_ERR_HANDLE_COLLISION if it
+		 * differs.
+		 */
+		uint8_t statFile(SDHFilehandle fh, const char *filename, FileInfo *finfo, SDHAddress *addr);
+
+		/**
+		 * Copies the name of the file whose segment 0 is at seg0addr into
+		 * filename, which has to hold at least 24 bytes, and terminates
+		 * it. Returns SDH_ERR_FILENAME if the stored name is malformed.
+		 */
+		uint8_t readFilename(SDHAddress seg0addr, char *filename);
 		uint8_t statSeg0(SDHAddress addr, FileInfo *finfo);
 		uint8_t statSeg(SDHAddress addr, SegmentInfo *sinfo);
 		/**
@@ -165,13 +525,75 @@ class SDHashClass {
 		 * returns SDH_OK on success, and len will hold the number of
 		 * bytes in dest that wasn't used.  e.g. len of 0 will indicate
 		 * dest was completely filled.
-		 * 
+		 *
+		 * With SDHASH_SEGMENT_CHECKSUMS, SDH_ERR_CHECKSUM is returned if
+		 * a segment read from doesn't match its checksum, after its data
+		 * has been put into dest or handed to the sink.
 		 */
 		uint8_t readFile(SDHFilehandle fh, uint32_t offset, uint8_t *dest, SDHDataSize *len);
 
+#ifdef SDHASH_LARGE_TRANSFERS
+		/**
+		 * Same as appendFile and readFile, but with 32 bit lengths.
+		 * The file is looked up and its hash chain walked once for
+		 * the whole transfer, so use these instead of looping over
+		 * appendFile and readFile in small chunks.
+		 *
+		 * Files can hold at most 65535 segments. If data wouldn't fit,
+		 * SDH_ERR_DATA_OVERFLOW is returned and nothing is appended.
+		 */
+		uint8_t appendFile32(SDHFilehandle fh, uint8_t *data, uint32_t len);
+		uint8_t readFile32(SDHFilehandle fh, uint32_t offset, uint8_t *dest, uint32_t *len);
+#endif
+
+		/**
+		 * Reads len bytes starting at offset and passes them to sink
+		 * as they come off the card, without buffering more than
+		 * SDHASH_SINK_CHUNK_SIZE bytes. len is updated like readFile
+		 * does. If sink returns false, SDH_ERR_ABORTED is returned.
+		 *
+		 * The card stays selected while sink runs, so sink must not
+		 * use the SPI bus.
+		 */
+		uint8_t readFileTo(SDHFilehandle fh, uint32_t offset, uint32_t *len, SDHSink sink, void *ctx);
+
 		/**
-		 * Replaces the data of the n-th segment. len can not be greater tha 512, but
-		 * this condition is not checked by the library.
+		 * Appends len bytes pulled from source while they are being
+		 * written, without buffering more than SDHASH_SOURCE_CHUNK_SIZE
+		 * bytes. If source returns false, the segments completed so
+		 * far are kept and SDH_ERR_ABORTED is returned.
+		 *
+		 * Like readFileTo's sink, source must not use the SPI bus.
+		 */
+		uint8_t appendFileFrom(SDHFilehandle fh, uint32_t len, SDHSource source, void *ctx);
+
+		/**
+		 * With SDHASH_LAZY_SEGMENT_COUNT, writes the segment count of
+		 * the file last appended to into its segment 0, and marks the
+		 * table as clean. Call it before removing the card, or to let
+		 * older versions of the library mount the table. Does nothing
+		 * otherwise.
+		 */
+		uint8_t flush();
+
+		/**
+		 * Overwrites len bytes of the file starting at offset, without
+		 * changing its size. The segments covering them are located in
+		 * one walk of the hash chain, and adjacent ones are rewritten
+		 * in one multiple block write. len is updated like readFile
+		 * does, so it holds the number of bytes that were past the end
+		 * of the file and weren't written.
+		 *
+		 * Segments that are only partly overwritten are read into a
+		 * buffer first, which takes about SDHASH_BLOCK_SIZE bytes of
+		 * stack.
+		 */
+		uint8_t writeAt(SDHFilehandle fh, uint32_t offset, uint8_t *data, SDHDataSize *len);
+
+		/**
+		 * Replaces the data of the n-th segment. len can not be greater than
+		 * 505, or 503 in tables with segment tags, otherwise
+		 * SDH_ERR_DATA_OVERFLOW is returned.
 		 *
 		 * if segNumber is 0, SDH_ERR_INVALID_ARGUMENT is returned since segment 0
 		 * is not a valid data segment
@@ -190,14 +612,215 @@ class SDHashClass {
 		 * of segment 0 as well, SDH_ERR_INVALID_ARGUMENT is returned.
 		 */ 
 		uint8_t truncateFile(SDHFilehandle fh, SDHSegmentCount count);
+
+		/**
+		 * Truncates the file to length bytes. The segment the file now
+		 * ends in is shortened in place, and the segments past it are
+		 * freed, adjacent ones in one go. Returns SDH_ERR_INVALID_ARGUMENT
+		 * if the file is shorter than length.
+		 *
+		 * Like writeAt, shortening a segment takes about
+		 * SDHASH_BLOCK_SIZE bytes of stack. Stream files keep their
+		 * blocks.
+		 */
+		uint8_t truncateTo(SDHFilehandle fh, uint32_t length);
+
+#ifdef SDHASH_AUTO_SCK_RATE
+		/**
+		 * The SPI rate in use and the block transfer times measured at
+		 * it. begin() tunes and stores them the first time it mounts a
+		 * table, and again whenever the stored rate can't read the
+		 * header back intact.
+		 */
+		const SDHCardProfile *cardProfile() {return &_profile;}
+
+		/**
+		 * Tunes the rate again, e.g. after changing the wiring, trying
+		 * the fastest first. Returns SDH_ERR_SD if even the slowest rate
+		 * fails, and SDH_ERR_INVALID_ARGUMENT if the table was created
+		 * without SDHASH_AUTO_SCK_RATE, so has no scratch blocks.
+		 */
+		uint8_t tuneSckRate();
+#endif
+
+#ifdef SDHASH_ONLINE_GROWTH
+		/**
+		 * Grows the table to buckets, or as far as the card or partition
+		 * allows if 0, e.g. after copying it to a bigger card. The added
+		 * blocks are cleared first. Files then move to where the bigger
+		 * table puts them a few at a time, see growStep(), and are
+		 * looked for in both tables until they all did. Returns
+		 * SDH_ERR_INVALID_ARGUMENT if the table wouldn't get bigger or
+		 * is still moving files from the last time.
+		 */
+		uint8_t growTable(SDHBucketCount buckets);
+
+		/**
+		 * Moves the files whose segment 0 is in the next
+		 * SDHASH_GROWTH_STEP buckets of the old table. createFile and
+		 * deleteFile call this, call it whenever there is time to
+		 * finish sooner.
+		 */
+		uint8_t growStep();
+
+		/**
+		 * Buckets of the old table still to be looked at, 0 when no
+		 * files are left to move.
+		 */
+		SDHBucketCount growthLeft();
+#endif
+
+#ifdef SDHASH_NAME_INDEX
+		/**
+		 * Calls visitor with every file whose name starts with prefix,
+		 * in name order, reading a few pages of the name index rather
+		 * than all of __LOG. Hidden files aren't indexed. If begin()
+		 * found the index out of date, it is rebuilt first. Returns
+		 * SDH_ERR_ABORTED if visitor returned false. Files created or
+		 * deleted by visitor may or may not be visited.
+		 */
+		uint8_t findPrefix(const char *prefix, SDHNameVisitor visitor, void *ctx);
+
+		/**
+		 * Same for the names from first on, up to but not including
+		 * last, or all of them if last is NULL.
+		 */
+		uint8_t findRange(const char *first, const char *last, SDHNameVisitor visitor, void *ctx);
+
+		/**
+		 * Builds the name index anew by replaying __LOG. Files created
+		 * in a part of __LOG that went missing aren't indexed. Tables
+		 * without segment tags can't keep one, SDH_ERR_CARD is returned
+		 * for them.
+		 */
+		uint8_t rebuildIndex();
+#endif
+
+#ifdef SDHASH_LATENCY_STATS
+		/**
+		 * How long calls took, in SDHASH_LATENCY_CLOCK ticks. Create
+		 * covers createFile and createStreamFile, append the appendFile
+		 * variants, read the readFile variants including readFileTo,
+		 * and delete deleteFile. Calls are recorded whether they fail
+		 * or not, but calls the library makes itself, like createFile
+		 * appending its data, are part of the call making them.
+		 */
+		const SDHLatencyStats *latencyStats(SDHOperation op) {return &_latency[op];}
+
+		/**
+		 * Ticks at most percent of the recorded calls took, rounded up to
+		 * the end of their histogram bucket, and never more than the
+		 * longest call. 0 if nothing has been recorded.
+		 */
+		uint32_t latencyPercentile(SDHOperation op, uint8_t percent);
+		void resetLatencyStats();
+#endif
 	private:
 		bool _getHashInfo();
 		SDHAddress _foldHash(uint32_t hash);
+		SDHAddress _segmentAddr(SDHAddress seg0addr, uint32_t key);
+#ifdef SDHASH_AUTO_SCK_RATE
+		uint8_t _setupSckRate();
+		bool _roundTrip(SDHAddress addr, uint8_t salt);
+#endif
+		SDHAddress _stepAddr(SDHAddress addr, SDHAddress addr0);
+		SDHBucketCount _probeBuckets();
+#ifdef SDHASH_ONLINE_GROWTH
+		void _useGeometry(uint8_t fileFlags);
+		uint8_t _moveFile(SDHAddress from, SDHAddress to, bool resume);
+#ifdef STREAM_FILES_ENABLED
+		uint8_t _moveExtent(SDHAddress from, SDHAddress to);
+#endif
+#endif
+#ifdef SDHASH_BLOOM_FILTER_BITS
+		void _bloomAdd(SDHFilehandle fh);
+		bool _bloomMayContain(SDHFilehandle fh);
+		uint8_t _buildBloom();
+		uint8_t _bloomFromLog();
+#endif
+		uint8_t _getPartition(SDHBucketCount *limit);
 		uint32_t _incHash(uint32_t hash);
-		uint8_t _writeSegment(SDHAddress seg0addr, SDHAddress addr, uint8_t *data, SDHDataSize len);
+		uint8_t _createSegment0(SDHAddress addr, SDHFilehandle fh, const char *filename, uint8_t flags, uint8_t *ext, uint8_t extlen, const uint8_t *data, SDHDataSize len, SDHSegmentCount segments_count);
+		uint8_t _findFile(SDHFilehandle fh, const char *filename, FileInfo *finfo, SDHAddress *addrPtr);
+		uint8_t _appendFile(SDHFilehandle fh, SDHWriteSource *src, SDHTransferSize len);
+		uint8_t _readFile(SDHFilehandle fh, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len);
+		uint8_t _readChain(SDHFilehandle fh, FileInfo *finfo, SDHAddress seg0addr, SDHSegmentCount first, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len);
+		uint8_t _readData(SDHReadTarget *target, SDHAddress addr, uint16_t offset, SDHDataSize count);
+		uint8_t _findSeg(SDHAddress seg0addr, SDHAddress *addr, SegmentInfo *sinfo, SDHSegmentCount segNumber);
+		uint8_t _findFree(SDHAddress addr0, SDHAddress skip, SDHAddress *addr);
+		SDHSegmentCount _segmentNumber(SDHSegmentCount segNumber);
+		uint8_t _writeSegment(SDHAddress seg0addr, SDHAddress addr, SDHWriteSource *src, SDHDataSize len, SDHSegmentCount segNumber);
+		uint8_t _writeSegmentData(SDHAddress seg0addr, SDHWriteSource *src, SDHDataSize len, SDHSegmentCount number);
+		uint8_t _writeSegmentMeta(SDHAddress seg0addr, SDHDataSize len, SDHSegmentCount number);
+		uint8_t _writeSegmentBytes(const uint8_t *data, SDHDataSize len, uint16_t ofs);
+		uint8_t _finishSegment(SDHDataSize padding);
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+		uint8_t _markChecked();
+		uint32_t _metaCrc(SegmentInfo *sinfo);
+		uint8_t _crcRange(SDHAddress addr, uint16_t ofs, uint16_t end, uint32_t *crc);
+		uint8_t _checkRest(SDHAddress addr, uint16_t ofs, uint16_t end, uint32_t crc);
+		uint8_t _readChecked(SDHReadTarget *target, SDHAddress addr, SegmentInfo *sinfo, uint16_t offset, SDHDataSize count);
+#endif
+#ifdef SDHASH_INLINE_FILES
+		uint8_t _inlineLength(SDHAddress seg0addr, SDHDataSize *used);
+		uint8_t _rewriteInline(SDHAddress seg0addr, SDHDataSize used, SDHDataSize offset, SDHWriteSource *src, SDHDataSize count, SDHDataSize length);
+		uint8_t _appendInline(SDHFilehandle fh, SDHAddress seg0addr, FileInfo *finfo, SDHWriteSource *src, SDHTransferSize len, uint8_t *head);
+		uint8_t _writeSpilled(SDHAddress seg0addr, uint8_t *head, SDHSegmentCount segments_count);
+		uint8_t _readInline(SDHAddress seg0addr, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len);
+#endif
+#ifdef SDHASH_COMPRESSION
+		uint8_t _writePacked(SDHAddress seg0addr, SDHAddress addr, SDHWriteSource *src, SDHDataSize *len, SDHSegmentCount segNumber);
+		uint8_t _packSegment(const uint8_t *data, SDHDataSize *raw, SDHDataSize *packed, uint16_t ofs, bool emit);
+		uint8_t _unpackSegment(SDHReadTarget *target, SDHAddress addr, uint16_t ofs, SDHDataSize packed, SDHDataSize offset, SDHDataSize count, uint32_t *crc);
+		uint8_t _unpackedOut(SDHReadTarget *target, const uint8_t *ring, uint8_t end, uint8_t count);
+#endif
+#ifdef SDHASH_RING_FILES
+		uint8_t _ringSeqAt(SDHAddress seg0addr, SDHFilehandle fh, SDHSegmentCount segNumber, uint32_t *key, uint32_t *seq);
+		uint8_t _findRingHead(SDHFilehandle fh, SDHAddress seg0addr, SDHSegmentCount capacity);
+		uint8_t _appendRing(SDHFilehandle fh, SDHAddress seg0addr, SDHSegmentCount capacity, SDHWriteSource *src, SDHTransferSize len);
+		uint8_t _writeRingSegment(SDHAddress seg0addr, SDHAddress addr, const uint8_t *data, SDHDataSize len, SDHSegmentCount segNumber, uint32_t seq);
+#endif
+		uint8_t _writeRun(SDHAddress seg0addr, SDHWriteRun *run, uint8_t *keep);
+		uint8_t _truncateChain(SDHAddress seg0addr, uint32_t key, SDHSegmentCount first, SDHSegmentCount segments_count);
+		uint8_t _updateSeg0Meta(SDHAddress seg0addr, uint8_t ofs, void *src, uint8_t len);
 		uint8_t _updateSeg0SegmentsCount(SDHAddress seg0addr, SDHSegmentCount segments_count);
+		uint8_t _appendedSegments(SDHAddress seg0addr, SDHSegmentCount segments_count);
+		uint8_t _writeHeader(SDHAddress pendingSeg0);
+		uint8_t _recoverSegmentsCount();
+#ifdef SDHASH_LAZY_SEGMENT_COUNT
+		uint8_t _setPending(SDHAddress seg0addr, SDHSegmentCount segments_count);
+#endif
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+		uint8_t _resolveSegmentsCount(SDHAddress seg0addr, FileInfo *finfo);
+		uint8_t _rotateSegmentsCount(SDHAddress seg0addr, SDHSegmentCount segments_count);
+#endif
+#ifdef STREAM_FILES_ENABLED
+		uint8_t _statExtent(SDHAddress seg0addr, SDHAddress *extent, SDHBucketCount *blocks, SDHBucketCount *used);
+		uint8_t _findExtent(SDHAddress addr, SDHAddress skip, SDHBucketCount blocks, SDHAddress *extent);
+		uint8_t _appendStream(SDHAddress seg0addr, SDHWriteSource *src, SDHTransferSize len);
+		uint8_t _readStream(SDHAddress seg0addr, uint32_t offset, SDHReadTarget *target, SDHTransferSize *len);
+		uint8_t _readNext(SDHReadTarget *target, SDHDataSize count, uint32_t *crc);
+#endif
 		uint8_t _appendLog(SDHLogEntryType type, SDHAddress seg0addr);
-		uint8_t _statSeg(SDHAddress addr, SDHSegmentType type, void *info);
+		uint8_t _logCreate(SDHAddress seg0addr, SDHFilehandle fh, const char *filename);
+#ifdef SDHASH_NAME_INDEX
+		uint8_t _checkIndex();
+		uint8_t _indexEntry(SDHLogEntryType type, SDHAddress seg0addr);
+		uint8_t _openIndex(SDHIndexInfo *idx, SDHSegmentCount *stamp);
+		uint8_t _storeMeta(SDHIndexInfo *idx, SDHSegmentCount stamp);
+		uint8_t _pageAddr(SDHIndexInfo *idx, SDHSegmentCount page, SDHAddress *addr, SegmentInfo *sinfo);
+		uint8_t _loadPage(SDHIndexInfo *idx, SDHSegmentCount page, uint8_t *data, SDHDataSize *len, SDHAddress *addrPtr);
+		uint8_t _newPage(SDHIndexInfo *idx, uint8_t *data, SDHDataSize len);
+		uint8_t _findLeaf(SDHIndexInfo *idx, const uint8_t *name, size_t namelen, uint8_t *page, SDHDataSize *len, SDHAddress *addr, SDHSegmentCount *path, uint8_t *depth);
+		uint8_t _indexInsert(SDHIndexInfo *idx, const uint8_t *name, uint8_t namelen, SDHAddress seg0addr);
+		uint8_t _indexRemove(SDHIndexInfo *idx, const uint8_t *name, uint8_t namelen, SDHAddress seg0addr);
+		uint8_t _indexAt(SDHIndexInfo *idx, SDHLogEntryType type, SDHAddress seg0addr);
+		uint8_t _indexFromLog(SDHIndexInfo *idx, SDHSegmentCount *stamp);
+		uint8_t _walkIndex(const char *first, bool prefix, const char *last, SDHNameVisitor visitor, void *ctx);
+#endif
+		uint8_t _logDelete(SDHAddress seg0addr);
+		uint8_t _statSeg(SDHAddress addr, SDHSegmentType type, void *info, uint8_t *name);
+		bool _nameMatches(uint8_t *name, const char *filename);
 };
 
 extern SDHashClass SDHash;
@@ -212,18 +835,35 @@ inline SDHFilehandle SDHashClass::filehandle(char *str) {
 }
 
 inline SDHFilehandle SDHashClass::filehandle(uint8_t *buf, size_t len) {
-	return fnv(buf, len, 0);
+#ifdef SDHASH_WIDE_HANDLES
+	return ((SDHFilehandle)sdhMurmur3(buf, len, kSDHashWideHandleSeed) << 32) | sdhHash(hashFunction(), buf, len);
+#else
+	return sdhHash(hashFunction(), buf, len);
+#endif
 }
 
 inline uint8_t SDHashClass::truncateSegment(SDHFilehandle fh, SDHSegmentCount segNumber) {
 	return replaceSegment(fh, segNumber, NULL, 0);
 }
 
+inline uint8_t SDHashClass::findSeg(SDHAddress seg0addr, SDHAddress *addr) {
+	SegmentInfo sinfo;
+	return _findSeg(seg0addr, addr, &sinfo, 0);
+}
+
 inline uint8_t SDHashClass::statSeg(SDHAddress addr, SegmentInfo* sinfo) {
-	return _statSeg(addr, kSDHashSegment, sinfo);
+	return _statSeg(addr, kSDHashSegment, sinfo, NULL);
 }
 
 inline uint8_t SDHashClass::statSeg0(SDHAddress addr, FileInfo *finfo) {
-	return _statSeg(addr, kSDHashSegment0, finfo);
+	uint8_t ret = _statSeg(addr, kSDHashSegment0, finfo, NULL);
+#ifdef SDHASH_ROTATE_SEGMENT_COUNT
+	if (ret == SDH_OK && finfo) ret = _resolveSegmentsCount(addr, finfo);
+#endif
+	return ret;
+}
+
+inline uint8_t SDHashClass::statFile(SDHFilehandle fh, FileInfo *finfo, SDHAddress *addr) {
+	return statFile(fh, NULL, finfo, addr);
 }
 #endif
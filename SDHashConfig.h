@@ -0,0 +1,223 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * Compile time configuration of SDHash. Everything that is disabled here
+ * is compiled out completely.
+ *
+ * Edit this file, or define SDHASH_USER_CONFIG to the name of a header
+ * that is included instead, e.g. -DSDHASH_USER_CONFIG='"myconfig.h"' for
+ * host builds. Numeric settings can also be overridden with -D.
+ */
+#ifndef SDHASHCONFIG_H
+#define SDHASHCONFIG_H
+
+#ifdef SDHASH_USER_CONFIG
+#include SDHASH_USER_CONFIG
+#else
+
+// disable this if you don't want the logging feature which provides
+// some speed ups when creating and deleting files, and also
+// makes the code a *little* smaller
+#define LOGGING_ENABLED
+
+// disable this if you don't need preallocated stream files, which
+// makes the code a little smaller
+#define STREAM_FILES_ENABLED
+
+///#define SERIAL_DEBUG
+
+#endif
+
+// hash function of tables created by begin(). kSDHashFNV1a is what
+// older versions of this library use, kSDHashMurmur3 is about twice as
+// fast per segment step but requires a v2 aware library.
+#ifndef NEW_TABLE_HASH
+#define NEW_TABLE_HASH kSDHashFNV1a
+#endif
+
+// define this to a hash function to only support tables using it, which
+// folds the hash function selection away. begin() rejects other tables.
+///#define SDHASH_FIXED_HASH kSDHashFNV1a
+
+// define this to create tables without segment tags, which older versions
+// of this library can read. Together with kSDHashFNV1a that produces v1
+// tables. Tables with tags can still be used.
+///#define SDHASH_NO_SEGMENT_TAGS
+
+// use 64 bit filehandles, which makes collisions between filehandles
+// practically impossible. This changes the on card format, tables using
+// them can only be mounted when this is enabled and vice versa.
+///#define SDHASH_WIDE_HANDLES
+
+// write the segment count of files only every this many appendFile
+// calls, or on flush(), instead of after each one. That saves rewriting
+// segment 0 for every append, about half the block writes of small
+// appends. The table header names the file until then, so begin() can
+// count its newer segments after a reset. Older versions of this library
+// can't mount the table while a count is pending.
+///#define SDHASH_LAZY_SEGMENT_COUNT 16
+
+// keep histograms of how long createFile, appendFile, readFile and
+// deleteFile take, see latencyStats(). Takes about 230 bytes of RAM.
+///#define SDHASH_LATENCY_STATS
+
+// clock the latency histograms are kept in, called without arguments.
+// micros() on Arduinos, and a monotonic clock in microseconds on the host.
+#ifndef SDHASH_LATENCY_CLOCK
+#define SDHASH_LATENCY_CLOCK micros
+#endif
+
+// once a file's segment 0 has been rewritten SDHASH_ROTATE_AFTER times,
+// take this many blocks next to it, itself included, and write its
+// segment count to each of them in turn. That spreads the writes that
+// otherwise all hit segment 0 for every append, at the cost of reading
+// the other blocks when looking the file up. Tables created with this
+// enabled can only be mounted when it is enabled. At most 8.
+///#define SDHASH_ROTATE_SEGMENT_COUNT 4
+
+#ifndef SDHASH_ROTATE_AFTER
+#define SDHASH_ROTATE_AFTER 32
+#endif
+
+// place the segments of a file in the allocation unit of its segment 0
+// rather than anywhere on the card, so appending to a file keeps writing
+// to the same erase block. The unit size is asked from the card with
+// allocationUnitSize() when a table is created, and is
+// SDHASH_ALLOCATION_UNIT_BLOCKS if the card doesn't know. Tables created
+// with this enabled can only be mounted when it is enabled.
+///#define SDHASH_LOCAL_SEGMENTS
+
+#ifndef SDHASH_ALLOCATION_UNIT_BLOCKS
+#define SDHASH_ALLOCATION_UNIT_BLOCKS 8192
+#endif
+
+// have begin() pick the fastest SPI rate at which a few scratch blocks
+// past the table survive a CRC checked write and read, instead of always
+// running at full speed. The rate and how long block transfers took, in
+// SDHASH_LATENCY_CLOCK ticks, are kept in the table header, see
+// cardProfile(). Tables created with this enabled are 8 blocks smaller.
+///#define SDHASH_AUTO_SCK_RATE
+
+// keep a Bloom filter of the filehandles of all files in this many bits
+// of RAM, so checking for a file that doesn't exist mostly doesn't read
+// the card at all. begin() builds it by replaying __LOG, which then also
+// lists hidden files. On tables created without this, or whose __LOG lost
+// a segment, the filter stays off and every lookup reads the card. Deleted
+// files stay in it until the next begin(). Tables created with this
+// enabled can only be mounted when it is enabled, and their __LOG mustn't
+// be truncated. At most 65536.
+///#define SDHASH_BLOOM_FILTER_BITS 2048
+
+// let growTable() make a table bigger while it is in use, e.g. after
+// copying it to a bigger card. Files move to the bigger table a few at a
+// time, and are looked for in both tables meanwhile, so missing files
+// take twice as long to look for. Tables that were grown can only be
+// mounted when this is enabled.
+///#define SDHASH_ONLINE_GROWTH
+
+// buckets of the old table each growStep() looks for files to move in
+#ifndef SDHASH_GROWTH_STEP
+#define SDHASH_GROWTH_STEP 8
+#endif
+
+// keep the names of all files but hidden ones sorted in a B-tree in the
+// hidden file __IDX, so findPrefix() and findRange() read a few blocks
+// rather than all of __LOG. Creating and deleting files updates it, which
+// costs a few more block reads and two more writes. Needs LOGGING_ENABLED,
+// and tables with segment tags.
+///#define SDHASH_NAME_INDEX
+
+// let createCompressedFile() make files whose segments are compressed with
+// a small LZ77 variant, so big appends of repetitive data, like text or
+// slowly changing readings, write fewer blocks. Packing a segment looks
+// back up to 256 bytes for every byte, which takes CPU time, and reading
+// one takes a 256 byte buffer.
+///#define SDHASH_COMPRESSION
+
+// keep the data of files createFile() makes with data in their segment 0
+// until it outgrows the rest of the block, 478 bytes or 474 with wide
+// handles, so a small file takes a single block, and is created with one
+// block write and read with one block read. Appending to such a file
+// rewrites segment 0, which takes a block sized buffer on the stack, until
+// its data moves to segment 1.
+// Tables with inline files can only be used when this is enabled.
+///#define SDHASH_INLINE_FILES
+
+// end the data segments written with a CRC32C of their metadata and data,
+// which readFile checks, returning SDH_ERR_CHECKSUM for segments a reset or
+// brown-out left corrupt. They hold 4 bytes less. Tables become version 4
+// when the first checked segment is written to them, which builds without
+// it read without checking.
+///#define SDHASH_SEGMENT_CHECKSUMS
+
+// let createRingFile() make files of a fixed number of segments, which
+// appendFile overwrites oldest first once they are full, so logging to one
+// costs a single block write per segment and never deletes. Every segment
+// starts with a 4 byte sequence number readFile finds the oldest by.
+// Needs tables with segment tags.
+///#define SDHASH_RING_FILES
+
+// number of buckets of tables created by begin(), 0 to use the whole card
+#ifndef SDHASH_TABLE_BUCKETS
+#define SDHASH_TABLE_BUCKETS 0
+#endif
+
+// most tables a partition directory can hold
+#ifndef SDHASH_MAX_PARTITIONS
+#define SDHASH_MAX_PARTITIONS 8
+#endif
+
+// bytes per block, and therefore per bucket and segment
+#ifndef SDHASH_BLOCK_SIZE
+#define SDHASH_BLOCK_SIZE 512
+#endif
+
+// bytes readFileTo hands to its sink at a time, which it also keeps on
+// the stack
+#ifndef SDHASH_SINK_CHUNK_SIZE
+#define SDHASH_SINK_CHUNK_SIZE 16
+#endif
+
+// bytes appendFileFrom asks its source for at a time
+#ifndef SDHASH_SOURCE_CHUNK_SIZE
+#define SDHASH_SOURCE_CHUNK_SIZE 16
+#endif
+
+// segments truncateTo and truncateFile look up before freeing them, whose
+// addresses are kept on the stack. At most 255.
+#ifndef SDHASH_TRUNCATE_BATCH
+#define SDHASH_TRUNCATE_BATCH 16
+#endif
+
+// the block device SDHash sits on. It has to provide the same methods as
+// Sd2Card. Host builds default to a file backed card.
+#ifndef SDHASH_BLOCK_DEVICE
+#ifdef ARDUINO
+#define SDHASH_BLOCK_DEVICE Sd2Card
+#define SDHASH_BLOCK_DEVICE_HEADER "utility/Sd2Card.h"
+#else
+#define SDHASH_BLOCK_DEVICE SdFileCard
+#define SDHASH_BLOCK_DEVICE_HEADER "utility/SdFileCard.h"
+#endif
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ * Measures the cost of one segment step (_incHash) for each hash function.
+ * tools/hashbench.cpp does the same on the host.
+ */
+#include <SDHash.h>
+
+#define STEPS 1000
+
+void bench(char *name, uint8_t func) {
+  uint32_t h = 1;
+  unsigned long t0 = micros();
+  for (uint16_t idx = 0; idx < STEPS; ++idx) h = sdhIncHash(func, h);
+  unsigned long elapsed = micros() - t0;
+
+  Serial.print(name);
+  Serial.print(" ");
+  Serial.print(elapsed * 1000 / STEPS);
+  Serial.print(" ns/step (");
+  Serial.print(h, HEX);
+  Serial.println(")");
+}
+
+void setup() {
+  Serial.begin(9600);
+  
+  bench("fnv1a", kSDHashFNV1a);
+  bench("murmur3", kSDHashMurmur3);
+}
+
+void loop () {
+}
@@ -21,6 +21,24 @@ static int FreeRam(void) {
   return free_memory;
 }
 
+// Print can't do 64 bit values, so print wide handles as two halves
+void printHandle(SDHFilehandle fh) {
+#ifdef SDHASH_WIDE_HANDLES
+  Serial.print((uint32_t)(fh >> 32), HEX);
+  Serial.print(':');
+#endif
+  Serial.println((uint32_t)fh, HEX);
+}
+
+#ifdef SDHASH_NAME_INDEX
+bool printName(void *ctx, const char *filename, SDHAddress seg0addr) {
+  Serial.print(seg0addr, DEC);
+  Serial.print(" ");
+  Serial.println(filename);
+  return true;
+}
+#endif
+
 char inputStr[32];  
 char *inputPtr;
 
@@ -53,6 +71,10 @@ void handleError(uint8_t errorCode) {
       Serial.println("file already exists");
       break;
     
+    case SDH_ERR_HANDLE_COLLISION:
+      Serial.println("filehandle collision");
+      break;
+      
     case SDH_ERR_WRONG_SEGMENT_TYPE:
       Serial.println("wrong segment type");
       break;
@@ -72,6 +94,11 @@ void handleError(uint8_t errorCode) {
   }
 }
 
+bool serialSink(void *ctx, const uint8_t *data, uint8_t len) {
+  Serial.write(data, len);
+  return true;
+}
+
 void handleInput() {
   Serial.println(inputStr);
   
@@ -89,6 +116,55 @@ void handleInput() {
     uint8_t ret = SDHash.zeroMagic();
     if ( ret == SDH_OK) Serial.println("ok");
     else handleError(ret);
+  } else if (strcmp(token, "sync") == 0) {
+    uint8_t ret = SDHash.flush();
+    if ( ret == SDH_OK) Serial.println("ok");
+    else handleError(ret);
+#ifdef SDHASH_LATENCY_STATS
+  } else if (strcmp(token, "lat") == 0) {
+    // lat prints count/p50/p99/max per operation in microseconds, lat r resets
+    if (ptr && strcmp(ptr, "r") == 0) {
+      SDHash.resetLatencyStats();
+      Serial.println("ok");
+    } else {
+      const char *names[kSDHashOpCount] = {"create", "append", "read", "delete"};
+      for (uint8_t op = 0; op < kSDHashOpCount; ++op) {
+        Serial.print(names[op]);
+        Serial.print(" n=");
+        Serial.print(SDHash.latencyStats((SDHOperation)op)->count);
+        Serial.print(" p50=");
+        Serial.print(SDHash.latencyPercentile((SDHOperation)op, 50));
+        Serial.print(" p99=");
+        Serial.print(SDHash.latencyPercentile((SDHOperation)op, 99));
+        Serial.print(" max=");
+        Serial.println(SDHash.latencyStats((SDHOperation)op)->max);
+      }
+    }
+#endif
+#ifdef SDHASH_AUTO_SCK_RATE
+  } else if (strcmp(token, "prof") == 0) {
+    // prof prints the SPI rate and microseconds per block, prof t tunes again
+    uint8_t ret = SDH_OK;
+    if (ptr && strcmp(ptr, "t") == 0) ret = SDHash.tuneSckRate();
+    if (ret != SDH_OK) handleError(ret);
+    else {
+      const SDHCardProfile *profile = SDHash.cardProfile();
+      Serial.print("rate=");
+      Serial.print(profile->sckRate, DEC);
+      Serial.print(" read=");
+      Serial.print(profile->readBlockTicks);
+      Serial.print(" write=");
+      Serial.print(profile->writeBlockTicks);
+      Serial.print(" multi=");
+      Serial.println(profile->multiWriteBlockTicks);
+    }
+#endif
+#ifdef SDHASH_NAME_INDEX
+  } else if (strcmp(token, "find") == 0) {
+    // find lists the files whose names start with the argument, or all
+    uint8_t ret = SDHash.findPrefix(ptr?ptr:"", printName, NULL);
+    if (ret != SDH_OK) handleError(ret);
+#endif
   } else if (strcmp(token, "free") == 0) {
     Serial.print("free ram=");
     Serial.println(FreeRam());
@@ -114,12 +190,21 @@ void handleInput() {
       Serial.println(token);
       
       Serial.print("hash=0x");
-      Serial.println(fh, HEX);
+      printHandle(fh);
       
       uint8_t ret = SDHash.createFile(fh, token);
       if (ret == SDH_OK) Serial.println("ok");
       else handleError(ret);
     }
+#ifdef SDHASH_COMPRESSION
+  } else if (strcmp(token, "cz") == 0) {
+    // cz creates a compressed file
+    if (ptr) {
+      uint8_t ret = SDHash.createCompressedFile(SDHash.filehandle(ptr), ptr);
+      if (ret == SDH_OK) Serial.println("ok");
+      else handleError(ret);
+    }
+#endif
   } else if (strcmp(token, "s") == 0) {
     if (ptr) {
       token = ptr;
@@ -131,14 +216,14 @@ void handleInput() {
       
       FileInfo finfo;
       SDHAddress addr;
-      uint8_t ret = SDHash.statFile(fh, &finfo, &addr);
+      uint8_t ret = SDHash.statFile(fh, token, &finfo, &addr);
       
       if (ret == SDH_OK) {
         Serial.print("addr=");
         Serial.println(addr);
         
         Serial.print("hash=0x");
-        Serial.println(finfo.hash, HEX);
+        printHandle(finfo.hash);
         
         Serial.print("segments=");
         Serial.println(finfo.segments_count);
@@ -157,7 +242,7 @@ void handleInput() {
       
       if (ret == SDH_OK) {
         Serial.print("hash=0x");
-        Serial.println(finfo.hash, HEX);
+        printHandle(finfo.hash);
         
         Serial.print("segments=");
         Serial.println(finfo.segments_count);
@@ -220,6 +305,14 @@ void handleInput() {
         } else handleError(ret);
       }
     }
+  } else if (strcmp(token, "cat") == 0) {
+    if (ptr) {
+      // streams the whole file to serial without a buffer
+      uint32_t len = 0xffffffff;
+      uint8_t ret = SDHash.readFileTo(SDHash.filehandle(ptr), 0, &len, serialSink, NULL);
+      Serial.println("");
+      if (ret != SDH_OK) handleError(ret);
+    }
   } else if (strcmp(token, "segaddr") == 0) {
     if (ptr) {
       char *filename = ptr;
@@ -258,7 +351,7 @@ void handleInput() {
     uint8_t off = 0;
     do {
       len = sizeof buf;
-      ret = SDHash.readFile(SDHash.filehandle("__LOG"), off, buf, &len);
+      ret = SDHash.readFile(SDHash.logFilehandle(), off, buf, &len);
       if (ret != SDH_OK) handleError(ret);
       
       if (len == 0) {
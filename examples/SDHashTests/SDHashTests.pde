@@ -81,6 +81,46 @@ uint8_t test1(uint8_t *err) {
     return TEST_FAILED;
   }
   
+  if (memcmp(buf, _testPattern, sizeof buf)) {
+    Serial.print("data mismatch");
+    return TEST_FAILED; 
+  }
+  /************************************************************************/
+  Serial.println("testing writes across boundaries");
+  
+  // put the original pattern back, a few bytes at a time
+  for (byte idx = 0; idx < sizeof _testPattern; idx+=1) {
+    _testPattern[idx] = ~_testPattern[idx];
+  }
+  
+  for (byte idx = 0; idx < sizeof _testPattern; idx+=4) {
+    len = min(4, sizeof _testPattern - idx);
+    *err = SDHash.writeAt(fh, idx, _testPattern+idx, &len);
+    if (*err != SDH_OK) return TEST_ERROR;
+    if (len) {
+      Serial.println("length mismatch");
+      return TEST_FAILED;
+    }
+  }
+  
+  // writes stop at the end of the file
+  len = 4;
+  *err = SDHash.writeAt(fh, sizeof _testPattern - 1, _testPattern + sizeof _testPattern - 1, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  if (len != 3) {
+    Serial.println("length mismatch");
+    return TEST_FAILED;
+  }
+  
+  len = sizeof buf;
+  *err = SDHash.readFile(fh, 0, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  if (len) {
+    Serial.println("length mismatch");
+    return TEST_FAILED;
+  }
+  
   if (memcmp(buf, _testPattern, sizeof buf)) {
     Serial.print("data mismatch");
     return TEST_FAILED; 
@@ -109,9 +149,637 @@ uint8_t test1(uint8_t *err) {
     Serial.print("data mismatch");
     return TEST_FAILED;
   }
+  /************************************************************************/
+  
+  Serial.println("testing truncation to a length");
+  
+  *err = SDHash.truncateTo(fh, 5);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  memset(buf, 0xFF, sizeof buf);
+  
+  len = sizeof buf;
+  *err = SDHash.readFile(fh, 0, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  if (len != sizeof buf - 5) {
+    Serial.print("length mismatch=");
+    Serial.println(len, DEC);
+  
+    return TEST_FAILED;
+  }
+  
+  if (memcmp(buf, _testPattern, 5)) {
+    Serial.print("data mismatch");
+    return TEST_FAILED;
+  }
+  
+  if (SDHash.truncateTo(fh, 6) != SDH_ERR_INVALID_ARGUMENT) {
+    Serial.print("truncated past the end");
+    return TEST_FAILED;
+  }
+  
+  return TEST_OK;
+}
+
+// the bytes of the long file test2 writes, from offset on
+void longPattern(uint32_t offset, uint8_t *buf, byte len) {
+  for (byte idx = 0; idx < len; ++idx) {
+    buf[idx] = (offset + idx) * 7 + ((offset + idx) >> 6);
+  }
+}
+
+uint8_t test2(uint8_t *err) {
+  
+  char *filename = "sdhash.long";
+  SDHFilehandle fh = SDHash.filehandle(filename);
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK && *err != SDH_ERR_FILE_NOT_FOUND) return TEST_ERROR;
+  
+  *err = SDHash.createFile(fh, filename);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  /************************************************************************/
+  
+  Serial.println("testing files longer than 127 segments");
+  
+  // every append takes a segment of its own, so the segment tags
+  // repeat twice over
+  uint8_t buf[64], want[64];
+  const uint32_t size = 300UL * sizeof buf;
+  for (uint32_t ofs = 0; ofs < size; ofs += sizeof buf) {
+    longPattern(ofs, buf, sizeof buf);
+    *err = SDHash.appendFile(fh, buf, sizeof buf);
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  
+  // overwrite a stretch past the first repeat, then cut the file short
+  // in the middle of a segment
+  memset(buf, 0xa5, sizeof buf);
+  SDHDataSize len = sizeof buf;
+  *err = SDHash.writeAt(fh, 200UL * sizeof buf + 10, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  *err = SDHash.truncateTo(fh, size - 100);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  // read it back after a remount, which rereads how segments are placed
+  // from the table header
+#ifdef SDHASH_LOCAL_SEGMENTS
+  if (!(SDHash.hashInfo()->flags & kSDHashTableLocalSegments)) {
+    Serial.println("table without local segments");
+    return TEST_FAILED;
+  }
+  uint8_t unitShift = SDHash.hashInfo()->unitShift;
+#endif
+  *err = SDHash.flush();
+  if (*err != SDH_OK) return TEST_ERROR;
+  *err = SDHash.begin();
+  if (*err != SDH_OK) return TEST_ERROR;
+#ifdef SDHASH_LOCAL_SEGMENTS
+  if (SDHash.hashInfo()->unitShift != unitShift) {
+    Serial.println("allocation unit size lost");
+    return TEST_FAILED;
+  }
+#endif
+  
+  for (uint32_t ofs = 0; ofs < size - 100; ofs += sizeof buf) {
+    len = sizeof buf;
+    *err = SDHash.readFile(fh, ofs, buf, &len);
+    if (*err != SDH_OK) return TEST_ERROR;
+    
+    longPattern(ofs, want, sizeof want);
+    if (ofs == 200UL * sizeof buf) memset(want + 10, 0xa5, sizeof want - 10);
+    if (ofs == 201UL * sizeof buf) memset(want, 0xa5, 10);
+    
+    SDHDataSize count = min((uint32_t)sizeof buf, size - 100 - ofs);
+    if (len != sizeof buf - count) {
+      Serial.println("length mismatch");
+      return TEST_FAILED;
+    }
+    if (memcmp(buf, want, count)) {
+      Serial.print("data mismatch at ");
+      Serial.println(ofs, DEC);
+      return TEST_FAILED;
+    }
+  }
+  
+  /************************************************************************/
+  
+  Serial.println("testing truncation after a reset");
+  
+  // a reset while truncateTo(fh, 290 * 64) frees the tail leaves the
+  // old count with the last segments gone
+  for (SDHSegmentCount segNumber = 299; segNumber >= 298; --segNumber) {
+    SDHAddress addr;
+    *err = SDHash.findSeg(fh, segNumber, &addr);
+    if (*err != SDH_OK) return TEST_ERROR;
+    *err = SDHash.zero(addr, 1);
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  
+  len = sizeof buf;
+  if (SDHash.readFile(fh, 298UL * sizeof buf, buf, &len) != SDH_ERR_MISSIG_SEGMENT) {
+    Serial.println("read past the cut");
+    return TEST_FAILED;
+  }
+  
+  // truncating again finishes it, and appends land right after the cut
+  *err = SDHash.truncateTo(fh, 290UL * sizeof buf);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  memset(buf, 0x5a, sizeof buf);
+  *err = SDHash.appendFile(fh, buf, sizeof buf);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  memset(buf, 0xFF, sizeof buf);
+  len = sizeof buf;
+  *err = SDHash.readFile(fh, 290UL * sizeof buf, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  memset(want, 0x5a, sizeof want);
+  if (len != 0 || memcmp(buf, want, sizeof want)) {
+    Serial.println("data mismatch after the cut");
+    return TEST_FAILED;
+  }
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  return TEST_OK;
+}
+
+#ifdef SDHASH_ONLINE_GROWTH
+// reads back a file test3 wrote
+uint8_t checkGrowFile(char *filename, uint8_t *err) {
+  uint8_t buf[64], want[64];
+  SDHDataSize len = sizeof buf;
+  *err = SDHash.readFile(SDHash.filehandle(filename), 0, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  longPattern(filename[5], want, sizeof want);
+  if (len != 0 || memcmp(buf, want, sizeof want)) {
+    Serial.print("data mismatch in ");
+    Serial.println(filename);
+    return TEST_FAILED;
+  }
+  return TEST_OK;
+}
+
+uint8_t test3(uint8_t *err) {
+  char filename[] = "grow.a";
+  uint8_t buf[64];
+  
+  /************************************************************************/
+  
+  Serial.println("testing growing the table");
+  
+  for (filename[5] = 'a'; filename[5] <= 'z'; ++filename[5]) {
+    SDHFilehandle fh = SDHash.filehandle(filename);
+    *err = SDHash.deleteFile(fh);
+    if (*err != SDH_OK && *err != SDH_ERR_FILE_NOT_FOUND) return TEST_ERROR;
+    *err = SDHash.createFile(fh, filename);
+    if (*err != SDH_OK) return TEST_ERROR;
+    longPattern(filename[5], buf, sizeof buf);
+    *err = SDHash.appendFile(fh, buf, sizeof buf);
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  
+  // only a table created smaller than the card, see
+  // SDHASH_TABLE_BUCKETS, has room to grow
+  SDHBucketCount buckets = SDHash.hashInfo()->buckets;
+  *err = SDHash.growTable(0);
+  if (*err == SDH_ERR_INVALID_ARGUMENT) {
+    Serial.println("table fills the card, not grown");
+  } else if (*err != SDH_OK) {
+    return TEST_ERROR;
+  } else if (SDHash.hashInfo()->buckets <= buckets) {
+    Serial.println("table didn't grow");
+    return TEST_FAILED;
+  }
+  
+  // files are found in either table while they move, and in the new
+  // one after a remount
+  while (SDHash.growthLeft()) {
+    for (filename[5] = 'a'; filename[5] <= 'z'; ++filename[5]) {
+      uint8_t ret = checkGrowFile(filename, err);
+      if (ret != TEST_OK) return ret;
+    }
+    *err = SDHash.growStep();
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  
+  *err = SDHash.begin();
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  for (filename[5] = 'a'; filename[5] <= 'z'; ++filename[5]) {
+    uint8_t ret = checkGrowFile(filename, err);
+    if (ret != TEST_OK) return ret;
+    *err = SDHash.deleteFile(SDHash.filehandle(filename));
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
   
   return TEST_OK;
 }
+#endif
+
+#ifdef SDHASH_NAME_INDEX
+char *_indexNames[] = {"idx.apple", "idx.apricot", "idx.banana", "idx.cherry"};
+
+// the names a walk of the index should visit, in order
+typedef struct {
+  byte first;
+  byte count;
+  byte visited;
+  bool mismatch;
+} IndexWalk;
+
+bool visitName(void *ctx, const char *filename, SDHAddress seg0addr) {
+  IndexWalk *walk = (IndexWalk*)ctx;
+  FileInfo finfo;
+  SDHAddress addr;
+  if (walk->visited >= walk->count || strcmp(filename, _indexNames[walk->first + walk->visited]) ||
+      SDHash.statFile(SDHash.filehandle((char*)filename), &finfo, &addr) != SDH_OK || addr != seg0addr) {
+    walk->mismatch = true;
+    return false;
+  }
+  walk->visited += 1;
+  return true;
+}
+
+uint8_t checkIndex(const char *prefix, const char *first, const char *last, byte firstName, byte count, uint8_t *err) {
+  IndexWalk walk = {firstName, count, 0, false};
+  if (prefix) *err = SDHash.findPrefix(prefix, visitName, &walk);
+  else *err = SDHash.findRange(first, last, visitName, &walk);
+  if (walk.mismatch) {
+    Serial.println("unexpected name");
+    return TEST_FAILED;
+  }
+  if (*err != SDH_OK) return TEST_ERROR;
+  if (walk.visited != count) {
+    Serial.print("names missing, found ");
+    Serial.println(walk.visited, DEC);
+    return TEST_FAILED;
+  }
+  return TEST_OK;
+}
+
+uint8_t test4(uint8_t *err) {
+  
+  /************************************************************************/
+  
+  Serial.println("testing the name index");
+  
+  // created out of order, the index sorts them
+  for (byte idx = sizeof _indexNames / sizeof *_indexNames; idx--;) {
+    SDHFilehandle fh = SDHash.filehandle(_indexNames[idx]);
+    *err = SDHash.deleteFile(fh);
+    if (*err != SDH_OK && *err != SDH_ERR_FILE_NOT_FOUND) return TEST_ERROR;
+    *err = SDHash.createFile(fh, _indexNames[idx]);
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  
+  uint8_t ret = checkIndex("idx.ap", NULL, NULL, 0, 2, err);
+  if (ret != TEST_OK) return ret;
+  ret = checkIndex(NULL, "idx.apricot", "idx.cherry", 1, 2, err);
+  if (ret != TEST_OK) return ret;
+  ret = checkIndex(NULL, "idx.b", "idx.d", 2, 2, err);
+  if (ret != TEST_OK) return ret;
+  
+  // rebuilt from __LOG, then read back after a remount
+  *err = SDHash.rebuildIndex();
+  if (*err != SDH_OK) return TEST_ERROR;
+  *err = SDHash.begin();
+  if (*err != SDH_OK) return TEST_ERROR;
+  ret = checkIndex("idx.", NULL, NULL, 0, 4, err);
+  if (ret != TEST_OK) return ret;
+  
+  *err = SDHash.deleteFile(SDHash.filehandle(_indexNames[0]));
+  if (*err != SDH_OK) return TEST_ERROR;
+  ret = checkIndex("idx.", NULL, NULL, 1, 3, err);
+  if (ret != TEST_OK) return ret;
+  
+  for (byte idx = 1; idx < sizeof _indexNames / sizeof *_indexNames; ++idx) {
+    *err = SDHash.deleteFile(SDHash.filehandle(_indexNames[idx]));
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  return checkIndex("idx.", NULL, NULL, 0, 0, err);
+}
+#endif
+
+#ifdef SDHASH_COMPRESSION
+// more than a segment holds, appends of less are stored as they are
+uint8_t _packBuf[900];
+
+// readings that repeat a lot, or bytes that don't repeat at all
+uint8_t packByte(bool random, uint16_t idx) {
+  if (random) return (uint8_t)((idx * 2654435761UL) >> 13);
+  return "t=21.5 h=40\n"[idx % 12];
+}
+
+uint8_t testPacked(bool random, SDHSegmentCount segments, uint8_t *err) {
+  char *filename = "sdhash.packed";
+  SDHFilehandle fh = SDHash.filehandle(filename);
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK && *err != SDH_ERR_FILE_NOT_FOUND) return TEST_ERROR;
+  *err = SDHash.createCompressedFile(fh, filename);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  for (uint16_t idx = 0; idx < sizeof _packBuf; ++idx) _packBuf[idx] = packByte(random, idx);
+  *err = SDHash.appendFile(fh, _packBuf, sizeof _packBuf);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  FileInfo finfo;
+  SDHAddress addr;
+  *err = SDHash.statFile(fh, &finfo, &addr);
+  if (*err != SDH_OK) return TEST_ERROR;
+  if (finfo.segments_count != segments) {
+    Serial.print("segments=");
+    Serial.println(finfo.segments_count, DEC);
+    return TEST_FAILED;
+  }
+  
+  // read at offsets that start and end inside segments
+  uint8_t buf[64];
+  for (uint16_t ofs = 10; ofs < sizeof _packBuf; ofs += sizeof buf) {
+    SDHDataSize len = sizeof buf;
+    *err = SDHash.readFile(fh, ofs, buf, &len);
+    if (*err != SDH_OK) return TEST_ERROR;
+    
+    SDHDataSize count = min((uint16_t)sizeof buf, (uint16_t)(sizeof _packBuf - ofs));
+    if (len != sizeof buf - count) {
+      Serial.println("length mismatch");
+      return TEST_FAILED;
+    }
+    for (SDHDataSize idx = 0; idx < count; ++idx) {
+      if (buf[idx] != packByte(random, ofs + idx)) {
+        Serial.print("data mismatch at ");
+        Serial.println(ofs + idx, DEC);
+        return TEST_FAILED;
+      }
+    }
+  }
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK) return TEST_ERROR;
+  return TEST_OK;
+}
+
+uint8_t test5(uint8_t *err) {
+  
+  /************************************************************************/
+  
+  Serial.println("testing compressed files");
+  
+  // one segment besides segment 0 holds it all
+  uint8_t ret = testPacked(false, 2, err);
+  if (ret != TEST_OK) return ret;
+  
+  /************************************************************************/
+  
+  Serial.println("testing incompressible data");
+  
+  // stored as it is, so it takes as many segments as uncompressed,
+  // rather than more
+  return testPacked(true, 3, err);
+}
+#endif
+
+#ifdef SDHASH_INLINE_FILES
+// reads back size bytes of the file test6 writes, with a stretch
+// overwritten by writeAt
+uint8_t checkInline(SDHFilehandle fh, uint32_t size, bool inlined, uint8_t *err) {
+  FileInfo finfo;
+  SDHAddress addr;
+  *err = SDHash.statFile(fh, &finfo, &addr);
+  if (*err != SDH_OK) return TEST_ERROR;
+  if (!(finfo.flags & kSDHashFileInline) != !inlined) {
+    Serial.println(inlined?"data not inline":"data still inline");
+    return TEST_FAILED;
+  }
+  
+  uint8_t buf[64], want[64];
+  for (uint32_t ofs = 0; ofs < size; ofs += sizeof buf) {
+    SDHDataSize len = sizeof buf;
+    *err = SDHash.readFile(fh, ofs, buf, &len);
+    if (*err != SDH_OK) return TEST_ERROR;
+    
+    longPattern(ofs, want, sizeof want);
+    if (ofs == 64) memset(want + 26, 0xa5, 10);
+    SDHDataSize count = min((uint32_t)sizeof buf, size - ofs);
+    if (len != sizeof buf - count || memcmp(buf, want, count)) {
+      Serial.print("data mismatch at ");
+      Serial.println(ofs, DEC);
+      return TEST_FAILED;
+    }
+  }
+  return TEST_OK;
+}
+
+uint8_t test6(uint8_t *err) {
+  char *filename = "sdhash.inline";
+  SDHFilehandle fh = SDHash.filehandle(filename);
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK && *err != SDH_ERR_FILE_NOT_FOUND) return TEST_ERROR;
+  
+  /************************************************************************/
+  
+  Serial.println("testing inline files");
+  
+  uint8_t buf[64];
+  longPattern(0, buf, sizeof buf);
+  *err = SDHash.createFile(fh, filename, buf, sizeof buf);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  // appends and writes that still fit rewrite segment 0
+  longPattern(sizeof buf, buf, sizeof buf);
+  *err = SDHash.appendFile(fh, buf, sizeof buf);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  memset(buf, 0xa5, 10);
+  SDHDataSize len = 10;
+  *err = SDHash.writeAt(fh, 90, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  *err = SDHash.begin();
+  if (*err != SDH_OK) return TEST_ERROR;
+  uint8_t ret = checkInline(fh, 2 * sizeof buf, true, err);
+  if (ret != TEST_OK) return ret;
+  
+  // past the end of the block the data moves to segment 1
+  for (uint32_t ofs = 2 * sizeof buf; ofs < 10 * sizeof buf; ofs += sizeof buf) {
+    longPattern(ofs, buf, sizeof buf);
+    *err = SDHash.appendFile(fh, buf, sizeof buf);
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  ret = checkInline(fh, 10 * sizeof buf, false, err);
+  if (ret != TEST_OK) return ret;
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK) return TEST_ERROR;
+  return TEST_OK;
+}
+#endif
+
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+uint8_t test7(uint8_t *err) {
+  char *filename = "sdhash.crc";
+  SDHFilehandle fh = SDHash.filehandle(filename);
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK && *err != SDH_ERR_FILE_NOT_FOUND) return TEST_ERROR;
+  
+  /************************************************************************/
+  
+  Serial.println("testing segment checksums");
+  
+  uint8_t buf[64];
+  longPattern(0, buf, sizeof buf);
+  *err = SDHash.createFile(fh, filename);
+  if (*err != SDH_OK) return TEST_ERROR;
+  *err = SDHash.appendFile(fh, buf, sizeof buf);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  // the table stays readable by the versions that know checked segments
+  *err = SDHash.begin();
+  if (*err != SDH_OK) return TEST_ERROR;
+  if (SDHash.hashInfo()->version != 4) {
+    Serial.print("version=");
+    Serial.println(SDHash.hashInfo()->version, DEC);
+    return TEST_FAILED;
+  }
+  
+  SDHAddress addr;
+  SegmentInfo sinfo;
+  *err = SDHash.findSeg(fh, 1, &addr);
+  if (*err != SDH_OK) return TEST_ERROR;
+  *err = SDHash.statSeg(addr, &sinfo);
+  if (*err != SDH_OK) return TEST_ERROR;
+  if (!sinfo.checked) {
+    Serial.println("segment not checked");
+    return TEST_FAILED;
+  }
+  
+  SDHDataSize len = sizeof buf;
+  *err = SDHash.readFile(fh, 0, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  // a byte gone bad in the middle of the data
+  uint8_t block[SDHASH_BLOCK_SIZE];
+  if (!SDHash.card()->readBlock(addr, block)) return TEST_ERROR;
+  block[SDHASH_BLOCK_SIZE / 16] ^= 0x10;
+  if (!SDHash.card()->writeBlock(addr, block, sizeof block)) return TEST_ERROR;
+  
+  len = sizeof buf;
+  if (SDHash.readFile(fh, 0, buf, &len) != SDH_ERR_CHECKSUM) {
+    Serial.println("bad segment read");
+    return TEST_FAILED;
+  }
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK) return TEST_ERROR;
+  return TEST_OK;
+}
+#endif
+
+#ifdef SDHASH_RING_FILES
+// appends records first to last to the ring, one segment each
+uint8_t appendRing(SDHFilehandle fh, byte first, byte last, uint8_t *err) {
+  uint8_t buf[64];
+  for (byte record = first; record <= last; ++record) {
+    longPattern(record * sizeof buf, buf, sizeof buf);
+    *err = SDHash.appendFile(fh, buf, sizeof buf);
+    if (*err != SDH_OK) return TEST_ERROR;
+  }
+  return TEST_OK;
+}
+
+// the ring should read as records first to last, oldest first
+uint8_t checkRing(SDHFilehandle fh, byte first, byte last, uint8_t *err) {
+  uint8_t buf[64], want[64];
+  for (byte record = first; record <= last + 1; ++record) {
+    SDHDataSize len = sizeof buf;
+    *err = SDHash.readFile(fh, (uint32_t)(record - first) * sizeof buf, buf, &len);
+    if (*err != SDH_OK) return TEST_ERROR;
+    
+    if (record > last) {
+      if (len != sizeof buf) {
+        Serial.println("read past the newest record");
+        return TEST_FAILED;
+      }
+      break;
+    }
+    longPattern(record * sizeof buf, want, sizeof want);
+    if (len != 0 || memcmp(buf, want, sizeof want)) {
+      Serial.print("record mismatch at ");
+      Serial.println(record, DEC);
+      return TEST_FAILED;
+    }
+  }
+  return TEST_OK;
+}
+
+uint8_t test8(uint8_t *err) {
+  char *filename = "sdhash.ring";
+  SDHFilehandle fh = SDHash.filehandle(filename);
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK && *err != SDH_ERR_FILE_NOT_FOUND) return TEST_ERROR;
+  
+  /************************************************************************/
+  
+  Serial.println("testing ring files");
+  
+  *err = SDHash.createRingFile(fh, filename, 4);
+  if (*err != SDH_OK) return TEST_ERROR;
+  
+  // its segments are all there, but empty
+  uint8_t buf[64];
+  SDHDataSize len = sizeof buf;
+  *err = SDHash.readFile(fh, 0, buf, &len);
+  if (*err != SDH_OK) return TEST_ERROR;
+  if (len != sizeof buf) {
+    Serial.println("new ring not empty");
+    return TEST_FAILED;
+  }
+  
+  // wrapping around overwrites the oldest records
+  uint8_t ret = appendRing(fh, 0, 5, err);
+  if (ret != TEST_OK) return ret;
+  ret = checkRing(fh, 2, 5, err);
+  if (ret != TEST_OK) return ret;
+  
+  /************************************************************************/
+  
+  Serial.println("testing ring files after a remount");
+  
+  // the newest segment is looked for again, reads start after it and
+  // appends go there
+  *err = SDHash.begin();
+  if (*err != SDH_OK) return TEST_ERROR;
+  ret = checkRing(fh, 2, 5, err);
+  if (ret != TEST_OK) return ret;
+  
+  ret = appendRing(fh, 6, 6, err);
+  if (ret != TEST_OK) return ret;
+  ret = checkRing(fh, 3, 6, err);
+  if (ret != TEST_OK) return ret;
+  
+  *err = SDHash.begin();
+  if (*err != SDH_OK) return TEST_ERROR;
+  ret = appendRing(fh, 7, 13, err);
+  if (ret != TEST_OK) return ret;
+  ret = checkRing(fh, 10, 13, err);
+  if (ret != TEST_OK) return ret;
+  
+  *err = SDHash.deleteFile(fh);
+  if (*err != SDH_OK) return TEST_ERROR;
+  return TEST_OK;
+}
+#endif
 
 void printError(uint8_t err) {
   Serial.print(err, HEX);
@@ -143,6 +811,85 @@ void setup() {
     case TEST_FAILED:
       return;
   }
+  
+#ifndef SDHASH_NO_SEGMENT_TAGS
+  // tables without segment tags mix up the segments of long files whose
+  // probe paths cross
+  switch(test2(&err)) {
+    case TEST_OK:
+      break;
+    case TEST_ERROR:
+      printError(err);
+    case TEST_FAILED:
+      return;
+  }
+#endif
+  
+#ifdef SDHASH_ONLINE_GROWTH
+  switch(test3(&err)) {
+    case TEST_OK:
+      break;
+    case TEST_ERROR:
+      printError(err);
+    case TEST_FAILED:
+      return;
+  }
+#endif
+  
+#ifdef SDHASH_NAME_INDEX
+  switch(test4(&err)) {
+    case TEST_OK:
+      break;
+    case TEST_ERROR:
+      printError(err);
+    case TEST_FAILED:
+      return;
+  }
+#endif
+  
+#ifdef SDHASH_COMPRESSION
+  switch(test5(&err)) {
+    case TEST_OK:
+      break;
+    case TEST_ERROR:
+      printError(err);
+    case TEST_FAILED:
+      return;
+  }
+#endif
+  
+#ifdef SDHASH_INLINE_FILES
+  switch(test6(&err)) {
+    case TEST_OK:
+      break;
+    case TEST_ERROR:
+      printError(err);
+    case TEST_FAILED:
+      return;
+  }
+#endif
+  
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+  switch(test7(&err)) {
+    case TEST_OK:
+      break;
+    case TEST_ERROR:
+      printError(err);
+    case TEST_FAILED:
+      return;
+  }
+#endif
+  
+#if defined(SDHASH_RING_FILES) && !defined(SDHASH_NO_SEGMENT_TAGS)
+  switch(test8(&err)) {
+    case TEST_OK:
+      break;
+    case TEST_ERROR:
+      printError(err);
+    case TEST_FAILED:
+      return;
+  }
+#endif
       
   Serial.println("all tests passed");
 }
@@ -0,0 +1,68 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * Host benchmark of the cost of one segment step (_incHash) for each hash
+ * function, one chain at a time and many chains at once. Build with e.g.
+ *
+ *	g++ -O2 -march=native -I.. -o hashbench hashbench.cpp
+ *
+ * The AVR counterpart is examples/HashBenchmark.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "utility/SDHashFunc.h"
+
+#define STEPS (1UL << 24)
+#define CHAINS 1024
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(const char *name, uint8_t func) {
+	// a single chain, which is what appendFile and friends do
+	uint32_t h = 1;
+	double t0 = now();
+	for (unsigned long idx = 0; idx < STEPS; ++idx) h = sdhIncHash(func, h);
+	double single = (now() - t0) * 1e9 / STEPS;
+
+	// many chains advanced together
+	static uint32_t keys[CHAINS];
+	for (unsigned idx = 0; idx < CHAINS; ++idx) keys[idx] = idx * 2654435761UL;
+	t0 = now();
+	for (unsigned long idx = 0; idx < STEPS / CHAINS; ++idx) sdhIncHashMany(func, keys, CHAINS);
+	double many = (now() - t0) * 1e9 / STEPS;
+
+	// print the results so the loops can't be optimised away
+	printf("%-8s %6.2f ns/step single, %6.2f ns/step batched (%08x %08x)\n",
+		name, single, many, (unsigned)h, (unsigned)keys[0]);
+}
+
+int main() {
+	bench("fnv1a", kSDHashFNV1a);
+	bench("murmur3", kSDHashMurmur3);
+	return 0;
+}
@@ -0,0 +1,516 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * Exports the files of an SDHash card image, the counterpart of sdhimage:
+ *
+ *	sdhexport [-p partition] [-j threads] [-l] [-a] [-d dir | -t tar] image
+ *
+ * Files are found by scanning the whole table for segment 0s, or with -l
+ * by replaying __LOG, which only reads the log but misses files whose
+ * entries were lost. Hidden files are skipped unless -a is given. The
+ * image is mapped into memory and files are reassembled by worker threads,
+ * each with its own instance of the library, so hash chains are followed
+ * exactly as on the device.
+ *
+ * With -d every file is written below dir by the worker reading it. With
+ * -t, or by default to stdout, a tar stream is written in name order,
+ * using large sequential writes. Workers read files ahead into memory,
+ * files too large for that are streamed by the writer itself.
+ *
+ * Table options like SDHASH_WIDE_HANDLES have to match the firmware's.
+ * Build with e.g.
+ *
+ *	g++ -O2 -pthread -I.. -DSDHASH_BLOCK_DEVICE=SdMapCard \
+ *		-DSDHASH_BLOCK_DEVICE_HEADER='"utility/SdMapCard.h"' \
+ *		-DSDHASH_SINK_CHUNK_SIZE=255 -o sdhexport sdhexport.cpp ../SDHash.cpp
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SDHash.h"
+
+// files read ahead of the tar writer at most
+#define READ_AHEAD 64
+// larger files are streamed by the tar writer
+#define MAX_BUFFERED (4UL << 20)
+#define OUTPUT_BUFFER (4UL << 20)
+#define TAR_BLOCK 512
+
+static const uint8_t kTableMagic[5] = {0xae, 'h', 'a', 's', 'h'};
+static const uint8_t kPartitionMagic[5] = {0xae, 'h', 'p', 'r', 't'};
+
+struct File {
+	SDHAddress seg0addr;
+	SDHFilehandle fh;
+	std::string name;
+
+	// filled in by the workers in tar mode
+	std::vector<uint8_t> data;
+	bool ready;
+	bool large;
+	uint8_t err;
+};
+
+/**
+ * Collects output and writes it in large chunks
+ */
+class Output {
+	public:
+		Output(int fd): _fd(fd), _failed(false) { _buf.reserve(OUTPUT_BUFFER); }
+		~Output() { flush(); }
+
+		void write(const uint8_t *data, size_t len) {
+			if (_buf.size() + len > OUTPUT_BUFFER) flush();
+			if (len >= OUTPUT_BUFFER) writeAll(data, len);
+			else _buf.insert(_buf.end(), data, data + len);
+		}
+
+		void flush() {
+			if (!_buf.empty()) writeAll(&_buf[0], _buf.size());
+			_buf.clear();
+		}
+
+		bool failed() const { return _failed; }
+
+	private:
+		int _fd;
+		bool _failed;
+		std::vector<uint8_t> _buf;
+
+		void writeAll(const uint8_t *data, size_t len) {
+			while (len && !_failed) {
+				ssize_t n = ::write(_fd, data, len);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) _failed = true;
+				else {
+					data += n;
+					len -= n;
+				}
+			}
+		}
+};
+
+static std::vector<File> files;
+static std::vector<SDHashClass*> instances;
+static bool hidden;
+static const char *outDir;
+
+static std::mutex lock;
+static std::condition_variable readyCond, spaceCond;
+static size_t nextFile, written;
+
+static bool isHidden(const std::string &name) {
+	return name.compare(0, 2, "__") == 0;
+}
+
+static bool byName(const File &a, const File &b) {
+	return a.name < b.name;
+}
+
+static bool safeName(const std::string &name) {
+	if (name.empty() || name[0] == '/') return false;
+	size_t start = 0;
+	while (start <= name.size()) {
+		size_t end = name.find('/', start);
+		if (end == std::string::npos) end = name.size();
+		std::string part = name.substr(start, end - start);
+		if (part.empty() || part == "." || part == "..") return false;
+		start = end + 1;
+	}
+	return true;
+}
+
+/**
+ * Looks up seg0addr and adds it to files if it is a file we export
+ */
+static void addFile(SDHashClass *sdh, SDHAddress seg0addr, std::vector<File> &out) {
+	FileInfo finfo;
+	char name[24];
+	if (sdh->statSeg0(seg0addr, &finfo) != SDH_OK) return;
+	if (sdh->readFilename(seg0addr, name) != SDH_OK) return;
+
+	File f;
+	f.seg0addr = seg0addr;
+	f.fh = finfo.hash;
+	f.name = name;
+	f.ready = f.large = false;
+	f.err = SDH_OK;
+	if (!hidden && isHidden(f.name)) return;
+	out.push_back(f);
+}
+
+static void scanWorker(SDHashClass *sdh, SDHAddress start, SDHAddress end, std::vector<File> *out) {
+	for (SDHAddress addr = start; addr < end; ++addr) {
+		const uint8_t *block = sdh->card()->block(addr);
+		if (block && block[0] == kSDHashSegment0) addFile(sdh, addr, *out);
+	}
+}
+
+static bool scan(unsigned threads) {
+	const HashInfo *info = instances[0]->hashInfo();
+	SDHAddress first = info->base + 1;
+	SDHAddress end = info->base + info->buckets;
+	SDHBucketCount per = (end - first + threads - 1) / threads;
+
+	std::vector<std::vector<File> > found(threads);
+	std::vector<std::thread> pool;
+	for (unsigned idx = 0; idx < threads; ++idx) {
+		SDHAddress from = first + std::min((SDHBucketCount)(end - first), per * idx);
+		SDHAddress to = first + std::min((SDHBucketCount)(end - first), per * (idx + 1));
+		pool.push_back(std::thread(scanWorker, instances[idx], from, to, &found[idx]));
+	}
+	for (unsigned idx = 0; idx < threads; ++idx) {
+		pool[idx].join();
+		files.insert(files.end(), found[idx].begin(), found[idx].end());
+	}
+	return true;
+}
+
+static bool logSink(void *ctx, const uint8_t *data, uint8_t len) {
+	std::vector<uint8_t> *log = (std::vector<uint8_t>*)ctx;
+	log->insert(log->end(), data, data + len);
+	return true;
+}
+
+static bool replayLog() {
+	SDHashClass *sdh = instances[0];
+	std::vector<uint8_t> log;
+	FileInfo finfo;
+	uint32_t len = 0xffffffff;
+	uint8_t ret = sdh->statFile(sdh->logFilehandle(), &finfo, NULL);
+	if (ret == SDH_OK) ret = sdh->readFileTo(sdh->logFilehandle(), 0, &len, logSink, &log);
+	if (ret != SDH_OK) {
+		fprintf(stderr, "reading __LOG failed, error=%d\n", ret);
+		return false;
+	}
+
+	// every entry is appended on its own, so gets its own segment. The
+	// entry is the segment 0 address followed by the type, which is as
+	// wide as the firmware's enums.
+	size_t entries = finfo.segments_count - 1;
+	size_t width = entries ? log.size() / entries : 0;
+	if (entries && (width <= sizeof(SDHAddress) || width * entries != log.size())) {
+		fprintf(stderr, "__LOG is malformed\n");
+		return false;
+	}
+
+	std::vector<SDHAddress> order;
+	std::set<SDHAddress> live;
+	bool consistent = true;
+	for (size_t ofs = 0; ofs < log.size(); ofs += width) {
+		SDHAddress addr;
+		memcpy(&addr, &log[ofs], sizeof addr);
+		if (log[ofs + sizeof addr] == kSDHashLogCreate) {
+			if (live.insert(addr).second) order.push_back(addr);
+			else consistent = false;
+		} else if (log[ofs + sizeof addr] == kSDHashLogDelete) live.erase(addr);
+	}
+	// a long __LOG in a full table can read back wrong, see the Readme
+	if (!consistent) fprintf(stderr, "__LOG is inconsistent, files may be missing, try without -l\n");
+
+	for (size_t idx = 0; idx < order.size(); ++idx) {
+		if (live.count(order[idx])) addFile(sdh, order[idx], files);
+	}
+	return true;
+}
+
+struct FileSink {
+	Output *out;
+	uint64_t size;
+	std::vector<uint8_t> *buf;
+};
+
+static bool fileSink(void *ctx, const uint8_t *data, uint8_t len) {
+	FileSink *sink = (FileSink*)ctx;
+	sink->size += len;
+	if (sink->out) sink->out->write(data, len);
+	if (sink->buf) {
+		if (sink->buf->size() + len > MAX_BUFFERED) return false;
+		sink->buf->insert(sink->buf->end(), data, data + len);
+	}
+	return true;
+}
+
+static uint8_t readFile(SDHashClass *sdh, File &f, FileSink *sink) {
+	uint32_t len = 0xffffffff;
+	return sdh->readFileTo(f.fh, 0, &len, fileSink, sink);
+}
+
+static bool makeParents(const std::string &path) {
+	for (size_t idx = 1; idx < path.size(); ++idx) {
+		if (path[idx] != '/') continue;
+		if (mkdir(path.substr(0, idx).c_str(), 0755) && errno != EEXIST) return false;
+	}
+	return true;
+}
+
+static void dirWorker(SDHashClass *sdh) {
+	for (;;) {
+		size_t idx;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (nextFile >= files.size()) return;
+			idx = nextFile++;
+		}
+
+		File &f = files[idx];
+		if (!safeName(f.name)) {
+			fprintf(stderr, "%s: skipped, not a safe path\n", f.name.c_str());
+			continue;
+		}
+
+		std::string path = std::string(outDir) + "/" + f.name;
+		int fd = -1;
+		if (makeParents(path)) fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(path.c_str());
+			f.err = SDH_ERR_INVALID_ARGUMENT;
+			continue;
+		}
+
+		bool failed;
+		{
+			Output out(fd);
+			FileSink sink = {&out, 0, NULL};
+			f.err = readFile(sdh, f, &sink);
+			out.flush();
+			failed = out.failed();
+		}
+		if (close(fd) || failed) {
+			perror(path.c_str());
+			f.err = SDH_ERR_INVALID_ARGUMENT;
+		}
+		if (f.err != SDH_OK) fprintf(stderr, "%s: error=%d\n", f.name.c_str(), f.err);
+	}
+}
+
+static void tarWorker(SDHashClass *sdh) {
+	for (;;) {
+		size_t idx;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (nextFile < files.size() && nextFile >= written + READ_AHEAD) spaceCond.wait(guard);
+			if (nextFile >= files.size()) return;
+			idx = nextFile++;
+		}
+
+		File &f = files[idx];
+		std::vector<uint8_t> data;
+		FileSink sink = {NULL, 0, &data};
+		uint8_t ret = readFile(sdh, f, &sink);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (ret == SDH_ERR_ABORTED) f.large = true;
+		else {
+			f.err = ret;
+			f.data.swap(data);
+		}
+		f.ready = true;
+		readyCond.notify_all();
+	}
+}
+
+static void tarNumber(char *field, size_t width, uint64_t value) {
+	if (value < (1ULL << (3 * (width - 1)))) {
+		snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+	} else {
+		// GNU base-256 for sizes octal can't hold
+		memset(field, 0, width);
+		field[0] = (char)0x80;
+		for (size_t idx = width - 1; idx > 0 && value; --idx, value >>= 8) field[idx] = value & 0xff;
+	}
+}
+
+static void tarHeader(Output &out, const std::string &name, uint64_t size) {
+	char h[TAR_BLOCK];
+	memset(h, 0, sizeof h);
+	strncpy(h, name.c_str(), 100);
+	tarNumber(h + 100, 8, 0644);
+	tarNumber(h + 108, 8, 0);
+	tarNumber(h + 116, 8, 0);
+	tarNumber(h + 124, 12, size);
+	tarNumber(h + 136, 12, 0);
+	memset(h + 148, ' ', 8);
+	h[156] = '0';
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+
+	unsigned sum = 0;
+	for (size_t idx = 0; idx < sizeof h; ++idx) sum += (uint8_t)h[idx];
+	snprintf(h + 148, 8, "%06o", sum);
+	out.write((uint8_t*)h, sizeof h);
+}
+
+static void tarPadding(Output &out, uint64_t size) {
+	static const uint8_t zeros[TAR_BLOCK] = {0};
+	if (size % TAR_BLOCK) out.write(zeros, TAR_BLOCK - size % TAR_BLOCK);
+}
+
+static bool writeTar(int fd, unsigned threads) {
+	std::vector<std::thread> pool;
+	for (unsigned idx = 0; idx < threads; ++idx) pool.push_back(std::thread(tarWorker, instances[idx]));
+
+	Output out(fd);
+	bool ok = true;
+	for (size_t idx = 0; idx < files.size(); ++idx) {
+		File &f = files[idx];
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (!f.ready) readyCond.wait(guard);
+		}
+
+		if (f.large) {
+			// one pass for the size, which goes first, then one for the data
+			FileSink count = {NULL, 0, NULL};
+			f.err = readFile(instances[threads], f, &count);
+			if (f.err == SDH_OK) {
+				tarHeader(out, f.name, count.size);
+				FileSink sink = {&out, 0, NULL};
+				f.err = readFile(instances[threads], f, &sink);
+				if (f.err == SDH_OK && sink.size != count.size) f.err = SDH_ERR_CARD;
+				tarPadding(out, sink.size);
+			}
+		} else if (f.err == SDH_OK) {
+			tarHeader(out, f.name, f.data.size());
+			if (!f.data.empty()) out.write(&f.data[0], f.data.size());
+			tarPadding(out, f.data.size());
+		}
+
+		if (f.err != SDH_OK) {
+			fprintf(stderr, "%s: error=%d\n", f.name.c_str(), f.err);
+			// a half written member can't be recovered from
+			if (f.large) ok = false;
+		}
+		std::vector<uint8_t>().swap(f.data);
+
+		std::lock_guard<std::mutex> guard(lock);
+		written = idx + 1;
+		spaceCond.notify_all();
+		if (!ok) {
+			nextFile = files.size();
+			break;
+		}
+	}
+
+	for (size_t idx = 0; idx < pool.size(); ++idx) pool[idx].join();
+
+	static const uint8_t end[2 * TAR_BLOCK] = {0};
+	out.write(end, sizeof end);
+	out.flush();
+	return ok && !out.failed();
+}
+
+static void usage() {
+	fprintf(stderr, "usage: sdhexport [-p partition] [-j threads] [-l] [-a] [-d dir | -t tar] image\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	uint8_t partition = 0;
+	unsigned threads = std::thread::hardware_concurrency();
+	bool useLog = false;
+	const char *tarPath = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:j:lad:t:")) != -1) {
+		switch (opt) {
+			case 'p': partition = strtoul(optarg, NULL, 0); break;
+			case 'j': threads = strtoul(optarg, NULL, 0); break;
+			case 'l': useLog = true; break;
+			case 'a': hidden = true; break;
+			case 'd': outDir = optarg; break;
+			case 't': tarPath = optarg; break;
+			default: usage();
+		}
+	}
+	if (argc - optind != 1 || (outDir && tarPath)) usage();
+	if (!threads) threads = 1;
+
+	// one instance per worker, plus one for the tar writer
+	for (unsigned idx = 0; idx <= threads; ++idx) instances.push_back(new SDHashClass(partition));
+	SdMapCard *card = instances[0]->card();
+	if (!card->open(argv[optind])) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	// begin() formats anything that isn't a table, so check first
+	const uint8_t *block0 = card->block(0);
+	if (memcmp(block0, kTableMagic, sizeof kTableMagic) && memcmp(block0, kPartitionMagic, sizeof kPartitionMagic)) {
+		fprintf(stderr, "%s: not an SDHash image\n", argv[optind]);
+		return 1;
+	}
+
+	// begin() one at a time, as it might create __LOG in our copy
+	for (unsigned idx = 0; idx <= threads; ++idx) {
+		if (idx) instances[idx]->card()->share(*card);
+		uint8_t ret = instances[idx]->begin();
+		if (ret != SDH_OK) {
+			fprintf(stderr, "begin failed, error=%d\n", ret);
+			return 1;
+		}
+	}
+
+	if (useLog) {
+		if (!replayLog()) return 1;
+	} else scan(threads);
+	std::sort(files.begin(), files.end(), byName);
+
+	bool ok;
+	if (outDir) {
+		if (mkdir(outDir, 0755) && errno != EEXIST) {
+			perror(outDir);
+			return 1;
+		}
+		std::vector<std::thread> pool;
+		for (unsigned idx = 0; idx < threads; ++idx) pool.push_back(std::thread(dirWorker, instances[idx]));
+		for (unsigned idx = 0; idx < threads; ++idx) pool[idx].join();
+
+		ok = true;
+		for (size_t idx = 0; idx < files.size(); ++idx) ok = ok && files[idx].err == SDH_OK;
+	} else {
+		int fd = tarPath ? open(tarPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : 1;
+		if (fd < 0) {
+			perror(tarPath);
+			return 1;
+		}
+		ok = writeTar(fd, threads);
+		for (size_t idx = 0; idx < files.size(); ++idx) ok = ok && files[idx].err == SDH_OK;
+		if (tarPath && close(fd)) ok = false;
+	}
+
+	fprintf(stderr, "%lu files exported\n", (unsigned long)files.size());
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * Checks the segments of an SDHash card image:
+ *
+ *	sdhfsck [-p partition] [-j threads] [-v] image
+ *
+ * Every block of the table is looked at once. Segments written with
+ * SDHASH_SEGMENT_CHECKSUMS have their CRC32C checked, and segments whose
+ * segment 0 is gone are counted as orphans. With -v the address of every
+ * bad or orphaned segment is listed. The image is mapped into memory and
+ * split between threads, so the check runs at about the speed the image
+ * can be read. Exits with 1 if a checksum doesn't match.
+ *
+ * Table options like SDHASH_WIDE_HANDLES have to match the firmware's.
+ * Build with e.g.
+ *
+ *	g++ -O2 -msse4.2 -pthread -I.. -DSDHASH_BLOCK_DEVICE=SdMapCard \
+ *		-DSDHASH_BLOCK_DEVICE_HEADER='"utility/SdMapCard.h"' \
+ *		-o sdhfsck sdhfsck.cpp ../SDHash.cpp
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "SDHash.h"
+#include "utility/SDHashCrc.h"
+
+static const uint8_t kTableMagic[5] = {0xae, 'h', 'a', 's', 'h'};
+static const uint8_t kPartitionMagic[5] = {0xae, 'h', 'p', 'r', 't'};
+
+// type, segment 0 address and the length and tag field
+#define META_SIZE (1 + sizeof(SDHAddress) + sizeof(SDHDataSize))
+#define LENGTH_MASK 0x01ff
+#define TAG_SHIFT 9
+// tagged segments follow it with their segment number
+#define NUMBER_SIZE sizeof(SDHSegmentCount)
+#define CRC_SIZE sizeof(uint32_t)
+
+struct Counts {
+	SDHBucketCount segments;
+	SDHBucketCount checked;
+	SDHBucketCount bad;
+	SDHBucketCount orphans;
+	std::vector<SDHAddress> badAddrs;
+	std::vector<SDHAddress> orphanAddrs;
+};
+
+static const SdMapCard *card;
+
+static bool isSegment0(SDHAddress addr) {
+	const uint8_t *block = card->block(addr);
+	return block && block[0] == kSDHashSegment0;
+}
+
+static bool checkSegment(const uint8_t *block) {
+	SDHDataSize field;
+	memcpy(&field, block + 1 + sizeof(SDHAddress), sizeof field);
+	uint16_t len = field & LENGTH_MASK;
+	uint16_t start = META_SIZE + (field >> TAG_SHIFT?NUMBER_SIZE:0);
+	if (start + len + CRC_SIZE > SDHASH_BLOCK_SIZE) return false;
+
+	uint32_t stored;
+	memcpy(&stored, block + start + len, sizeof stored);
+	return sdhCrc32c(0, block, start + len) == stored;
+}
+
+static void scanWorker(SDHAddress start, SDHAddress end, Counts *counts) {
+	for (SDHAddress addr = start; addr < end; ++addr) {
+		const uint8_t *block = card->block(addr);
+		if (!block || (block[0] != kSDHashSegment && block[0] != kSDHashSegmentChecked)) continue;
+
+		counts->segments++;
+		if (block[0] == kSDHashSegmentChecked) {
+			counts->checked++;
+			if (!checkSegment(block)) {
+				counts->bad++;
+				counts->badAddrs.push_back(addr);
+			}
+		}
+
+		SDHAddress seg0addr;
+		memcpy(&seg0addr, block + 1, sizeof seg0addr);
+		if (!isSegment0(seg0addr)) {
+			counts->orphans++;
+			counts->orphanAddrs.push_back(addr);
+		}
+	}
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: sdhfsck [-p partition] [-j threads] [-v] image\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	uint8_t partition = 0;
+	unsigned threads = std::thread::hardware_concurrency();
+	bool verbose = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:j:v")) != -1) {
+		switch (opt) {
+			case 'p': partition = strtoul(optarg, NULL, 0); break;
+			case 'j': threads = strtoul(optarg, NULL, 0); break;
+			case 'v': verbose = true; break;
+			default: usage();
+		}
+	}
+	if (argc - optind != 1) usage();
+	if (!threads) threads = 1;
+
+	SDHashClass *sdh = new SDHashClass(partition);
+	if (!sdh->card()->open(argv[optind])) {
+		perror(argv[optind]);
+		return 1;
+	}
+	card = sdh->card();
+
+	// begin() formats anything that isn't a table, so check first
+	const uint8_t *block0 = card->block(0);
+	if (memcmp(block0, kTableMagic, sizeof kTableMagic) && memcmp(block0, kPartitionMagic, sizeof kPartitionMagic)) {
+		fprintf(stderr, "%s: not an SDHash image\n", argv[optind]);
+		return 1;
+	}
+	uint8_t ret = sdh->begin();
+	if (ret != SDH_OK) {
+		fprintf(stderr, "begin failed, error=%d\n", ret);
+		return 1;
+	}
+
+	const HashInfo *info = sdh->hashInfo();
+	SDHAddress first = info->base + 1;
+	SDHAddress end = info->base + info->buckets;
+	SDHBucketCount per = (end - first + threads - 1) / threads;
+
+	double started = now();
+	std::vector<Counts> counts(threads);
+	std::vector<std::thread> pool;
+	for (unsigned idx = 0; idx < threads; ++idx) {
+		SDHAddress from = first + std::min((SDHBucketCount)(end - first), per * idx);
+		SDHAddress to = first + std::min((SDHBucketCount)(end - first), per * (idx + 1));
+		pool.push_back(std::thread(scanWorker, from, to, &counts[idx]));
+	}
+	Counts total = Counts();
+	for (unsigned idx = 0; idx < threads; ++idx) {
+		pool[idx].join();
+		total.segments += counts[idx].segments;
+		total.checked += counts[idx].checked;
+		total.bad += counts[idx].bad;
+		total.orphans += counts[idx].orphans;
+		if (!verbose) continue;
+		for (size_t k = 0; k < counts[idx].badAddrs.size(); ++k) printf("bad checksum at block %lu\n", (unsigned long)counts[idx].badAddrs[k]);
+		for (size_t k = 0; k < counts[idx].orphanAddrs.size(); ++k) printf("orphan at block %lu\n", (unsigned long)counts[idx].orphanAddrs[k]);
+	}
+	double secs = now() - started;
+
+	printf("%lu segments, %lu checked, %lu bad, %lu orphans\n", (unsigned long)total.segments,
+		(unsigned long)total.checked, (unsigned long)total.bad, (unsigned long)total.orphans);
+	fprintf(stderr, "%lu blocks in %.3fs, %.0f MB/s\n", (unsigned long)(end - first), secs,
+		secs > 0 ? (end - first) * (double)SDHASH_BLOCK_SIZE / secs / 1e6 : 0);
+	return total.bad ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * Builds an SDHash card image from a directory tree, ready to be dd'ed
+ * onto a card:
+ *
+ *	sdhimage [-b blocks] [-j threads] [-S bytes] dir image
+ *
+ * Every regular file below dir becomes a file named by its path relative
+ * to dir, which can be at most 22 characters long. Files are created by the
+ * library itself on an in-memory card, so placement follows exactly the
+ * same folding and probing rules as on the device, and __LOG gets its
+ * entries as usual. Stream files go first while the table still has long
+ * free runs, then the rest in path order. Worker threads read and hash the files ahead
+ * of the insertion, and the image is written out in block order in one
+ * pass at the end.
+ *
+ * -b sets the size of the table in blocks. By default the table is sized
+ * to be half full. Files of at least -S bytes, and those too large for a
+ * hash chain, become stream files.
+ *
+ * Table options like NEW_TABLE_HASH and SDHASH_WIDE_HANDLES have to match
+ * the firmware's. Build with e.g.
+ *
+ *	g++ -O2 -pthread -I.. -DSDHASH_BLOCK_DEVICE=SdMemCard \
+ *		-DSDHASH_BLOCK_DEVICE_HEADER='"utility/SdMemCard.h"' \
+ *		-o sdhimage sdhimage.cpp ../SDHash.cpp
+ */
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SDHash.h"
+
+// createFile needs room for at least two padding bytes
+#define MAX_FILENAME_LENGTH 22
+// the least a segment holds, tagged segments keeping their number and
+// checked ones their CRC as well
+#ifdef SDHASH_SEGMENT_CHECKSUMS
+#define SEGMENT_DATA_SIZE (SDHASH_BLOCK_SIZE - 7 - 2 - 4)
+#else
+#define SEGMENT_DATA_SIZE (SDHASH_BLOCK_SIZE - 7 - 2)
+#endif
+#define MAX_SEGMENTS 0xffffUL
+// files read ahead of the insertion at most
+#define READ_AHEAD 64
+
+struct Entry {
+	std::string name;
+	std::string path;
+	uint64_t size;
+	bool stream;
+
+	// filled in by the workers
+	std::vector<uint8_t> data;
+	SDHFilehandle fh;
+	bool ready;
+	bool failed;
+};
+
+static std::vector<Entry> entries;
+static std::string root;
+
+static std::mutex lock;
+static std::condition_variable readyCond, spaceCond;
+static size_t nextToRead, inserted;
+
+static int collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+
+	Entry e;
+	e.path = path;
+	e.name = path + root.size() + 1;
+	e.size = st->st_size;
+	e.ready = e.failed = false;
+	entries.push_back(e);
+	return 0;
+}
+
+static bool byKindAndName(const Entry &a, const Entry &b) {
+	if (a.stream != b.stream) return a.stream;
+	return a.name < b.name;
+}
+
+static bool readAll(const char *path, std::vector<uint8_t> &data) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = read(fd, &data[done], data.size() - done);
+		if (n <= 0) break;
+		done += n;
+	}
+	close(fd);
+	return done == data.size();
+}
+
+static void worker() {
+	for (;;) {
+		size_t idx;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (nextToRead < entries.size() && nextToRead >= inserted + READ_AHEAD) spaceCond.wait(guard);
+			if (nextToRead >= entries.size()) return;
+			idx = nextToRead++;
+		}
+
+		Entry &e = entries[idx];
+		std::vector<uint8_t> data(e.size);
+		bool ok = readAll(e.path.c_str(), data);
+		SDHFilehandle fh = SDHash.filehandle((uint8_t*)e.name.data(), e.name.size());
+
+		std::lock_guard<std::mutex> guard(lock);
+		e.data.swap(data);
+		e.fh = fh;
+		e.failed = !ok;
+		e.ready = true;
+		readyCond.notify_all();
+	}
+}
+
+static uint32_t segmentsFor(uint64_t size) {
+	return (size + SEGMENT_DATA_SIZE - 1) / SEGMENT_DATA_SIZE;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: sdhimage [-b blocks] [-j threads] [-S bytes] dir image\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	uint32_t blocks = 0;
+	unsigned threads = std::thread::hardware_concurrency();
+	uint64_t streamSize = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:j:S:")) != -1) {
+		switch (opt) {
+			case 'b': blocks = strtoul(optarg, NULL, 0); break;
+			case 'j': threads = strtoul(optarg, NULL, 0); break;
+			case 'S': streamSize = strtoull(optarg, NULL, 0); break;
+			default: usage();
+		}
+	}
+	if (argc - optind != 2) usage();
+	if (!threads) threads = 1;
+
+	root = argv[optind];
+	while (root.size() > 1 && root[root.size() - 1] == '/') root.erase(root.size() - 1);
+	if (nftw(root.c_str(), collect, 32, FTW_PHYS)) {
+		perror(root.c_str());
+		return 1;
+	}
+
+	uint64_t needed = 2;
+	for (size_t idx = 0; idx < entries.size(); ++idx) {
+		Entry &e = entries[idx];
+		if (e.name.size() > MAX_FILENAME_LENGTH) {
+			fprintf(stderr, "%s: name longer than %d characters\n", e.name.c_str(), MAX_FILENAME_LENGTH);
+			return 1;
+		}
+		needed += 1 + segmentsFor(e.size);
+		e.stream = (streamSize && e.size >= streamSize) || segmentsFor(e.size) + 1 > MAX_SEGMENTS;
+	}
+	std::sort(entries.begin(), entries.end(), byKindAndName);
+	// every entry __LOG gets is appended on its own, taking a segment
+	needed += entries.size() + 1;
+	if (!blocks) {
+		if (needed * 2 > 0xffffffffULL) {
+			fprintf(stderr, "too much data for one table\n");
+			return 1;
+		}
+		blocks = needed * 2;
+	}
+
+	SDHash.card()->create(blocks);
+	uint8_t ret = SDHash.begin();
+	if (ret != SDH_OK) {
+		fprintf(stderr, "begin failed, error=%d\n", ret);
+		return 1;
+	}
+
+	std::vector<std::thread> pool;
+	for (unsigned idx = 0; idx < threads; ++idx) pool.push_back(std::thread(worker));
+
+	uint64_t bytes = 0;
+	for (size_t idx = 0; idx < entries.size() && ret == SDH_OK; ++idx) {
+		Entry &e = entries[idx];
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (!e.ready) readyCond.wait(guard);
+		}
+		if (e.failed) {
+			perror(e.path.c_str());
+			ret = SDH_ERR_INVALID_ARGUMENT;
+			break;
+		}
+
+		uint32_t segments = segmentsFor(e.size);
+		if (e.stream) {
+#ifdef STREAM_FILES_ENABLED
+			ret = SDHash.createStreamFile(e.fh, e.name.c_str(), segments ? segments : 1);
+#else
+			fprintf(stderr, "%s: too large, and stream files are disabled\n", e.name.c_str());
+			ret = SDH_ERR_DATA_OVERFLOW;
+#endif
+		} else ret = SDHash.createFile(e.fh, e.name.c_str());
+
+		if (ret == SDH_OK && e.size) ret = SDHash.appendFile32(e.fh, &e.data[0], e.size);
+		if (ret != SDH_OK) fprintf(stderr, "%s: error=%d sd=0x%x\n", e.name.c_str(), ret, SDHash.sdErrorCode());
+
+		bytes += e.size;
+		std::vector<uint8_t>().swap(e.data);
+
+		std::lock_guard<std::mutex> guard(lock);
+		inserted = idx + 1;
+		spaceCond.notify_all();
+	}
+
+	// let the workers run out of entries
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		inserted = entries.size();
+		nextToRead = entries.size();
+		spaceCond.notify_all();
+	}
+	for (size_t idx = 0; idx < pool.size(); ++idx) pool[idx].join();
+	if (ret != SDH_OK) return 1;
+
+	if (!SDHash.card()->save(argv[optind + 1])) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	printf("%lu files, %llu bytes, %lu of %lu blocks used\n",
+		(unsigned long)entries.size(), (unsigned long long)bytes,
+		(unsigned long)SDHash.card()->blocks().size(), (unsigned long)blocks);
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * Runs a fixed workload against a simulated card and prints how long each
+ * phase would take on a real one, to compare changes to the library in
+ * predicted card time rather than host time:
+ *
+ *	sdhsim [-b blocks] [-f files] [-a appends] [-s bytes] [-r rate] [-g permille] [-S seed] [-H heat.csv]
+ *
+ * -f files are created, then -a appends of -s bytes each are spread over
+ * them round robin, every file is read back whole, and all of them are
+ * deleted. -r is the setSckRate rate, 0 being the fastest, and -g the
+ * chance of a garbage collection stall per block written. The table has
+ * -b blocks. The most written blocks are summed up at the end, -H saves
+ * the writes of every block to a file. Build with e.g.
+ *
+ *	g++ -O2 -I.. -DSDHASH_BLOCK_DEVICE=SdSimCard \
+ *		-DSDHASH_BLOCK_DEVICE_HEADER='"utility/SdSimCard.h"' \
+ *		-o sdhsim sdhsim.cpp ../SDHash.cpp
+ *
+ * along with whatever SDHashConfig.h options are to be compared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "SDHash.h"
+
+static unsigned long files = 16, appends = 1024, size = 64;
+
+static uint64_t phaseStart;
+static SdSimStats statsStart;
+
+static void startPhase() {
+	phaseStart = SDHash.card()->elapsedMicros();
+	statsStart = *SDHash.card()->stats();
+}
+
+static void endPhase(const char *name, unsigned long ops) {
+	uint64_t us = SDHash.card()->elapsedMicros() - phaseStart;
+	const SdSimStats *stats = SDHash.card()->stats();
+	printf("%-8s %7lu ops %10.1f ms %9.1f us/op %8lu cmds %8lu blocks read %8lu written %5lu stalls\n",
+		name, ops, us / 1000.0, ops?(double)us / ops:0.0,
+		(unsigned long)(stats->commands - statsStart.commands),
+		(unsigned long)(stats->blocksRead - statsStart.blocksRead),
+		(unsigned long)(stats->blocksWritten - statsStart.blocksWritten),
+		(unsigned long)(stats->gcStalls - statsStart.gcStalls));
+}
+
+static void check(uint8_t ret, const char *what, unsigned long idx) {
+	if (ret == SDH_OK) return;
+	fprintf(stderr, "%s %lu failed with %d\n", what, idx, ret);
+	exit(1);
+}
+
+static void usage() {
+	fprintf(stderr, "usage: sdhsim [-b blocks] [-f files] [-a appends] [-s bytes] [-r rate] [-g permille] [-S seed] [-H heat.csv]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	unsigned long blocks = 65536;
+	int rate = 0;
+	const char *heatPath = NULL;
+	int opt;
+	SdSimCard *card = SDHash.card();
+	while ((opt = getopt(argc, argv, "b:f:a:s:r:g:S:H:")) != -1) {
+		switch (opt) {
+			case 'b': blocks = strtoul(optarg, NULL, 0); break;
+			case 'f': files = strtoul(optarg, NULL, 0); break;
+			case 'a': appends = strtoul(optarg, NULL, 0); break;
+			case 's': size = strtoul(optarg, NULL, 0); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'g': card->timing.gcPermille = atoi(optarg); break;
+			case 'S': card->seed(strtoul(optarg, NULL, 0)); break;
+			case 'H': heatPath = optarg; break;
+			default: usage();
+		}
+	}
+	if (optind != argc || !files || !size || size > 0xffff) usage();
+
+	card->create(blocks);
+	if (SDHash.begin() != SDH_OK || !card->setSckRate(rate)) {
+		fprintf(stderr, "can't set up the table\n");
+		return 1;
+	}
+
+	std::vector<SDHFilehandle> fhs(files);
+	std::vector<uint8_t> data(size > 4096?size:4096);
+	for (size_t idx = 0; idx < data.size(); ++idx) data[idx] = idx * 7;
+
+	card->resetClock();
+
+	startPhase();
+	for (unsigned long idx = 0; idx < files; ++idx) {
+		char name[32];
+		snprintf(name, sizeof name, "file%lu", idx);
+		fhs[idx] = SDHash.filehandle(name);
+		check(SDHash.createFile(fhs[idx], name), "create", idx);
+	}
+	endPhase("create", files);
+
+	startPhase();
+	for (unsigned long idx = 0; idx < appends; ++idx) {
+		check(SDHash.appendFile(fhs[idx % files], &data[0], size), "append", idx);
+	}
+	endPhase("append", appends);
+
+	startPhase();
+	for (unsigned long idx = 0; idx < files; ++idx) {
+		uint32_t offset = 0, left;
+		do {
+			left = data.size();
+			check(SDHash.readFile32(fhs[idx], offset, &data[0], &left), "read", idx);
+			offset += data.size() - left;
+		} while (!left);
+	}
+	endPhase("read", files);
+
+	startPhase();
+	for (unsigned long idx = 0; idx < files; ++idx) {
+		check(SDHash.deleteFile(fhs[idx]), "delete", idx);
+	}
+	endPhase("delete", files);
+
+	printf("total    %10.1f ms simulated, %lu erase block switches, %llu SPI bytes\n",
+		card->elapsedMicros() / 1000.0,
+		(unsigned long)card->stats()->eraseBlockSwitches,
+		(unsigned long long)card->stats()->spiBytes);
+
+	const std::map<uint32_t, uint32_t> &heat = card->writeHeat();
+	uint32_t hottest = 0, hottestWrites = 0;
+	for (std::map<uint32_t, uint32_t>::const_iterator it = heat.begin(); it != heat.end(); ++it) {
+		if (it->second > hottestWrites) {
+			hottest = it->first;
+			hottestWrites = it->second;
+		}
+	}
+	printf("heat     %8lu blocks written, hottest block %lu written %lu times\n",
+		(unsigned long)heat.size(), (unsigned long)hottest, (unsigned long)hottestWrites);
+	if (heatPath && !card->saveHeat(heatPath)) {
+		fprintf(stderr, "can't write %s\n", heatPath);
+		return 1;
+	}
+	return 0;
+}
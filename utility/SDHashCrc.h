@@ -0,0 +1,172 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * CRC32C (Castagnoli) of segment data, see SDHASH_SEGMENT_CHECKSUMS. Like
+ * the hash functions this only depends on stdint, so host tools can check
+ * images with the same code the library uses.
+ *
+ * AVRs go a byte at a time through a table in flash. Host builds use the
+ * CRC32 instructions of SSE4.2 or ARMv8 when they have them, and slice-by-8
+ * otherwise, which are all a lot faster than reading the card.
+ */
+#ifndef SDHashCrc_h
+#define SDHashCrc_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(ARDUINO)
+#include <avr/pgmspace.h>
+#define SDH_CRC_PROGMEM PROGMEM
+#define SDH_CRC_TABLE(idx) pgm_read_dword(kSDHashCrc32cTable + (idx))
+#else
+#define SDH_CRC_PROGMEM
+#define SDH_CRC_TABLE(idx) kSDHashCrc32cTable[idx]
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#endif
+
+// the reflected polynomial 0x1edc6f41, byte by byte
+static const uint32_t kSDHashCrc32cTable[256] SDH_CRC_PROGMEM = {
+	0x00000000UL, 0xf26b8303UL, 0xe13b70f7UL, 0x1350f3f4UL,
+	0xc79a971fUL, 0x35f1141cUL, 0x26a1e7e8UL, 0xd4ca64ebUL,
+	0x8ad958cfUL, 0x78b2dbccUL, 0x6be22838UL, 0x9989ab3bUL,
+	0x4d43cfd0UL, 0xbf284cd3UL, 0xac78bf27UL, 0x5e133c24UL,
+	0x105ec76fUL, 0xe235446cUL, 0xf165b798UL, 0x030e349bUL,
+	0xd7c45070UL, 0x25afd373UL, 0x36ff2087UL, 0xc494a384UL,
+	0x9a879fa0UL, 0x68ec1ca3UL, 0x7bbcef57UL, 0x89d76c54UL,
+	0x5d1d08bfUL, 0xaf768bbcUL, 0xbc267848UL, 0x4e4dfb4bUL,
+	0x20bd8edeUL, 0xd2d60dddUL, 0xc186fe29UL, 0x33ed7d2aUL,
+	0xe72719c1UL, 0x154c9ac2UL, 0x061c6936UL, 0xf477ea35UL,
+	0xaa64d611UL, 0x580f5512UL, 0x4b5fa6e6UL, 0xb93425e5UL,
+	0x6dfe410eUL, 0x9f95c20dUL, 0x8cc531f9UL, 0x7eaeb2faUL,
+	0x30e349b1UL, 0xc288cab2UL, 0xd1d83946UL, 0x23b3ba45UL,
+	0xf779deaeUL, 0x05125dadUL, 0x1642ae59UL, 0xe4292d5aUL,
+	0xba3a117eUL, 0x4851927dUL, 0x5b016189UL, 0xa96ae28aUL,
+	0x7da08661UL, 0x8fcb0562UL, 0x9c9bf696UL, 0x6ef07595UL,
+	0x417b1dbcUL, 0xb3109ebfUL, 0xa0406d4bUL, 0x522bee48UL,
+	0x86e18aa3UL, 0x748a09a0UL, 0x67dafa54UL, 0x95b17957UL,
+	0xcba24573UL, 0x39c9c670UL, 0x2a993584UL, 0xd8f2b687UL,
+	0x0c38d26cUL, 0xfe53516fUL, 0xed03a29bUL, 0x1f682198UL,
+	0x5125dad3UL, 0xa34e59d0UL, 0xb01eaa24UL, 0x42752927UL,
+	0x96bf4dccUL, 0x64d4cecfUL, 0x77843d3bUL, 0x85efbe38UL,
+	0xdbfc821cUL, 0x2997011fUL, 0x3ac7f2ebUL, 0xc8ac71e8UL,
+	0x1c661503UL, 0xee0d9600UL, 0xfd5d65f4UL, 0x0f36e6f7UL,
+	0x61c69362UL, 0x93ad1061UL, 0x80fde395UL, 0x72966096UL,
+	0xa65c047dUL, 0x5437877eUL, 0x4767748aUL, 0xb50cf789UL,
+	0xeb1fcbadUL, 0x197448aeUL, 0x0a24bb5aUL, 0xf84f3859UL,
+	0x2c855cb2UL, 0xdeeedfb1UL, 0xcdbe2c45UL, 0x3fd5af46UL,
+	0x7198540dUL, 0x83f3d70eUL, 0x90a324faUL, 0x62c8a7f9UL,
+	0xb602c312UL, 0x44694011UL, 0x5739b3e5UL, 0xa55230e6UL,
+	0xfb410cc2UL, 0x092a8fc1UL, 0x1a7a7c35UL, 0xe811ff36UL,
+	0x3cdb9bddUL, 0xceb018deUL, 0xdde0eb2aUL, 0x2f8b6829UL,
+	0x82f63b78UL, 0x709db87bUL, 0x63cd4b8fUL, 0x91a6c88cUL,
+	0x456cac67UL, 0xb7072f64UL, 0xa457dc90UL, 0x563c5f93UL,
+	0x082f63b7UL, 0xfa44e0b4UL, 0xe9141340UL, 0x1b7f9043UL,
+	0xcfb5f4a8UL, 0x3dde77abUL, 0x2e8e845fUL, 0xdce5075cUL,
+	0x92a8fc17UL, 0x60c37f14UL, 0x73938ce0UL, 0x81f80fe3UL,
+	0x55326b08UL, 0xa759e80bUL, 0xb4091bffUL, 0x466298fcUL,
+	0x1871a4d8UL, 0xea1a27dbUL, 0xf94ad42fUL, 0x0b21572cUL,
+	0xdfeb33c7UL, 0x2d80b0c4UL, 0x3ed04330UL, 0xccbbc033UL,
+	0xa24bb5a6UL, 0x502036a5UL, 0x4370c551UL, 0xb11b4652UL,
+	0x65d122b9UL, 0x97baa1baUL, 0x84ea524eUL, 0x7681d14dUL,
+	0x2892ed69UL, 0xdaf96e6aUL, 0xc9a99d9eUL, 0x3bc21e9dUL,
+	0xef087a76UL, 0x1d63f975UL, 0x0e330a81UL, 0xfc588982UL,
+	0xb21572c9UL, 0x407ef1caUL, 0x532e023eUL, 0xa145813dUL,
+	0x758fe5d6UL, 0x87e466d5UL, 0x94b49521UL, 0x66df1622UL,
+	0x38cc2a06UL, 0xcaa7a905UL, 0xd9f75af1UL, 0x2b9cd9f2UL,
+	0xff56bd19UL, 0x0d3d3e1aUL, 0x1e6dcdeeUL, 0xec064eedUL,
+	0xc38d26c4UL, 0x31e6a5c7UL, 0x22b65633UL, 0xd0ddd530UL,
+	0x0417b1dbUL, 0xf67c32d8UL, 0xe52cc12cUL, 0x1747422fUL,
+	0x49547e0bUL, 0xbb3ffd08UL, 0xa86f0efcUL, 0x5a048dffUL,
+	0x8ecee914UL, 0x7ca56a17UL, 0x6ff599e3UL, 0x9d9e1ae0UL,
+	0xd3d3e1abUL, 0x21b862a8UL, 0x32e8915cUL, 0xc083125fUL,
+	0x144976b4UL, 0xe622f5b7UL, 0xf5720643UL, 0x07198540UL,
+	0x590ab964UL, 0xab613a67UL, 0xb831c993UL, 0x4a5a4a90UL,
+	0x9e902e7bUL, 0x6cfbad78UL, 0x7fab5e8cUL, 0x8dc0dd8fUL,
+	0xe330a81aUL, 0x115b2b19UL, 0x020bd8edUL, 0xf0605beeUL,
+	0x24aa3f05UL, 0xd6c1bc06UL, 0xc5914ff2UL, 0x37faccf1UL,
+	0x69e9f0d5UL, 0x9b8273d6UL, 0x88d28022UL, 0x7ab90321UL,
+	0xae7367caUL, 0x5c18e4c9UL, 0x4f48173dUL, 0xbd23943eUL,
+	0xf36e6f75UL, 0x0105ec76UL, 0x12551f82UL, 0xe03e9c81UL,
+	0x34f4f86aUL, 0xc69f7b69UL, 0xd5cf889dUL, 0x27a40b9eUL,
+	0x79b737baUL, 0x8bdcb4b9UL, 0x988c474dUL, 0x6ae7c44eUL,
+	0xbe2da0a5UL, 0x4c4623a6UL, 0x5f16d052UL, 0xad7d5351UL,
+};
+
+#if !defined(ARDUINO) && !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+// tables for the 7 bytes after the one kSDHashCrc32cTable takes care of,
+// built on first use
+struct SDHCrc32cSlices {
+	uint32_t table[7][256];
+
+	SDHCrc32cSlices() {
+		for (int idx = 0; idx < 256; ++idx) {
+			uint32_t crc = kSDHashCrc32cTable[idx];
+			for (int slice = 0; slice < 7; ++slice) {
+				crc = (crc >> 8) ^ kSDHashCrc32cTable[crc & 0xff];
+				table[slice][idx] = crc;
+			}
+		}
+	}
+};
+#endif
+
+/**
+ * Continues the CRC32C crc of earlier data with len bytes of buf. Start
+ * with 0, e.g. sdhCrc32c(0, "123456789", 9) is 0xe3069283.
+ */
+static inline uint32_t sdhCrc32c(uint32_t crc, const uint8_t *buf, size_t len) {
+	crc = ~crc;
+#if !defined(ARDUINO) && (defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32))
+	for (; len >= 8; len -= 8, buf += 8) {
+		uint64_t word;
+		memcpy(&word, buf, sizeof word);
+#if defined(__SSE4_2__)
+		crc = (uint32_t)_mm_crc32_u64(crc, word);
+#else
+		crc = __crc32cd(crc, word);
+#endif
+	}
+#elif !defined(ARDUINO)
+	static const SDHCrc32cSlices slices;
+	const uint32_t (*t)[256] = slices.table;
+	for (; len >= 8; len -= 8, buf += 8) {
+		// bytes are assembled one by one, so this doesn't depend on
+		// byte order or alignment
+		uint32_t lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+		crc = t[6][lo & 0xff] ^ t[5][(lo >> 8) & 0xff] ^ t[4][(lo >> 16) & 0xff] ^ t[3][lo >> 24] ^
+			t[2][buf[4]] ^ t[1][buf[5]] ^ t[0][buf[6]] ^ kSDHashCrc32cTable[buf[7]];
+	}
+#endif
+	while (len--) crc = (crc >> 8) ^ SDH_CRC_TABLE((crc ^ *buf++) & 0xff);
+	return ~crc;
+}
+
+#undef SDH_CRC_TABLE
+#undef SDH_CRC_PROGMEM
+
+#endif
@@ -0,0 +1,212 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * Key hash functions. These only depend on stdint so host tools can
+ * share them with the library.
+ *
+ * Which function a table uses is recorded in its header, see Readme.md.
+ */
+#ifndef SDHashFunc_h
+#define SDHashFunc_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if !defined(ARDUINO) && (defined(__AVX2__) || defined(__SSE4_1__))
+#include <immintrin.h>
+#endif
+
+typedef enum {
+	// v1 tables, bytewise FNV-1a
+	kSDHashFNV1a = 0x00,
+	// murmur3 for filenames, its 32 bit finalizer for segment keys
+	kSDHashMurmur3 = 0x01,
+} SDHHashFunction;
+
+#define kSDHashFNVOffsetBias 2166136261UL
+#define kSDHashFNVPrime 16777619UL
+
+// added before finalising segment keys, otherwise a key of 0
+// would be a fixed point of the chain
+#define kSDHashMurmur3IncConstant 0x9e3779b9UL
+
+// seed of the high half of 64 bit filehandles, so it is independent of
+// the low half even for Murmur3 tables
+#define kSDHashWideHandleSeed 0x5bd1e995UL
+
+/**
+ * FNV-1a (32) with hval set to the offset bias when 0, so that buffers of
+ * 0s don't hash to 0.
+ */
+static inline uint32_t sdhFnv(const uint8_t *buf, size_t len, uint32_t hval) {
+	const uint8_t *end = buf+len;
+	if (!hval) hval = kSDHashFNVOffsetBias;
+	for(;buf < end;++buf) {
+		hval ^= (uint32_t)*buf;
+		hval += (hval<<1) + (hval<<4) + (hval<<7) + (hval<<8) + (hval<<24);
+	}
+	return hval;
+}
+
+static inline uint32_t sdhMurmur3Fmix(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6bUL;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35UL;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline uint32_t sdhRotl32(uint32_t x, uint8_t r) {
+	return (x << r) | (x >> (32 - r));
+}
+
+/**
+ * Murmur3 (x86, 32 bit). Words are assembled little endian byte by byte,
+ * so the result doesn't depend on the platform or on alignment.
+ */
+static inline uint32_t sdhMurmur3(const uint8_t *buf, size_t len, uint32_t seed) {
+	uint32_t h = seed;
+	size_t blocks = len / 4;
+
+	for (size_t idx = 0; idx < blocks; ++idx, buf += 4) {
+		uint32_t k = (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+			((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+
+		k *= 0xcc9e2d51UL;
+		k = sdhRotl32(k, 15);
+		k *= 0x1b873593UL;
+
+		h ^= k;
+		h = sdhRotl32(h, 13);
+		h = h*5 + 0xe6546b64UL;
+	}
+
+	uint32_t k = 0;
+	switch (len & 3) {
+		case 3: k ^= (uint32_t)buf[2] << 16;
+			// fall through
+		case 2: k ^= (uint32_t)buf[1] << 8;
+			// fall through
+		case 1: k ^= buf[0];
+			k *= 0xcc9e2d51UL;
+			k = sdhRotl32(k, 15);
+			k *= 0x1b873593UL;
+			h ^= k;
+	}
+
+	h ^= (uint32_t)len;
+	return sdhMurmur3Fmix(h);
+}
+
+/**
+ * Hashes a filename into a filehandle
+ */
+static inline uint32_t sdhHash(uint8_t func, const uint8_t *buf, size_t len) {
+	if (func == kSDHashMurmur3) return sdhMurmur3(buf, len, 0);
+	return sdhFnv(buf, len, 0);
+}
+
+/**
+ * Derives the next segment key from the current one
+ */
+static inline uint32_t sdhIncHash(uint8_t func, uint32_t hash) {
+	if (func == kSDHashMurmur3) return sdhMurmur3Fmix(hash + kSDHashMurmur3IncConstant);
+
+	// FNV-1a of the key's bytes, little endian, seeded with the key
+	uint8_t buf[4] = {(uint8_t)hash, (uint8_t)(hash >> 8), (uint8_t)(hash >> 16), (uint8_t)(hash >> 24)};
+	return sdhFnv(buf, sizeof buf, hash);
+}
+
+#ifndef ARDUINO
+/**
+ * Advances count keys by one step each, e.g. to walk many chains at once.
+ * Uses AVX2 or SSE4.1 when the host build has them.
+ */
+static inline void sdhIncHashMany(uint8_t func, uint32_t *hashes, size_t count) {
+	size_t idx = 0;
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	if (func == kSDHashMurmur3) {
+		const __m256i c = _mm256_set1_epi32((int)kSDHashMurmur3IncConstant);
+		const __m256i m1 = _mm256_set1_epi32((int)0x85ebca6bUL);
+		const __m256i m2 = _mm256_set1_epi32((int)0xc2b2ae35UL);
+		for (; idx + 8 <= count; idx += 8) {
+			__m256i h = _mm256_loadu_si256((const __m256i*)(hashes + idx));
+			h = _mm256_add_epi32(h, c);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+			h = _mm256_mullo_epi32(h, m1);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+			h = _mm256_mullo_epi32(h, m2);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+			_mm256_storeu_si256((__m256i*)(hashes + idx), h);
+		}
+	} else {
+		const __m256i bias = _mm256_set1_epi32((int)kSDHashFNVOffsetBias);
+		const __m256i prime = _mm256_set1_epi32((int)kSDHashFNVPrime);
+		const __m256i mask = _mm256_set1_epi32(0xff);
+		for (; idx + 8 <= count; idx += 8) {
+			__m256i key = _mm256_loadu_si256((const __m256i*)(hashes + idx));
+			__m256i h = _mm256_blendv_epi8(key, bias, _mm256_cmpeq_epi32(key, zero));
+			for (int shift = 0; shift < 32; shift += 8) {
+				h = _mm256_xor_si256(h, _mm256_and_si256(_mm256_srli_epi32(key, shift), mask));
+				h = _mm256_mullo_epi32(h, prime);
+			}
+			_mm256_storeu_si256((__m256i*)(hashes + idx), h);
+		}
+	}
+#elif defined(__SSE4_1__)
+	const __m128i zero = _mm_setzero_si128();
+	if (func == kSDHashMurmur3) {
+		const __m128i c = _mm_set1_epi32((int)kSDHashMurmur3IncConstant);
+		const __m128i m1 = _mm_set1_epi32((int)0x85ebca6bUL);
+		const __m128i m2 = _mm_set1_epi32((int)0xc2b2ae35UL);
+		for (; idx + 4 <= count; idx += 4) {
+			__m128i h = _mm_loadu_si128((const __m128i*)(hashes + idx));
+			h = _mm_add_epi32(h, c);
+			h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+			h = _mm_mullo_epi32(h, m1);
+			h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+			h = _mm_mullo_epi32(h, m2);
+			h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+			_mm_storeu_si128((__m128i*)(hashes + idx), h);
+		}
+	} else {
+		const __m128i bias = _mm_set1_epi32((int)kSDHashFNVOffsetBias);
+		const __m128i prime = _mm_set1_epi32((int)kSDHashFNVPrime);
+		const __m128i mask = _mm_set1_epi32(0xff);
+		for (; idx + 4 <= count; idx += 4) {
+			__m128i key = _mm_loadu_si128((const __m128i*)(hashes + idx));
+			__m128i h = _mm_blendv_epi8(key, bias, _mm_cmpeq_epi32(key, zero));
+			for (int shift = 0; shift < 32; shift += 8) {
+				h = _mm_xor_si128(h, _mm_and_si128(_mm_srli_epi32(key, shift), mask));
+				h = _mm_mullo_epi32(h, prime);
+			}
+			_mm_storeu_si128((__m128i*)(hashes + idx), h);
+		}
+	}
+#endif
+	for (; idx < count; ++idx) hashes[idx] = sdhIncHash(func, hashes[idx]);
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * The bits of WProgram.h SDHash uses, for building on the host.
+ */
+#ifndef SDHashHost_h
+#define SDHashHost_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#define HEX 16
+#define DEC 10
+
+template <class A, class B> static inline A min(A a, B b) {
+	return a < (A)b ? a : (A)b;
+}
+
+template <class A, class B> static inline A max(A a, B b) {
+	return a > (A)b ? a : (A)b;
+}
+
+static inline unsigned long micros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static inline unsigned long millis() {
+	return micros() / 1000;
+}
+
+#ifdef SERIAL_DEBUG
+#include <stdio.h>
+// prints debug output to stderr
+class SDHashHostSerial {
+	public:
+		void print(const char *str) { fputs(str, stderr); }
+		void print(unsigned long val, int base = DEC) { fprintf(stderr, base == HEX?"%lx":"%lu", val); }
+		void println(const char *str) { print(str); fputc('\n', stderr); }
+		void println(unsigned long val, int base = DEC) { print(val, base); fputc('\n', stderr); }
+};
+static SDHashHostSerial Serial;
+#endif
+
+#endif
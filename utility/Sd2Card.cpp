@@ -111,6 +111,9 @@ uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
   if (cmd == CMD8) crc = 0X87;  // correct crc for CMD8 with arg 0X1AA
   spiSend(crc);
 
+  // skip stuff byte for stop read
+  if (cmd == CMD12) spiRec();
+
   // wait for response
   for (uint8_t i = 0; ((status_ = spiRec()) & 0X80) && i != 0XFF; i++);
   return status_;
@@ -142,6 +145,44 @@ uint32_t Sd2Card::cardSize(void) {
   }
 }
 //------------------------------------------------------------------------------
+/**
+ * Determine the allocation unit of an SD flash memory card, the unit the
+ * card erases and garbage collects its flash in.
+ *
+ * \return The number of 512 byte data blocks in an allocation unit, or
+ *         zero if the card doesn't report one or an error occurs.
+ */
+uint32_t Sd2Card::allocationUnitSize(void) {
+  // AU_SIZE of the SD status, from 0XA on in MB
+  static const uint8_t kLargeUnitMB[] = {8, 12, 16, 24, 32, 64};
+  uint8_t status[64];
+  uint8_t au;
+  csd_t csd;
+
+  if (cardAcmd(ACMD13, 0)) {
+    error(SD_CARD_ERROR_ACMD13);
+    goto fail;
+  }
+  spiRec();  // second byte of the R2 response
+  if (!waitStartBlock()) goto fail;
+  for (uint8_t i = 0; i < sizeof(status); i++) status[i] = spiRec();
+  spiRec();  // get first crc byte
+  spiRec();  // get second crc byte
+  chipSelectHigh();
+
+  au = status[10] >> 4;
+  if (au >= 0XA) return (uint32_t)kLargeUnitMB[au - 0XA] << 11;
+  if (au) return 32UL << (au - 1);
+
+ fail:
+  chipSelectHigh();
+  // older cards only have the erase sector size in their CSD
+  if (readCSD(&csd) && csd.v1.csd_ver == 0) {
+    return ((csd.v1.sector_size_high << 1) | csd.v1.sector_size_low) + 1;
+  }
+  return 0;
+}
+//------------------------------------------------------------------------------
 void Sd2Card::chipSelectHigh(void) {
   digitalWrite(chipSelectPin_, HIGH);
 }
@@ -211,7 +252,7 @@ uint8_t Sd2Card::eraseSingleBlockEnable(void) {
  * can be determined by calling errorCode() and errorData().
  */
 uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
-  errorCode_ = inBlock_ = partialBlockRead_ = type_ = 0;
+  errorCode_ = inBlock_ = inMultiple_ = partialBlockRead_ = type_ = 0;
   chipSelectPin_ = chipSelectPin;
   // 16-bit init start time allows over a minute
   uint16_t t0 = (uint16_t)millis();
@@ -419,6 +460,113 @@ void Sd2Card::readEnd(void) {
   }
 }
 //------------------------------------------------------------------------------
+/** Start a read multiple blocks sequence.
+ *
+ * \param[in] blockNumber Address of first block in sequence.
+ *
+ * \note This function is used with readNext() and readStop()
+ * for optimized multiple block reads.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::readStart(uint32_t blockNumber) {
+  // use address if not SDHC card
+  if (type()!= SD_CARD_TYPE_SDHC) blockNumber <<= 9;
+  if (cardCommand(CMD18, blockNumber)) {
+    error(SD_CARD_ERROR_CMD18);
+    goto fail;
+  }
+  // no data token has been seen yet
+  offset_ = 512;
+  inMultiple_ = 1;
+  return true;
+
+ fail:
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
+/**
+ * Read the next count bytes of a read multiple blocks sequence. Reads
+ * can span block boundaries, in which case the crc of the finished block is
+ * skipped and the next block's start token is waited for.
+ *
+ * \param[out] dst Pointer to the location that will receive the data, or
+ * NULL to skip count bytes.
+ * \param[in] count Number of bytes to read
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::readNext(uint8_t* dst, uint16_t count) {
+  uint16_t n;
+  uint8_t b;
+  if (!inMultiple_) goto fail;
+
+  while (count) {
+    if (offset_ >= 512) {
+      if (!waitStartBlock()) goto fail;
+      offset_ = 0;
+    }
+    n = 512 - offset_;
+    if (n > count) n = count;
+
+#ifdef OPTIMIZE_HARDWARE_SPI
+    // start first spi transfer
+    SPDR = 0XFF;
+    for (uint16_t i = 1; i < n; i++) {
+      while (!(SPSR & (1 << SPIF)));
+      b = SPDR;
+      SPDR = 0XFF;
+      if (dst) *dst++ = b;
+    }
+    // wait for last byte
+    while (!(SPSR & (1 << SPIF)));
+    b = SPDR;
+    if (dst) *dst++ = b;
+#else  // OPTIMIZE_HARDWARE_SPI
+    for (uint16_t i = 0; i < n; i++) {
+      b = spiRec();
+      if (dst) *dst++ = b;
+    }
+#endif  // OPTIMIZE_HARDWARE_SPI
+
+    offset_ += n;
+    count -= n;
+    if (offset_ >= 512) {
+      // skip crc
+      spiRec();
+      spiRec();
+    }
+  }
+  return true;
+
+ fail:
+  inMultiple_ = 0;
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
+/** End a read multiple blocks sequence.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::readStop(void) {
+  inMultiple_ = 0;
+  if (cardCommand(CMD12, 0)) {
+    error(SD_CARD_ERROR_CMD12);
+    goto fail;
+  }
+  if (!waitNotBusy(SD_READ_TIMEOUT)) goto fail;
+  chipSelectHigh();
+  return true;
+
+ fail:
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
 /** read CID or CSR register */
 uint8_t Sd2Card::readRegister(uint8_t cmd, void* buf) {
   uint8_t* dst = reinterpret_cast<uint8_t*>(buf);
@@ -136,6 +136,12 @@ uint8_t const SD_CARD_ERROR_WRITE_PROGRAMMING = 0X14;
 uint8_t const SD_CARD_ERROR_WRITE_TIMEOUT = 0X15;
 /** incorrect rate selected */
 uint8_t const SD_CARD_ERROR_SCK_RATE = 0X16;
+/** card returned an error response for CMD18 (read multiple block) */
+uint8_t const SD_CARD_ERROR_CMD18 = 0X17;
+/** card returned an error response for CMD12 (stop transmission) */
+uint8_t const SD_CARD_ERROR_CMD12 = 0X18;
+/** card returned an error response for ACMD13 (read SD status) */
+uint8_t const SD_CARD_ERROR_ACMD13 = 0X19;
 //------------------------------------------------------------------------------
 // card types
 /** Standard capacity V1 SD card */
@@ -152,7 +158,9 @@ uint8_t const SD_CARD_TYPE_SDHC = 3;
 class Sd2Card {
  public:
   /** Construct an instance of Sd2Card. */
-  Sd2Card(void) : errorCode_(0), inBlock_(0), partialBlockRead_(0), type_(0) {}
+  Sd2Card(void) : errorCode_(0), inBlock_(0), inMultiple_(0),
+    partialBlockRead_(0), type_(0) {}
+  uint32_t allocationUnitSize(void);
   uint32_t cardSize(void);
   uint8_t erase(uint32_t firstBlock, uint32_t lastBlock);
   uint8_t eraseSingleBlockEnable(void);
@@ -198,6 +206,9 @@ class Sd2Card {
     return readRegister(CMD9, csd);
   }
   void readEnd(void);
+  uint8_t readStart(uint32_t blockNumber);
+  uint8_t readNext(uint8_t* dst, uint16_t count);
+  uint8_t readStop(void);
   uint8_t setSckRate(uint8_t sckRateID);
   /** Return the card type: SD V1, SD V2 or SDHC */
   uint8_t type(void) const {return type_;}
@@ -224,6 +235,7 @@ class Sd2Card {
   uint8_t chipSelectPin_;
   uint8_t errorCode_;
   uint8_t inBlock_;
+  uint8_t inMultiple_;
   uint16_t offset_;
   uint8_t partialBlockRead_;
   uint8_t status_;
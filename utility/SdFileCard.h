@@ -0,0 +1,219 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * A block device for host builds backed by a card image or a raw device,
+ * providing the parts of Sd2Card's interface SDHash uses.
+ *
+ * open() the image before calling SDHash.begin().
+ */
+#ifndef SdFileCard_h
+#define SdFileCard_h
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define kSdFileCardBlockSize 512
+
+/** the image isn't open */
+uint8_t const SD_FILE_CARD_ERROR_CLOSED = 0X01;
+/** read from the image failed or hit its end */
+uint8_t const SD_FILE_CARD_ERROR_READ = 0X02;
+/** write to the image failed */
+uint8_t const SD_FILE_CARD_ERROR_WRITE = 0X03;
+/** block or offset outside of the image */
+uint8_t const SD_FILE_CARD_ERROR_RANGE = 0X04;
+/** read or write call outside of a multiple block sequence */
+uint8_t const SD_FILE_CARD_ERROR_SEQUENCE = 0X05;
+
+class SdFileCard {
+	public:
+		SdFileCard(): _fd(-1), _blocks(0), _errorCode(0), _inWrite(0), _inRead(0) {}
+		~SdFileCard() { close(); }
+
+		/**
+		 * Opens the image at path. If blocks isn't 0 the image is
+		 * created or extended to hold that many blocks, otherwise its
+		 * size is taken from the existing file.
+		 */
+		uint8_t open(const char *path, uint32_t blocks = 0) {
+			close();
+			_fd = ::open(path, O_RDWR | (blocks?O_CREAT:0), 0644);
+			if (_fd < 0) return error(SD_FILE_CARD_ERROR_CLOSED);
+
+			struct stat st;
+			if (fstat(_fd, &st)) return error(SD_FILE_CARD_ERROR_CLOSED);
+
+			if (blocks && (uint64_t)st.st_size < (uint64_t)blocks * kSdFileCardBlockSize) {
+				if (ftruncate(_fd, (off_t)blocks * kSdFileCardBlockSize)) return error(SD_FILE_CARD_ERROR_WRITE);
+			} else if (!blocks) {
+				blocks = st.st_size / kSdFileCardBlockSize;
+			}
+			_blocks = blocks;
+			return true;
+		}
+
+		void close() {
+			if (_fd >= 0) ::close(_fd);
+			_fd = -1;
+			_blocks = 0;
+		}
+
+		uint8_t init() { _errorCode = 0; return _fd >= 0 ? true : error(SD_FILE_CARD_ERROR_CLOSED); }
+		uint8_t init(uint8_t sckRateID) { (void)sckRateID; return init(); }
+		uint32_t cardSize() { return _blocks; }
+		// images have no flash geometry of their own
+		uint32_t allocationUnitSize() { return 0; }
+		uint8_t errorCode() const { return _errorCode; }
+		uint8_t setSckRate(uint8_t sckRateID) { return sckRateID <= 6; }
+		void partialBlockRead(uint8_t value) { (void)value; }
+		void readEnd() {}
+
+		uint8_t readBlock(uint32_t block, uint8_t* dst) {
+			return readData(block, 0, kSdFileCardBlockSize, dst);
+		}
+
+		uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+			if (count == 0) return true;
+			if (block >= _blocks || offset + count > kSdFileCardBlockSize) return error(SD_FILE_CARD_ERROR_RANGE);
+			if (pread(_fd, dst, count, (off_t)block * kSdFileCardBlockSize + offset) != count) {
+				return error(SD_FILE_CARD_ERROR_READ);
+			}
+			return true;
+		}
+
+		uint8_t readStart(uint32_t blockNumber) {
+			_block = blockNumber;
+			_offset = 0;
+			_inRead = 1;
+			return true;
+		}
+
+		uint8_t readNext(uint8_t* dst, uint16_t count) {
+			if (!_inRead) return error(SD_FILE_CARD_ERROR_SEQUENCE);
+			while (count) {
+				uint16_t n = kSdFileCardBlockSize - _offset;
+				if (n > count) n = count;
+				if (dst) {
+					if (!readData(_block, _offset, n, dst)) return false;
+					dst += n;
+				} else if (_block >= _blocks) return error(SD_FILE_CARD_ERROR_RANGE);
+
+				_offset += n;
+				count -= n;
+				if (_offset == kSdFileCardBlockSize) {
+					_offset = 0;
+					_block += 1;
+				}
+			}
+			return true;
+		}
+
+		uint8_t readStop() {
+			_inRead = 0;
+			return true;
+		}
+
+		uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src, uint16_t size) {
+			if (blockNumber >= _blocks || size > kSdFileCardBlockSize) return error(SD_FILE_CARD_ERROR_RANGE);
+			memcpy(_buf, src, size);
+			memset(_buf + size, 0, kSdFileCardBlockSize - size);
+			return flush(blockNumber);
+		}
+
+		uint8_t writeStart(uint32_t blockNumber, uint32_t eraseCount) {
+			(void)eraseCount;
+			_block = blockNumber;
+			_offset = 0;
+			_inWrite = 1;
+			return true;
+		}
+
+		/**
+		 * Same as Sd2Card::writeData, len + offset == 512 completes the
+		 * current block
+		 */
+		uint8_t writeData(const uint8_t* src, uint16_t len, uint16_t offset) {
+			// the position in the block is kept here, Sd2Card only uses
+			// offset to tell when a block starts
+			(void)offset;
+			if (!_inWrite) return error(SD_FILE_CARD_ERROR_SEQUENCE);
+			if (_offset + len > kSdFileCardBlockSize) return error(SD_FILE_CARD_ERROR_RANGE);
+			if (src) memcpy(_buf + _offset, src, len);
+			else memset(_buf + _offset, 0, len);
+			_offset += len;
+
+			if (_offset == kSdFileCardBlockSize) {
+				if (!flush(_block)) return false;
+				_block += 1;
+				_offset = 0;
+			}
+			return true;
+		}
+
+		bool writeDataPadding(uint16_t paddingLength) {
+			return writeData(NULL, paddingLength, kSdFileCardBlockSize - paddingLength);
+		}
+
+		/** Same as Sd2Card::erase, erased blocks read as zeros */
+		uint8_t erase(uint32_t firstBlock, uint32_t lastBlock) {
+			if (firstBlock > lastBlock || lastBlock >= _blocks) return error(SD_FILE_CARD_ERROR_RANGE);
+			memset(_buf, 0, kSdFileCardBlockSize);
+			for (uint32_t block = firstBlock; block <= lastBlock; ++block) {
+				if (!flush(block)) return false;
+			}
+			return true;
+		}
+
+		uint8_t writeStop() {
+			_inWrite = 0;
+			// an unfinished block is dropped, like the card would
+			return _offset == 0 ? true : error(SD_FILE_CARD_ERROR_SEQUENCE);
+		}
+
+	private:
+		int _fd;
+		uint32_t _blocks;
+		uint8_t _errorCode;
+		uint8_t _inWrite;
+		uint8_t _inRead;
+		uint32_t _block;
+		uint16_t _offset;
+		uint8_t _buf[kSdFileCardBlockSize];
+
+		uint8_t error(uint8_t code) {
+			_errorCode = code;
+			return false;
+		}
+
+		uint8_t flush(uint32_t blockNumber) {
+			if (blockNumber >= _blocks) return error(SD_FILE_CARD_ERROR_RANGE);
+			if (pwrite(_fd, _buf, kSdFileCardBlockSize, (off_t)blockNumber * kSdFileCardBlockSize) != kSdFileCardBlockSize) {
+				return error(SD_FILE_CARD_ERROR_WRITE);
+			}
+			return true;
+		}
+};
+
+#endif
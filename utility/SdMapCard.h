@@ -0,0 +1,221 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * A block device for host tools that maps a card image into memory,
+ * providing the parts of Sd2Card's interface SDHash uses. The mapping is
+ * private, so writes are seen by this process only and never reach the
+ * image.
+ *
+ * Several cards can share() one mapping, e.g. one per thread, since reads
+ * don't change the mapping. Select it with
+ *
+ *	-DSDHASH_BLOCK_DEVICE=SdMapCard -DSDHASH_BLOCK_DEVICE_HEADER='"utility/SdMapCard.h"'
+ */
+#ifndef SdMapCard_h
+#define SdMapCard_h
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define kSdMapCardBlockSize 512
+
+/** the image isn't mapped */
+uint8_t const SD_MAP_CARD_ERROR_CLOSED = 0X01;
+/** block or offset outside of the image */
+uint8_t const SD_MAP_CARD_ERROR_RANGE = 0X04;
+/** read or write call outside of a multiple block sequence */
+uint8_t const SD_MAP_CARD_ERROR_SEQUENCE = 0X05;
+
+class SdMapCard {
+	public:
+		SdMapCard(): _base(NULL), _blocks(0), _owner(false), _errorCode(0), _inWrite(0), _inRead(0) {}
+		~SdMapCard() { close(); }
+
+		/** Maps the image at path */
+		uint8_t open(const char *path) {
+			close();
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0) return error(SD_MAP_CARD_ERROR_CLOSED);
+
+			struct stat st;
+			if (fstat(fd, &st) || st.st_size < kSdMapCardBlockSize) {
+				::close(fd);
+				return error(SD_MAP_CARD_ERROR_CLOSED);
+			}
+
+			void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (base == MAP_FAILED) return error(SD_MAP_CARD_ERROR_CLOSED);
+
+			_base = (uint8_t*)base;
+			_blocks = st.st_size / kSdMapCardBlockSize;
+			_owner = true;
+			return true;
+		}
+
+		/** Uses the mapping of another card, which has to outlive this one */
+		void share(const SdMapCard &other) {
+			close();
+			_base = other._base;
+			_blocks = other._blocks;
+		}
+
+		void close() {
+			if (_owner) munmap(_base, (size_t)_blocks * kSdMapCardBlockSize);
+			_base = NULL;
+			_blocks = 0;
+			_owner = false;
+		}
+
+		/** the block's data, for reading without copying */
+		const uint8_t *block(uint32_t block) const {
+			return block < _blocks ? _base + (size_t)block * kSdMapCardBlockSize : NULL;
+		}
+
+		uint8_t init() { _errorCode = 0; return _base ? true : error(SD_MAP_CARD_ERROR_CLOSED); }
+		uint8_t init(uint8_t sckRateID) { (void)sckRateID; return init(); }
+		uint32_t cardSize() { return _blocks; }
+		// images have no flash geometry of their own
+		uint32_t allocationUnitSize() { return 0; }
+		uint8_t errorCode() const { return _errorCode; }
+		uint8_t setSckRate(uint8_t sckRateID) { return sckRateID <= 6; }
+		void partialBlockRead(uint8_t value) { (void)value; }
+		void readEnd() {}
+
+		uint8_t readBlock(uint32_t block, uint8_t* dst) {
+			return readData(block, 0, kSdMapCardBlockSize, dst);
+		}
+
+		uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+			if (count == 0) return true;
+			if (block >= _blocks || offset + count > kSdMapCardBlockSize) return error(SD_MAP_CARD_ERROR_RANGE);
+			memcpy(dst, _base + (size_t)block * kSdMapCardBlockSize + offset, count);
+			return true;
+		}
+
+		uint8_t readStart(uint32_t blockNumber) {
+			_block = blockNumber;
+			_offset = 0;
+			_inRead = 1;
+			return true;
+		}
+
+		uint8_t readNext(uint8_t* dst, uint16_t count) {
+			if (!_inRead) return error(SD_MAP_CARD_ERROR_SEQUENCE);
+			while (count) {
+				uint16_t n = kSdMapCardBlockSize - _offset;
+				if (n > count) n = count;
+				if (dst) {
+					if (!readData(_block, _offset, n, dst)) return false;
+					dst += n;
+				} else if (_block >= _blocks) return error(SD_MAP_CARD_ERROR_RANGE);
+
+				_offset += n;
+				count -= n;
+				if (_offset == kSdMapCardBlockSize) {
+					_offset = 0;
+					_block += 1;
+				}
+			}
+			return true;
+		}
+
+		uint8_t readStop() {
+			_inRead = 0;
+			return true;
+		}
+
+		uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src, uint16_t size) {
+			if (blockNumber >= _blocks || size > kSdMapCardBlockSize) return error(SD_MAP_CARD_ERROR_RANGE);
+			uint8_t *dst = _base + (size_t)blockNumber * kSdMapCardBlockSize;
+			memcpy(dst, src, size);
+			memset(dst + size, 0, kSdMapCardBlockSize - size);
+			return true;
+		}
+
+		uint8_t writeStart(uint32_t blockNumber, uint32_t eraseCount) {
+			(void)eraseCount;
+			_block = blockNumber;
+			_offset = 0;
+			_inWrite = 1;
+			return true;
+		}
+
+		/**
+		 * Same as Sd2Card::writeData, len + offset == 512 completes the
+		 * current block
+		 */
+		uint8_t writeData(const uint8_t* src, uint16_t len, uint16_t offset) {
+			// the position in the block is kept here, Sd2Card only uses
+			// offset to tell when a block starts
+			(void)offset;
+			if (!_inWrite) return error(SD_MAP_CARD_ERROR_SEQUENCE);
+			if (_block >= _blocks || _offset + len > kSdMapCardBlockSize) return error(SD_MAP_CARD_ERROR_RANGE);
+			uint8_t *dst = _base + (size_t)_block * kSdMapCardBlockSize + _offset;
+			if (src) memcpy(dst, src, len);
+			else memset(dst, 0, len);
+			_offset += len;
+
+			if (_offset == kSdMapCardBlockSize) {
+				_block += 1;
+				_offset = 0;
+			}
+			return true;
+		}
+
+		bool writeDataPadding(uint16_t paddingLength) {
+			return writeData(NULL, paddingLength, kSdMapCardBlockSize - paddingLength);
+		}
+
+		/** Same as Sd2Card::erase, erased blocks read as zeros */
+		uint8_t erase(uint32_t firstBlock, uint32_t lastBlock) {
+			if (firstBlock > lastBlock || lastBlock >= _blocks) return error(SD_MAP_CARD_ERROR_RANGE);
+			memset(_base + (size_t)firstBlock * kSdMapCardBlockSize, 0, (size_t)(lastBlock - firstBlock + 1) * kSdMapCardBlockSize);
+			return true;
+		}
+
+		uint8_t writeStop() {
+			_inWrite = 0;
+			return _offset == 0 ? true : error(SD_MAP_CARD_ERROR_SEQUENCE);
+		}
+
+	private:
+		uint8_t *_base;
+		uint32_t _blocks;
+		bool _owner;
+		uint8_t _errorCode;
+		uint8_t _inWrite;
+		uint8_t _inRead;
+		uint32_t _block;
+		uint16_t _offset;
+
+		uint8_t error(uint8_t code) {
+			_errorCode = code;
+			return false;
+		}
+};
+
+#endif
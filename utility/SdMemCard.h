@@ -0,0 +1,229 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * A block device for host tools held entirely in memory, providing the
+ * parts of Sd2Card's interface SDHash uses. Only blocks that were written
+ * take up memory, everything else reads as zeros.
+ *
+ * create() the card before calling SDHash.begin(), and save() it to an
+ * image once done. Select it with
+ *
+ *	-DSDHASH_BLOCK_DEVICE=SdMemCard -DSDHASH_BLOCK_DEVICE_HEADER='"utility/SdMemCard.h"'
+ */
+#ifndef SdMemCard_h
+#define SdMemCard_h
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <map>
+
+#define kSdMemCardBlockSize 512
+
+/** the card wasn't created */
+uint8_t const SD_MEM_CARD_ERROR_CLOSED = 0X01;
+/** block or offset outside of the card */
+uint8_t const SD_MEM_CARD_ERROR_RANGE = 0X04;
+/** read or write call outside of a multiple block sequence */
+uint8_t const SD_MEM_CARD_ERROR_SEQUENCE = 0X05;
+/** saving the image failed */
+uint8_t const SD_MEM_CARD_ERROR_SAVE = 0X06;
+
+class SdMemCard {
+	public:
+		struct Block {
+			uint8_t data[kSdMemCardBlockSize];
+		};
+		typedef std::map<uint32_t, Block> BlockMap;
+
+		SdMemCard(): _blocks(0), _errorCode(0), _inWrite(0), _inRead(0) {}
+
+		/**
+		 * Creates an empty card of the given number of blocks,
+		 * dropping whatever was on it
+		 */
+		uint8_t create(uint32_t blocks) {
+			_data.clear();
+			_blocks = blocks;
+			return true;
+		}
+
+		/**
+		 * Writes the card to an image at path in block order, in a
+		 * single pass. Blocks that were never written are left as
+		 * holes, which read as zeros.
+		 */
+		uint8_t save(const char *path) {
+			int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) return error(SD_MEM_CARD_ERROR_SAVE);
+
+			for (BlockMap::const_iterator it = _data.begin(); it != _data.end(); ++it) {
+				if (pwrite(fd, it->second.data, kSdMemCardBlockSize, (off_t)it->first * kSdMemCardBlockSize) != kSdMemCardBlockSize) {
+					::close(fd);
+					return error(SD_MEM_CARD_ERROR_SAVE);
+				}
+			}
+			bool ok = !ftruncate(fd, (off_t)_blocks * kSdMemCardBlockSize);
+			ok = !::close(fd) && ok;
+			return ok ? true : error(SD_MEM_CARD_ERROR_SAVE);
+		}
+
+		/** blocks that were written, in block order */
+		const BlockMap &blocks() const { return _data; }
+
+		uint8_t init() { _errorCode = 0; return _blocks ? true : error(SD_MEM_CARD_ERROR_CLOSED); }
+		uint8_t init(uint8_t sckRateID) { (void)sckRateID; return init(); }
+		uint32_t cardSize() { return _blocks; }
+		// images have no flash geometry of their own
+		uint32_t allocationUnitSize() { return 0; }
+		uint8_t errorCode() const { return _errorCode; }
+		uint8_t setSckRate(uint8_t sckRateID) { return sckRateID <= 6; }
+		void partialBlockRead(uint8_t value) { (void)value; }
+		void readEnd() {}
+
+		uint8_t readBlock(uint32_t block, uint8_t* dst) {
+			return readData(block, 0, kSdMemCardBlockSize, dst);
+		}
+
+		uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+			if (count == 0) return true;
+			if (block >= _blocks || offset + count > kSdMemCardBlockSize) return error(SD_MEM_CARD_ERROR_RANGE);
+
+			BlockMap::const_iterator it = _data.find(block);
+			if (it == _data.end()) memset(dst, 0, count);
+			else memcpy(dst, it->second.data + offset, count);
+			return true;
+		}
+
+		uint8_t readStart(uint32_t blockNumber) {
+			_block = blockNumber;
+			_offset = 0;
+			_inRead = 1;
+			return true;
+		}
+
+		uint8_t readNext(uint8_t* dst, uint16_t count) {
+			if (!_inRead) return error(SD_MEM_CARD_ERROR_SEQUENCE);
+			while (count) {
+				uint16_t n = kSdMemCardBlockSize - _offset;
+				if (n > count) n = count;
+				if (dst) {
+					if (!readData(_block, _offset, n, dst)) return false;
+					dst += n;
+				} else if (_block >= _blocks) return error(SD_MEM_CARD_ERROR_RANGE);
+
+				_offset += n;
+				count -= n;
+				if (_offset == kSdMemCardBlockSize) {
+					_offset = 0;
+					_block += 1;
+				}
+			}
+			return true;
+		}
+
+		uint8_t readStop() {
+			_inRead = 0;
+			return true;
+		}
+
+		uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src, uint16_t size) {
+			if (blockNumber >= _blocks || size > kSdMemCardBlockSize) return error(SD_MEM_CARD_ERROR_RANGE);
+			memcpy(_buf, src, size);
+			memset(_buf + size, 0, kSdMemCardBlockSize - size);
+			return flush(blockNumber);
+		}
+
+		uint8_t writeStart(uint32_t blockNumber, uint32_t eraseCount) {
+			(void)eraseCount;
+			_block = blockNumber;
+			_offset = 0;
+			_inWrite = 1;
+			return true;
+		}
+
+		/**
+		 * Same as Sd2Card::writeData, len + offset == 512 completes the
+		 * current block
+		 */
+		uint8_t writeData(const uint8_t* src, uint16_t len, uint16_t offset) {
+			// the position in the block is kept here, Sd2Card only uses
+			// offset to tell when a block starts
+			(void)offset;
+			if (!_inWrite) return error(SD_MEM_CARD_ERROR_SEQUENCE);
+			if (_offset + len > kSdMemCardBlockSize) return error(SD_MEM_CARD_ERROR_RANGE);
+			if (src) memcpy(_buf + _offset, src, len);
+			else memset(_buf + _offset, 0, len);
+			_offset += len;
+
+			if (_offset == kSdMemCardBlockSize) {
+				if (!flush(_block)) return false;
+				_block += 1;
+				_offset = 0;
+			}
+			return true;
+		}
+
+		bool writeDataPadding(uint16_t paddingLength) {
+			return writeData(NULL, paddingLength, kSdMemCardBlockSize - paddingLength);
+		}
+
+		/**
+		 * Same as Sd2Card::erase, erased blocks become holes again and
+		 * read as zeros
+		 */
+		uint8_t erase(uint32_t firstBlock, uint32_t lastBlock) {
+			if (firstBlock > lastBlock || lastBlock >= _blocks) return error(SD_MEM_CARD_ERROR_RANGE);
+			_data.erase(_data.lower_bound(firstBlock), _data.upper_bound(lastBlock));
+			return true;
+		}
+
+		uint8_t writeStop() {
+			_inWrite = 0;
+			// an unfinished block is dropped, like the card would
+			return _offset == 0 ? true : error(SD_MEM_CARD_ERROR_SEQUENCE);
+		}
+
+	private:
+		BlockMap _data;
+		uint32_t _blocks;
+		uint8_t _errorCode;
+		uint8_t _inWrite;
+		uint8_t _inRead;
+		uint32_t _block;
+		uint16_t _offset;
+		uint8_t _buf[kSdMemCardBlockSize];
+
+		uint8_t error(uint8_t code) {
+			_errorCode = code;
+			return false;
+		}
+
+		uint8_t flush(uint32_t blockNumber) {
+			if (blockNumber >= _blocks) return error(SD_MEM_CARD_ERROR_RANGE);
+			memcpy(_data[blockNumber].data, _buf, kSdMemCardBlockSize);
+			return true;
+		}
+};
+
+#endif
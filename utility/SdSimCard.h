@@ -0,0 +1,369 @@
+/*
+    SDHash - small adhoc filesystem for Arduinos
+    Copyright (C) 2011  Shuning Bian
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+	Contact: freespace@gmail.com
+*/
+
+/**
+ * An SdMemCard that also keeps a simulated clock of how long the same
+ * calls would take on a real card behind an AVR's SPI port. It follows
+ * the command sequences of Sd2Card: command overhead, SPI bytes at the
+ * current setSckRate, read access time, programming time after each
+ * block written, stalls for switching erase blocks and random garbage
+ * collection while the card is busy. Multiple block transfers only pay
+ * the access and command costs once, and pre-erased blocks program
+ * faster.
+ *
+ * The defaults roughly match a class 4 card on a 16MHz AVR, tune timing
+ * to match a particular card. Nothing is slept, elapsedMicros() reports
+ * the simulated time. writeHeat() counts the writes to each block, to find
+ * the blocks that will wear out first. Select it with
+ *
+ *	-DSDHASH_BLOCK_DEVICE=SdSimCard -DSDHASH_BLOCK_DEVICE_HEADER='"utility/SdSimCard.h"'
+ */
+#ifndef SdSimCard_h
+#define SdSimCard_h
+
+#include <stdio.h>
+
+#include <map>
+
+#include "SdMemCard.h"
+
+// erase blocks the card keeps open for writing at the same time
+#define kSdSimCardMaxOpenEraseBlocks 4
+
+typedef struct {
+	// clock of the AVR driving the SPI port
+	uint32_t cpuHz;
+	// cycles the SPI loops spend per byte on top of shifting it out
+	uint8_t byteOverheadCycles;
+	// chip select, CRC and response polling of every command
+	uint16_t commandUs;
+	// until the first data token of a read
+	uint16_t readAccessUs;
+	// until each further data token of a multiple block read
+	uint16_t readNextUs;
+	// programming a block written with writeBlock
+	uint16_t writeProgramUs;
+	// programming a block of a multiple block write, and one that was
+	// pre-erased by writeStart
+	uint16_t multiWriteProgramUs;
+	uint16_t preErasedProgramUs;
+	// busy after the stop token of a multiple block write
+	uint16_t stopUs;
+	// blocks per erase block, and how many of them can be open
+	uint32_t eraseBlockBlocks;
+	uint8_t openEraseBlocks;
+	// writing into an erase block that isn't open
+	uint16_t eraseBlockSwitchUs;
+	// chance per block programmed, in 1/1000, of a garbage collection
+	// stall, and its length
+	uint16_t gcPermille;
+	uint32_t gcStallUs;
+} SdSimTiming;
+
+typedef struct {
+	uint32_t commands;
+	uint32_t blocksRead;
+	uint32_t blocksWritten;
+	uint64_t spiBytes;
+	uint32_t eraseBlockSwitches;
+	uint32_t gcStalls;
+} SdSimStats;
+
+class SdSimCard : public SdMemCard {
+	public:
+		SdSimTiming timing;
+
+		SdSimCard(): _sckRate(0), _partial(0), _inBlock(0), _rng(1) {
+			timing.cpuHz = 16000000UL;
+			timing.byteOverheadCycles = 3;
+			timing.commandUs = 10;
+			timing.readAccessUs = 300;
+			timing.readNextUs = 20;
+			timing.writeProgramUs = 800;
+			timing.multiWriteProgramUs = 250;
+			timing.preErasedProgramUs = 150;
+			timing.stopUs = 500;
+			timing.eraseBlockBlocks = 8192;
+			timing.openEraseBlocks = 2;
+			timing.eraseBlockSwitchUs = 3000;
+			timing.gcPermille = 5;
+			timing.gcStallUs = 40000;
+			resetClock();
+		}
+
+		/** simulated time since creation or the last resetClock() */
+		uint64_t elapsedMicros() const { return _now / 1000; }
+		const SdSimStats *stats() const { return &_stats; }
+
+		void resetClock() {
+			_now = _busyUntil = 0;
+			memset(&_stats, 0, sizeof _stats);
+			memset(_open, 0xff, sizeof _open);
+			_heat.clear();
+		}
+
+		/** times each block was programmed since the last resetClock() */
+		const std::map<uint32_t, uint32_t> &writeHeat() const { return _heat; }
+
+		/**
+		 * Writes the heat map to path as "block,writes" lines, hottest
+		 * first, for plotting. Returns false if path can't be written.
+		 */
+		bool saveHeat(const char *path) const {
+			FILE *f = fopen(path, "w");
+			if (!f) return false;
+			std::multimap<uint32_t, uint32_t> byWrites;
+			for (std::map<uint32_t, uint32_t>::const_iterator it = _heat.begin(); it != _heat.end(); ++it) {
+				byWrites.insert(std::make_pair(it->second, it->first));
+			}
+			fprintf(f, "block,writes\n");
+			for (std::multimap<uint32_t, uint32_t>::const_reverse_iterator it = byWrites.rbegin(); it != byWrites.rend(); ++it) {
+				fprintf(f, "%lu,%lu\n", (unsigned long)it->second, (unsigned long)it->first);
+			}
+			return fclose(f) == 0;
+		}
+
+		/** seeds the garbage collection stalls, so runs can be repeated */
+		void seed(uint32_t value) { _rng = value?value:1; }
+
+		uint8_t init() { _inBlock = 0; return SdMemCard::init(); }
+		uint8_t init(uint8_t sckRateID) { return setSckRate(sckRateID) && init(); }
+
+		uint32_t allocationUnitSize() { return timing.eraseBlockBlocks; }
+
+		uint8_t setSckRate(uint8_t sckRateID) {
+			if (sckRateID > 6) return false;
+			_sckRate = sckRateID;
+			return true;
+		}
+
+		void partialBlockRead(uint8_t value) {
+			readEnd();
+			_partial = value;
+		}
+
+		void readEnd() {
+			if (!_inBlock) return;
+			// the rest of the block and its crc
+			spi(kSdMemCardBlockSize - _offset + 2);
+			_inBlock = 0;
+		}
+
+		uint8_t readBlock(uint32_t block, uint8_t* dst) {
+			return readData(block, 0, kSdMemCardBlockSize, dst);
+		}
+
+		uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+			if (count == 0) return true;
+			if (!_inBlock || block != _block || offset < _offset) {
+				readEnd();
+				command();
+				wait(timing.readAccessUs);
+				spi(1);
+				_block = block;
+				_offset = 0;
+				_inBlock = 1;
+				_stats.blocksRead += 1;
+			}
+			spi(offset + count - _offset);
+			_offset = offset + count;
+			if (!_partial || _offset >= kSdMemCardBlockSize) readEnd();
+
+			return SdMemCard::readData(block, offset, count, dst);
+		}
+
+		uint8_t readStart(uint32_t blockNumber) {
+			readEnd();
+			command();
+			_offset = kSdMemCardBlockSize;
+			_firstToken = 1;
+			return SdMemCard::readStart(blockNumber);
+		}
+
+		uint8_t readNext(uint8_t* dst, uint16_t count) {
+			uint16_t left = count;
+			while (left) {
+				if (_offset >= kSdMemCardBlockSize) {
+					wait(_firstToken?timing.readAccessUs:timing.readNextUs);
+					spi(1);
+					_firstToken = 0;
+					_offset = 0;
+					_stats.blocksRead += 1;
+				}
+				uint16_t n = kSdMemCardBlockSize - _offset;
+				if (n > left) n = left;
+				spi(n);
+				_offset += n;
+				left -= n;
+				if (_offset >= kSdMemCardBlockSize) spi(2);
+			}
+			return SdMemCard::readNext(dst, count);
+		}
+
+		uint8_t readStop() {
+			command();
+			waitNotBusy();
+			return SdMemCard::readStop();
+		}
+
+		uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src, uint16_t size) {
+			readEnd();
+			command();
+			// token, data, crc and data response
+			spi(1 + kSdMemCardBlockSize + 2 + 1);
+			program(blockNumber, timing.writeProgramUs);
+			waitNotBusy();
+			// CMD13 and the second byte of its response
+			command();
+			spi(1);
+			return SdMemCard::writeBlock(blockNumber, src, size);
+		}
+
+		uint8_t writeStart(uint32_t blockNumber, uint32_t eraseCount) {
+			readEnd();
+			// ACMD23 is CMD55 followed by the command itself
+			if (eraseCount > 1) {
+				command();
+				command();
+			}
+			command();
+			_block = blockNumber;
+			_preErased = eraseCount > 1?eraseCount:0;
+			return SdMemCard::writeStart(blockNumber, eraseCount);
+		}
+
+		uint8_t writeData(const uint8_t* src, uint16_t len, uint16_t offset) {
+			if (offset == 0) {
+				waitNotBusy();
+				spi(1);
+			}
+			spi(len);
+			if (offset + len >= kSdMemCardBlockSize) {
+				spi(3);
+				program(_block, _preErased?timing.preErasedProgramUs:timing.multiWriteProgramUs);
+				if (_preErased) _preErased -= 1;
+				_block += 1;
+			}
+			return SdMemCard::writeData(src, len, offset);
+		}
+
+		bool writeDataPadding(uint16_t paddingLength) {
+			return writeData(NULL, paddingLength, kSdMemCardBlockSize - paddingLength);
+		}
+
+		uint8_t writeStop() {
+			waitNotBusy();
+			spi(1);
+			_busyUntil = _now + timing.stopUs * 1000ULL;
+			waitNotBusy();
+			return SdMemCard::writeStop();
+		}
+
+		uint8_t erase(uint32_t firstBlock, uint32_t lastBlock) {
+			readEnd();
+			// CMD9 and the CSD for eraseSingleBlockEnable, then CMD32,
+			// CMD33 and CMD38, busy about as long as switching to each
+			// erase block takes
+			command();
+			spi(1 + 16 + 2);
+			command();
+			command();
+			command();
+			if (lastBlock >= firstBlock) {
+				uint32_t units = lastBlock / timing.eraseBlockBlocks - firstBlock / timing.eraseBlockBlocks + 1;
+				_busyUntil = _now + (uint64_t)units * timing.eraseBlockSwitchUs * 1000ULL;
+			}
+			waitNotBusy();
+			return SdMemCard::erase(firstBlock, lastBlock);
+		}
+
+	private:
+		uint64_t _now;
+		// when the card stops programming
+		uint64_t _busyUntil;
+		SdSimStats _stats;
+		uint8_t _sckRate;
+		uint8_t _partial;
+		uint8_t _inBlock;
+		uint8_t _firstToken;
+		uint32_t _block;
+		uint16_t _offset;
+		uint32_t _preErased;
+		// most recently written erase blocks first
+		uint32_t _open[kSdSimCardMaxOpenEraseBlocks];
+		uint32_t _rng;
+		std::map<uint32_t, uint32_t> _heat;
+
+		void wait(uint32_t us) { _now += us * 1000ULL; }
+
+		void spi(uint32_t bytes) {
+			// sckRateID n divides the cpu clock by 2 << n
+			uint32_t cycles = 8 * (2UL << _sckRate) + timing.byteOverheadCycles;
+			_now += bytes * cycles * 1000000000ULL / timing.cpuHz;
+			_stats.spiBytes += bytes;
+		}
+
+		// Sd2Card polls the card with 0xff until it stops being busy
+		void waitNotBusy() {
+			if (_busyUntil > _now) _now = _busyUntil;
+			spi(1);
+		}
+
+		void command() {
+			waitNotBusy();
+			// command, argument, crc and a byte until the response
+			spi(7);
+			wait(timing.commandUs);
+			_stats.commands += 1;
+		}
+
+		void program(uint32_t block, uint16_t us) {
+			uint64_t busy = us;
+
+			uint32_t unit = block / timing.eraseBlockBlocks;
+			uint8_t open = timing.openEraseBlocks < kSdSimCardMaxOpenEraseBlocks?timing.openEraseBlocks:kSdSimCardMaxOpenEraseBlocks;
+			uint8_t idx = 0;
+			while (idx < open && _open[idx] != unit) ++idx;
+			if (idx == open) {
+				busy += timing.eraseBlockSwitchUs;
+				_stats.eraseBlockSwitches += 1;
+				if (open) idx = open - 1;
+			}
+			// move it to the front
+			for (; idx > 0; --idx) _open[idx] = _open[idx - 1];
+			_open[0] = unit;
+
+			// xorshift32
+			_rng ^= _rng << 13;
+			_rng ^= _rng >> 17;
+			_rng ^= _rng << 5;
+			if (_rng % 1000 < timing.gcPermille) {
+				busy += timing.gcStallUs;
+				_stats.gcStalls += 1;
+			}
+
+			_busyUntil = _now + busy * 1000;
+			_stats.blocksWritten += 1;
+			_heat[block] += 1;
+		}
+};
+
+#endif